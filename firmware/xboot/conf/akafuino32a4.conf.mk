@@ -109,6 +109,7 @@ ENABLE_LOCK_BITS = yes
 ENABLE_FUSE_BITS = yes
 ENABLE_FLASH_ERASE_WRITE = yes
 ENABLE_CRC_SUPPORT = yes
+ENABLE_BROADCAST_SUPPORT = no
 
 # API
 ENABLE_API = yes
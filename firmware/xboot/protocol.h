@@ -34,8 +34,6 @@
 #ifndef __PROTOCOL_H
 #define __PROTOCOL_H
 
-#include "xboot.h"
-
 // Defines
 
 // General Commands
@@ -90,6 +88,12 @@
 #define CMD_AUTONEG_START       '@'
 #define CMD_AUTONEG_DONE        '#'
 
+// Broadcast Programming Commands
+#define CMD_BROADCAST_START     'W'
+#define CMD_BROADCAST_END       'w'
+#define CMD_BROADCAST_SELECT    'X'
+#define CMD_BROADCAST_STATUS    'k'
+
 // Memory types for block access
 #define MEM_EEPROM              'E'
 #define MEM_FLASH               'F'
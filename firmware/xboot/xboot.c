@@ -59,6 +59,12 @@ unsigned char buffer[SPM_PAGESIZE];
 unsigned char protected;
 #endif // NEED_CODE_PROTECTION
 
+#ifdef ENABLE_BROADCAST_SUPPORT
+unsigned char broadcast_mode;
+unsigned int broadcast_blocks;
+unsigned char broadcast_errors;
+#endif // ENABLE_BROADCAST_SUPPORT
+
 // Main code
 int main(void)
 {
@@ -79,6 +85,10 @@ int main(void)
         
         comm_mode = MODE_UNDEF;
         
+        #ifdef ENABLE_BROADCAST_SUPPORT
+        broadcast_mode = BROADCAST_OFF;
+        #endif // ENABLE_BROADCAST_SUPPORT
+        
         #ifdef USE_INTERRUPTS
         rx_char_cnt = 0;
         tx_char_cnt = 0;
@@ -475,6 +485,12 @@ int main(void)
                 // Chip erase
                 else if (val == CMD_CHIP_ERASE)
                 {
+                        #ifdef ENABLE_BROADCAST_SUPPORT
+                        // another node is selected, leave memory alone
+                        if (broadcast_mode == BROADCAST_IDLE)
+                                continue;
+                        #endif // ENABLE_BROADCAST_SUPPORT
+                        
                         // Erase the application section
                         Flash_EraseApplicationSection();
                         // Wait for completion
@@ -518,8 +534,24 @@ int main(void)
                         i = get_2bytes();
                         // Memory type
                         val = get_char();
+                        #ifdef ENABLE_BROADCAST_SUPPORT
+                        // another node is selected, discard the data
+                        if (broadcast_mode == BROADCAST_IDLE)
+                                val = 0;
+                        #endif // ENABLE_BROADCAST_SUPPORT
                         // Load it
-                        send_char(BlockLoad(i, val, &address));
+                        val = BlockLoad(i, val, &address);
+                        #ifdef ENABLE_BROADCAST_SUPPORT
+                        // keep count for the status command
+                        if (broadcast_mode != BROADCAST_IDLE)
+                        {
+                                if (val == REPLY_ACK)
+                                        broadcast_blocks++;
+                                else
+                                        broadcast_errors++;
+                        }
+                        #endif // ENABLE_BROADCAST_SUPPORT
+                        send_char(val);
                 }
                 // Block read
                 else if (val == CMD_BLOCK_READ)
@@ -553,6 +585,11 @@ int main(void)
                 {
                         // get low byte
                         i = get_char();
+                        #ifdef ENABLE_BROADCAST_SUPPORT
+                        // another node is selected, leave memory alone
+                        if (broadcast_mode == BROADCAST_IDLE)
+                                continue;
+                        #endif // ENABLE_BROADCAST_SUPPORT
                         send_char(REPLY_ACK);
                 }
                 // Write program memory high byte
@@ -560,6 +597,14 @@ int main(void)
                 {
                         // get high byte; combine
                         i |= (get_char() << 8);
+                        #ifdef ENABLE_BROADCAST_SUPPORT
+                        // another node is selected, leave memory alone
+                        if (broadcast_mode == BROADCAST_IDLE)
+                        {
+                                address++;
+                                continue;
+                        }
+                        #endif // ENABLE_BROADCAST_SUPPORT
                         Flash_LoadFlashWord((address << 1), i);
                         address++;
                         send_char(REPLY_ACK);
@@ -567,6 +612,12 @@ int main(void)
                 // Write page
                 else if (val == CMD_WRITE_PAGE)
                 {
+                        #ifdef ENABLE_BROADCAST_SUPPORT
+                        // another node is selected, leave memory alone
+                        if (broadcast_mode == BROADCAST_IDLE)
+                                continue;
+                        #endif // ENABLE_BROADCAST_SUPPORT
+                        
                         if (address >= (APP_SECTION_SIZE>>1))
                         {
                                 // don't allow bootloader overwrite
@@ -583,7 +634,16 @@ int main(void)
                 // Write EEPROM memory
                 else if (val == CMD_WRITE_EEPROM_BYTE)
                 {
-                        EEPROM_write_byte(address, get_char());
+                        val = get_char();
+                        #ifdef ENABLE_BROADCAST_SUPPORT
+                        // another node is selected, leave memory alone
+                        if (broadcast_mode == BROADCAST_IDLE)
+                        {
+                                address++;
+                                continue;
+                        }
+                        #endif // ENABLE_BROADCAST_SUPPORT
+                        EEPROM_write_byte(address, val);
                         address++;
                 }
                 // Read EEPROM memory
@@ -605,7 +665,13 @@ int main(void)
                 // Write lockbits
                 else if (val == CMD_WRITE_LOCK_BITS)
                 {
-                        SP_WriteLockBits( get_char() );
+                        val = get_char();
+                        #ifdef ENABLE_BROADCAST_SUPPORT
+                        // another node is selected, leave memory alone
+                        if (broadcast_mode == BROADCAST_IDLE)
+                                continue;
+                        #endif // ENABLE_BROADCAST_SUPPORT
+                        SP_WriteLockBits(val);
                         send_char(REPLY_ACK);
                 }
                 // Read lockbits
@@ -643,6 +709,12 @@ int main(void)
                 // Exit bootloader
                 else if (val == CMD_EXIT_BOOTLOADER)
                 {
+                        #ifdef ENABLE_BROADCAST_SUPPORT
+                        // another node is selected, stay put
+                        if (broadcast_mode == BROADCAST_IDLE)
+                                continue;
+                        #endif // ENABLE_BROADCAST_SUPPORT
+                        
                         in_bootloader = 0;
                         send_char(REPLY_ACK);
                 }
@@ -732,6 +804,41 @@ int main(void)
                         send_char(crc & 0xff);
                 }
                 #endif // ENABLE_CRC_SUPPORT
+                #ifdef ENABLE_BROADCAST_SUPPORT
+                // Enter broadcast mode
+                else if (val == CMD_BROADCAST_START)
+                {
+                        // every node on the bus accepts the following
+                        // commands, but none of them reply
+                        broadcast_mode = BROADCAST_ALL;
+                        broadcast_blocks = 0;
+                        broadcast_errors = 0;
+                }
+                // Leave broadcast mode
+                else if (val == CMD_BROADCAST_END)
+                {
+                        // no reply, all nodes would answer at once
+                        broadcast_mode = BROADCAST_OFF;
+                }
+                // Select one node by ID
+                else if (val == CMD_BROADCAST_SELECT)
+                {
+                        if (get_2bytes() == get_node_id())
+                                broadcast_mode = BROADCAST_SELECTED;
+                        else
+                                broadcast_mode = BROADCAST_IDLE;
+                        
+                        // only the selected node actually replies
+                        send_char(REPLY_ACK);
+                }
+                // Report broadcast status
+                else if (val == CMD_BROADCAST_STATUS)
+                {
+                        send_char((broadcast_blocks >> 8) & 0xff);
+                        send_char(broadcast_blocks & 0xff);
+                        send_char(broadcast_errors);
+                }
+                #endif // ENABLE_BROADCAST_SUPPORT
                 #ifdef USE_I2C
                 #ifdef USE_I2C_ADDRESS_NEGOTIATION
                 // Enter autonegotiate mode
@@ -1082,6 +1189,12 @@ unsigned char __attribute__ ((noinline)) get_char(void)
 
 void __attribute__ ((noinline)) send_char(unsigned char c)
 {
+        #ifdef ENABLE_BROADCAST_SUPPORT
+        // stay quiet unless this node is selected
+        if (broadcast_mode == BROADCAST_ALL || broadcast_mode == BROADCAST_IDLE)
+                return;
+        #endif // ENABLE_BROADCAST_SUPPORT
+        
         while (1)
         {
                 cli();
@@ -1200,6 +1313,12 @@ void __attribute__ ((noinline)) send_char(unsigned char c)
         unsigned char tmp;
         #endif
         
+        #ifdef ENABLE_BROADCAST_SUPPORT
+        // stay quiet unless this node is selected
+        if (broadcast_mode == BROADCAST_ALL || broadcast_mode == BROADCAST_IDLE)
+                return;
+        #endif // ENABLE_BROADCAST_SUPPORT
+        
         #ifdef USE_UART
         // Send character
         if (comm_mode == MODE_UNDEF || comm_mode == MODE_UART)
@@ -1501,6 +1620,22 @@ uint16_t crc16_block(uint32_t start, uint32_t length)
         return crc;
 }
 
+#ifdef ENABLE_BROADCAST_SUPPORT
+uint16_t get_node_id(void)
+{
+        // CRC of lot number, wafer number and wafer coordinates
+        // in the production signature row, same as the xgrid node ID
+        uint16_t crc = 0;
+        
+        for (uint8_t i = 0x08; i <= 0x15; i++)
+        {
+                crc = _crc16_update(crc, SP_ReadCalibrationByte(i));
+        }
+        
+        return crc;
+}
+#endif // ENABLE_BROADCAST_SUPPORT
+
 void install_firmware()
 {
         uint16_t crc;
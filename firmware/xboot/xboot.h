@@ -111,6 +111,7 @@
 #define ENABLE_FUSE_BITS
 #define ENABLE_FLASH_ERASE_WRITE
 #define ENABLE_CRC_SUPPORT
+//#define ENABLE_BROADCAST_SUPPORT
 
 // API
 #define ENABLE_API
@@ -412,12 +413,24 @@
 #endif // NEED_CODE_PROTECTION
 #endif // ENABLE_EEPROM_PROTECTION
 
+#ifdef ENABLE_BROADCAST_SUPPORT
+#ifndef __AVR_XMEGA__
+#error Broadcast support requires the XMEGA production signature row!
+#endif // __AVR_XMEGA__
+#endif // ENABLE_BROADCAST_SUPPORT
+
 // communication modes
 #define MODE_UNDEF              0
 #define MODE_UART               1
 #define MODE_I2C                2
 #define MODE_FIFO               3
 
+// broadcast modes
+#define BROADCAST_OFF           0
+#define BROADCAST_ALL           1
+#define BROADCAST_SELECTED      2
+#define BROADCAST_IDLE          3
+
 // types
 typedef uint32_t ADDR_T;
 
@@ -449,6 +462,12 @@ extern volatile unsigned char tx_char_cnt;
 extern unsigned char comm_mode;
 #endif // USE_INTERRUPTS
 
+#ifdef ENABLE_BROADCAST_SUPPORT
+extern unsigned char broadcast_mode;
+extern unsigned int broadcast_blocks;
+extern unsigned char broadcast_errors;
+#endif // ENABLE_BROADCAST_SUPPORT
+
 // Functions
 unsigned char __attribute__ ((noinline)) ow_slave_read_bit(void);
 void __attribute__ ((noinline)) ow_slave_write_bit(unsigned char b);
@@ -464,6 +483,9 @@ unsigned char BlockLoad(unsigned int size, unsigned char mem, ADDR_T *address);
 void BlockRead(unsigned int size, unsigned char mem, ADDR_T *address);
 
 uint16_t crc16_block(uint32_t start, uint32_t length);
+#ifdef ENABLE_BROADCAST_SUPPORT
+uint16_t get_node_id(void);
+#endif // ENABLE_BROADCAST_SUPPORT
 void install_firmware(void);
 
 
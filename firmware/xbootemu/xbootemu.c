@@ -0,0 +1,925 @@
+/************************************************************************/
+/* xbootemu                                                             */
+/*                                                                      */
+/* xbootemu.c                                                           */
+/*                                                                      */
+/* Host-side emulator of the XBoot command loop on a pseudo terminal    */
+/*                                                                      */
+/* Alex Forencich <alex@alexforencich.com>                              */
+/*                                                                      */
+/* Copyright (c) 2012 Alex Forencich                                    */
+/*                                                                      */
+/* Permission is hereby granted, free of charge, to any person          */
+/* obtaining a copy of this software and associated documentation       */
+/* files(the "Software"), to deal in the Software without restriction,  */
+/* including without limitation the rights to use, copy, modify, merge, */
+/* publish, distribute, sublicense, and/or sell copies of the Software, */
+/* and to permit persons to whom the Software is furnished to do so,    */
+/* subject to the following conditions:                                 */
+/*                                                                      */
+/* The above copyright notice and this permission notice shall be       */
+/* included in all copies or substantial portions of the Software.      */
+/*                                                                      */
+/* THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,      */
+/* EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF   */
+/* MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND                */
+/* NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS  */
+/* BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN   */
+/* ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN    */
+/* CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE     */
+/* SOFTWARE.                                                            */
+/*                                                                      */
+/************************************************************************/
+
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <termios.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "../xboot/protocol.h"
+
+// Version reported to the host
+#define XBOOT_VERSION_MAJOR 1
+#define XBOOT_VERSION_MINOR 7
+
+// Defaults match the xgrid node (atxmega128a3)
+#define DEFAULT_APP_SIZE        0x20000
+#define DEFAULT_BOOT_SIZE       0x2000
+#define DEFAULT_PAGE_SIZE       512
+#define DEFAULT_EEPROM_SIZE     2048
+#define DEFAULT_SIGNATURE       0x1e9742
+#define DEFAULT_BAUD_RATE       115200
+#define DEFAULT_PAGE_WRITE_US   8000
+#define DEFAULT_ERASE_US        60000
+#define DEFAULT_RX_FIFO_DEPTH   3
+
+// Sleep only when this far ahead of the modeled link,
+// keeps the syscall overhead out of the timing
+#define SLEEP_SLACK_NS          500000LL
+
+#define RX_QUEUE_SIZE           4096
+
+// broadcast modes
+#define BROADCAST_OFF           0
+#define BROADCAST_ALL           1
+#define BROADCAST_SELECTED      2
+#define BROADCAST_IDLE          3
+
+typedef struct
+{
+        uint8_t c;
+        int64_t t;
+} rx_entry_t;
+
+// configuration
+uint32_t app_size = DEFAULT_APP_SIZE;
+uint32_t boot_size = DEFAULT_BOOT_SIZE;
+uint32_t page_size = DEFAULT_PAGE_SIZE;
+uint32_t eeprom_size = DEFAULT_EEPROM_SIZE;
+uint32_t signature = DEFAULT_SIGNATURE;
+uint32_t baud_rate = DEFAULT_BAUD_RATE;
+uint32_t page_write_us = DEFAULT_PAGE_WRITE_US;
+uint32_t erase_us = DEFAULT_ERASE_US;
+uint32_t rx_fifo_depth = DEFAULT_RX_FIFO_DEPTH;
+uint16_t node_id = 0;
+
+// memories
+uint8_t *flash;
+uint8_t *eeprom;
+uint8_t *buffer;
+
+// pty
+int pty_fd;
+int64_t byte_time;
+
+// receive queue, filled by the reader thread
+pthread_mutex_t rx_lock = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t rx_cond = PTHREAD_COND_INITIALIZER;
+rx_entry_t rx_queue[RX_QUEUE_SIZE];
+int rx_head;
+int rx_tail;
+int rx_closed;
+
+// modeled time, the emulated CPU and the transmit side of the link
+// overruns are decided on these, so host scheduling jitter does not count
+int64_t cpu_clock;
+int64_t tx_clock;
+int sent_since_wait;
+
+// bootloader state
+uint8_t broadcast_mode;
+uint16_t broadcast_blocks;
+uint8_t broadcast_errors;
+
+// session statistics
+struct
+{
+        int active;
+        int64_t start;
+        int64_t end;
+        uint32_t bytes_in;
+        uint32_t bytes_out;
+        uint32_t commands;
+        uint32_t round_trips;
+        uint32_t pages_written;
+        uint32_t bytes_programmed;
+        uint32_t bytes_read;
+        uint32_t overruns;
+} stats;
+
+int64_t now_ns(void)
+{
+        struct timespec ts;
+        clock_gettime(CLOCK_MONOTONIC, &ts);
+        return (int64_t)ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+void sleep_until(int64_t t)
+{
+        struct timespec ts;
+        
+        if (t - now_ns() < SLEEP_SLACK_NS)
+                return;
+        
+        ts.tv_sec = t / 1000000000LL;
+        ts.tv_nsec = t % 1000000000LL;
+        
+        while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, 0) == EINTR) { };
+}
+
+void busy(uint32_t us)
+{
+        cpu_clock += (int64_t)us * 1000;
+        sleep_until(cpu_clock);
+}
+
+void print_stats(void)
+{
+        double elapsed;
+        
+        // the reader thread counts overruns under the same lock
+        pthread_mutex_lock(&rx_lock);
+        
+        if (!stats.active)
+        {
+                pthread_mutex_unlock(&rx_lock);
+                return;
+        }
+        
+        elapsed = (stats.end - stats.start) / 1e9;
+        
+        printf("session: %.3f s, %u commands, %u round trips\n", elapsed, stats.commands, stats.round_trips);
+        printf("  link: %u bytes in, %u bytes out", stats.bytes_in, stats.bytes_out);
+        if (baud_rate && elapsed > 0)
+                printf(", %.1f%% utilization", 100.0 * (stats.bytes_in + stats.bytes_out) * byte_time / 1e9 / elapsed);
+        printf("\n");
+        printf("  programmed: %u bytes in %u pages", stats.bytes_programmed, stats.pages_written);
+        if (elapsed > 0)
+                printf(", %.2f kB/s", stats.bytes_programmed / 1024.0 / elapsed);
+        printf("\n");
+        printf("  read back: %u bytes\n", stats.bytes_read);
+        if (stats.overruns)
+                printf("  receive overruns: %u bytes dropped\n", stats.overruns);
+        
+        fflush(stdout);
+        
+        memset(&stats, 0, sizeof(stats));
+        
+        pthread_mutex_unlock(&rx_lock);
+}
+
+void *reader_thread(void *arg)
+{
+        uint8_t buf[256];
+        int64_t arrival = 0;
+        int64_t t;
+        int len;
+        
+        (void)arg;
+        
+        while (1)
+        {
+                len = read(pty_fd, buf, sizeof(buf));
+                
+                if (len <= 0)
+                {
+                        // no client connected
+                        pthread_mutex_lock(&rx_lock);
+                        if (!rx_closed)
+                        {
+                                rx_closed = 1;
+                                pthread_cond_signal(&rx_cond);
+                        }
+                        pthread_mutex_unlock(&rx_lock);
+                        usleep(100000);
+                        continue;
+                }
+                
+                t = now_ns();
+                
+                pthread_mutex_lock(&rx_lock);
+                
+                rx_closed = 0;
+                
+                for (int i = 0; i < len; i++)
+                {
+                        // bytes arrive back to back at the modeled baud rate
+                        if (arrival < t)
+                                arrival = t;
+                        arrival += byte_time;
+                        
+                        if (((rx_head + 1) % RX_QUEUE_SIZE) == rx_tail)
+                        {
+                                stats.overruns++;
+                                continue;
+                        }
+                        
+                        rx_queue[rx_head].c = buf[i];
+                        rx_queue[rx_head].t = arrival;
+                        rx_head = (rx_head + 1) % RX_QUEUE_SIZE;
+                }
+                
+                pthread_cond_signal(&rx_cond);
+                pthread_mutex_unlock(&rx_lock);
+        }
+        
+        return 0;
+}
+
+// returns -1 when the client disconnects
+int get_char(void)
+{
+        rx_entry_t e;
+        int cnt;
+        
+        pthread_mutex_lock(&rx_lock);
+        
+        while (rx_head == rx_tail)
+        {
+                if (rx_closed && stats.active)
+                {
+                        pthread_mutex_unlock(&rx_lock);
+                        return -1;
+                }
+                
+                // host is waiting on our reply
+                if (sent_since_wait)
+                {
+                        stats.round_trips++;
+                        sent_since_wait = 0;
+                }
+                
+                pthread_cond_wait(&rx_cond, &rx_lock);
+        }
+        
+        // CPU picks up the next character once it has arrived
+        if (cpu_clock < rx_queue[rx_tail].t)
+                cpu_clock = rx_queue[rx_tail].t;
+        
+        // the UART can only hold a few characters while the
+        // bootloader is busy, anything beyond that is lost
+        if (rx_fifo_depth)
+        {
+                cnt = 0;
+                
+                for (int i = rx_tail; i != rx_head; i = (i + 1) % RX_QUEUE_SIZE)
+                {
+                        if (rx_queue[i].t > cpu_clock)
+                                break;
+                        cnt++;
+                }
+                
+                while (cnt > (int)rx_fifo_depth)
+                {
+                        // drop the first arrival that did not fit
+                        int last = (rx_tail + rx_fifo_depth) % RX_QUEUE_SIZE;
+                        for (int i = last; (i + 1) % RX_QUEUE_SIZE != rx_head; i = (i + 1) % RX_QUEUE_SIZE)
+                                rx_queue[i] = rx_queue[(i + 1) % RX_QUEUE_SIZE];
+                        rx_head = (rx_head + RX_QUEUE_SIZE - 1) % RX_QUEUE_SIZE;
+                        stats.overruns++;
+                        cnt--;
+                }
+        }
+        
+        e = rx_queue[rx_tail];
+        rx_tail = (rx_tail + 1) % RX_QUEUE_SIZE;
+        
+        pthread_mutex_unlock(&rx_lock);
+        
+        sleep_until(cpu_clock);
+        
+        if (!stats.active)
+        {
+                stats.active = 1;
+                stats.start = now_ns();
+        }
+        
+        stats.bytes_in++;
+        stats.end = now_ns();
+        
+        return e.c;
+}
+
+// returns -1 when the client disconnects
+int get_2bytes(void)
+{
+        int hi = get_char();
+        int lo;
+        
+        if (hi < 0)
+                return -1;
+        
+        lo = get_char();
+        
+        if (lo < 0)
+                return -1;
+        
+        return (hi << 8) | lo;
+}
+
+void send_char(uint8_t c)
+{
+        // stay quiet unless this node is selected
+        if (broadcast_mode == BROADCAST_ALL || broadcast_mode == BROADCAST_IDLE)
+                return;
+        
+        // blocks until the data register is free, like the real thing
+        if (cpu_clock < tx_clock - byte_time)
+                cpu_clock = tx_clock - byte_time;
+        
+        if (tx_clock < cpu_clock)
+                tx_clock = cpu_clock;
+        tx_clock += byte_time;
+        
+        // host sees the character once it is on the wire
+        sleep_until(tx_clock);
+        
+        if (write(pty_fd, &c, 1) != 1)
+                return;
+        
+        sent_since_wait = 1;
+        stats.bytes_out++;
+        stats.end = now_ns();
+}
+
+uint16_t crc16_update(uint16_t crc, uint8_t a)
+{
+        // same as _crc16_update from avr-libc
+        crc ^= a;
+        for (int i = 0; i < 8; i++)
+        {
+                if (crc & 1)
+                        crc = (crc >> 1) ^ 0xA001;
+                else
+                        crc = (crc >> 1);
+        }
+        return crc;
+}
+
+uint16_t crc16_block(uint32_t start, uint32_t length)
+{
+        uint16_t crc = 0;
+        
+        for ( ; length > 0; length--)
+                crc = crc16_update(crc, flash[start++]);
+        
+        return crc;
+}
+
+uint8_t block_load(unsigned int size, uint8_t mem, uint32_t *address)
+{
+        uint32_t tempaddress;
+        
+        // fill up buffer
+        for (unsigned int i = 0; i < page_size; i++)
+        {
+                int c = 0xff;
+                
+                if (i < size)
+                        c = get_char();
+                
+                // client went away mid block, write nothing
+                if (c < 0)
+                        return REPLY_ERROR;
+                
+                buffer[i] = c;
+        }
+        
+        if (mem == MEM_EEPROM)
+        {
+                for (unsigned int i = 0; i < size && i < page_size; i++)
+                {
+                        eeprom[(*address + i) % eeprom_size] = buffer[i];
+                }
+                (*address) += size;
+                
+                // one EEPROM page write per block
+                busy(page_write_us);
+                
+                return REPLY_ACK;
+        }
+        else if (mem == MEM_FLASH)
+        {
+                // NOTE: For flash programming, 'address' is given in words.
+                tempaddress = ((*address) << 1) & ~(page_size - 1);
+                
+                (*address) += size >> 1;
+                
+                // application section erase-write only
+                if (tempaddress < app_size)
+                {
+                        memcpy(flash + tempaddress, buffer, page_size);
+                        stats.pages_written++;
+                        stats.bytes_programmed += size;
+                }
+                
+                busy(page_write_us);
+                
+                return REPLY_ACK;
+        }
+        else if (mem == MEM_USERSIG)
+        {
+                busy(page_write_us);
+                
+                return REPLY_ACK;
+        }
+        
+        return REPLY_ERROR;
+}
+
+void block_read(unsigned int size, uint8_t mem, uint32_t *address)
+{
+        if (mem == MEM_EEPROM)
+        {
+                for (unsigned int i = 0; i < size; i++)
+                        send_char(eeprom[(*address)++ % eeprom_size]);
+        }
+        else if (mem == MEM_FLASH || mem == MEM_USERSIG || mem == MEM_PRODSIG)
+        {
+                (*address) <<= 1;
+                
+                for (unsigned int i = 0; i < size; i++)
+                {
+                        if (mem == MEM_FLASH && *address < app_size + boot_size)
+                                send_char(flash[*address]);
+                        else
+                                send_char(0xff);
+                        (*address)++;
+                }
+                
+                (*address) >>= 1;
+        }
+        else
+        {
+                return;
+        }
+        
+        stats.bytes_read += size;
+}
+
+// Command loop, mirrors main() in xboot.c
+int run_bootloader(void)
+{
+        uint32_t address = 0;
+        int val;
+        int i = 0;
+        
+        broadcast_mode = BROADCAST_OFF;
+        
+        while (1)
+        {
+                val = get_char();
+                
+                if (val < 0)
+                        return 0;
+                
+                stats.commands++;
+                
+                if (val == CMD_CHECK_AUTOINCREMENT)
+                {
+                        send_char(REPLY_YES);
+                }
+                else if (val == CMD_SET_ADDRESS)
+                {
+                        i = get_2bytes();
+                        if (i < 0)
+                                return 0;
+                        address = i;
+                        send_char(REPLY_ACK);
+                }
+                else if (val == CMD_SET_EXT_ADDRESS)
+                {
+                        val = get_char();
+                        i = get_2bytes();
+                        if (val < 0 || i < 0)
+                                return 0;
+                        address = ((uint32_t)val << 16) | i;
+                        send_char(REPLY_ACK);
+                }
+                else if (val == CMD_CHIP_ERASE)
+                {
+                        if (broadcast_mode == BROADCAST_IDLE)
+                                continue;
+                        
+                        memset(flash, 0xff, app_size);
+                        memset(eeprom, 0xff, eeprom_size);
+                        busy(erase_us);
+                        send_char(REPLY_ACK);
+                }
+                else if (val == CMD_CHECK_BLOCK_SUPPORT)
+                {
+                        send_char(REPLY_YES);
+                        send_char((page_size >> 8) & 0xFF);
+                        send_char(page_size & 0xFF);
+                }
+                else if (val == CMD_BLOCK_LOAD)
+                {
+                        i = get_2bytes();
+                        val = get_char();
+                        if (i < 0 || val < 0)
+                                return 0;
+                        if (broadcast_mode == BROADCAST_IDLE)
+                                val = 0;
+                        val = block_load(i, val, &address);
+                        if (broadcast_mode != BROADCAST_IDLE)
+                        {
+                                if (val == REPLY_ACK)
+                                        broadcast_blocks++;
+                                else
+                                        broadcast_errors++;
+                        }
+                        send_char(val);
+                }
+                else if (val == CMD_BLOCK_READ)
+                {
+                        i = get_2bytes();
+                        val = get_char();
+                        if (i < 0 || val < 0)
+                                return 0;
+                        block_read(i, val, &address);
+                }
+                else if (val == CMD_READ_BYTE)
+                {
+                        uint32_t a = (address << 1) % (app_size + boot_size);
+                        send_char(flash[a + 1]);
+                        send_char(flash[a]);
+                        address++;
+                }
+                else if (val == CMD_WRITE_LOW_BYTE)
+                {
+                        i = get_char();
+                        // another node is selected, leave memory alone
+                        if (broadcast_mode == BROADCAST_IDLE)
+                                continue;
+                        send_char(REPLY_ACK);
+                }
+                else if (val == CMD_WRITE_HIGH_BYTE)
+                {
+                        i |= (get_char() << 8);
+                        // another node is selected, leave memory alone
+                        if (broadcast_mode == BROADCAST_IDLE)
+                        {
+                                address++;
+                                continue;
+                        }
+                        buffer[(address << 1) % page_size] = i;
+                        buffer[((address << 1) + 1) % page_size] = i >> 8;
+                        address++;
+                        send_char(REPLY_ACK);
+                }
+                else if (val == CMD_WRITE_PAGE)
+                {
+                        // another node is selected, leave memory alone
+                        if (broadcast_mode == BROADCAST_IDLE)
+                                continue;
+                        
+                        if (address >= (app_size >> 1))
+                        {
+                                send_char(REPLY_ERROR);
+                        }
+                        else
+                        {
+                                memcpy(flash + ((address << 1) & ~(page_size - 1)), buffer, page_size);
+                                stats.pages_written++;
+                                stats.bytes_programmed += page_size;
+                                busy(page_write_us);
+                                send_char(REPLY_ACK);
+                        }
+                }
+                else if (val == CMD_WRITE_EEPROM_BYTE)
+                {
+                        val = get_char();
+                        // another node is selected, leave memory alone
+                        if (broadcast_mode != BROADCAST_IDLE)
+                                eeprom[address % eeprom_size] = val;
+                        address++;
+                }
+                else if (val == CMD_READ_EEPROM_BYTE)
+                {
+                        send_char(eeprom[address % eeprom_size]);
+                        address++;
+                }
+                else if (val == CMD_WRITE_LOCK_BITS)
+                {
+                        get_char();
+                        // another node is selected, leave memory alone
+                        if (broadcast_mode == BROADCAST_IDLE)
+                                continue;
+                        send_char(REPLY_ACK);
+                }
+                else if (val == CMD_READ_LOCK_BITS || val == CMD_READ_LOW_FUSE_BITS ||
+                        val == CMD_READ_HIGH_FUSE_BITS || val == CMD_READ_EXT_FUSE_BITS)
+                {
+                        send_char(0xff);
+                }
+                else if ((val == CMD_ENTER_PROG_MODE) || (val == CMD_LEAVE_PROG_MODE))
+                {
+                        send_char(REPLY_ACK);
+                }
+                else if (val == CMD_EXIT_BOOTLOADER)
+                {
+                        // another node is selected, stay put
+                        if (broadcast_mode == BROADCAST_IDLE)
+                                continue;
+                        
+                        send_char(REPLY_ACK);
+                        return 1;
+                }
+                else if (val == CMD_PROGRAMMER_TYPE)
+                {
+                        send_char('S');
+                }
+                else if (val == CMD_DEVICE_CODE)
+                {
+                        send_char(123);
+                        send_char(0);
+                }
+                else if ((val == CMD_SET_LED) || (val == CMD_CLEAR_LED) || (val == CMD_SET_TYPE))
+                {
+                        get_char();
+                        send_char(REPLY_ACK);
+                }
+                else if (val == CMD_PROGRAM_ID)
+                {
+                        const char *id = "XBoot++";
+                        while (*id)
+                                send_char(*id++);
+                }
+                else if (val == CMD_VERSION)
+                {
+                        send_char('0' + XBOOT_VERSION_MAJOR);
+                        send_char('0' + XBOOT_VERSION_MINOR);
+                }
+                else if (val == CMD_READ_SIGNATURE)
+                {
+                        send_char(signature & 0xff);
+                        send_char((signature >> 8) & 0xff);
+                        send_char((signature >> 16) & 0xff);
+                }
+                else if (val == CMD_CRC)
+                {
+                        uint32_t start = 0;
+                        uint32_t length = 0;
+                        uint16_t crc;
+                        
+                        val = get_char();
+                        
+                        switch (val)
+                        {
+                                case SECTION_FLASH:
+                                        length = app_size + boot_size;
+                                        break;
+                                case SECTION_APPLICATION:
+                                        length = app_size;
+                                        break;
+                                case SECTION_BOOT:
+                                        start = app_size;
+                                        length = boot_size;
+                                        break;
+                                case SECTION_APP:
+                                        length = app_size / 2;
+                                        break;
+                                case SECTION_APP_TEMP:
+                                        start = app_size / 2;
+                                        length = app_size / 2;
+                                        break;
+                                default:
+                                        send_char(REPLY_ERROR);
+                                        continue;
+                        }
+                        
+                        crc = crc16_block(start, length);
+                        
+                        // about 16 cycles per byte at 32 MHz
+                        busy(length / 2);
+                        
+                        send_char((crc >> 8) & 0xff);
+                        send_char(crc & 0xff);
+                }
+                else if (val == CMD_BROADCAST_START)
+                {
+                        broadcast_mode = BROADCAST_ALL;
+                        broadcast_blocks = 0;
+                        broadcast_errors = 0;
+                }
+                else if (val == CMD_BROADCAST_END)
+                {
+                        broadcast_mode = BROADCAST_OFF;
+                }
+                else if (val == CMD_BROADCAST_SELECT)
+                {
+                        i = get_2bytes();
+                        if (i < 0)
+                                return 0;
+                        if (i == node_id)
+                                broadcast_mode = BROADCAST_SELECTED;
+                        else
+                                broadcast_mode = BROADCAST_IDLE;
+                        
+                        send_char(REPLY_ACK);
+                }
+                else if (val == CMD_BROADCAST_STATUS)
+                {
+                        send_char((broadcast_blocks >> 8) & 0xff);
+                        send_char(broadcast_blocks & 0xff);
+                        send_char(broadcast_errors);
+                }
+                else if (val != CMD_SYNC)
+                {
+                        send_char(REPLY_ERROR);
+                }
+        }
+}
+
+uint8_t *map_file(const char *name, uint32_t size)
+{
+        struct stat st;
+        uint8_t *p;
+        int fd;
+        int blank;
+        
+        fd = open(name, O_RDWR | O_CREAT, 0644);
+        
+        if (fd < 0)
+        {
+                perror(name);
+                return 0;
+        }
+        
+        fstat(fd, &st);
+        blank = (st.st_size == 0);
+        
+        if (ftruncate(fd, size) < 0)
+        {
+                perror(name);
+                close(fd);
+                return 0;
+        }
+        
+        p = mmap(0, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+        close(fd);
+        
+        if (p == MAP_FAILED)
+        {
+                perror(name);
+                return 0;
+        }
+        
+        // new files start out erased
+        if (blank)
+                memset(p, 0xff, size);
+        
+        return p;
+}
+
+int open_pty(const char *link)
+{
+        struct termios tio;
+        int fd;
+        
+        fd = posix_openpt(O_RDWR | O_NOCTTY);
+        
+        if (fd < 0 || grantpt(fd) < 0 || unlockpt(fd) < 0)
+        {
+                perror("pty");
+                return -1;
+        }
+        
+        // raw 8 bit data, no echo
+        tcgetattr(fd, &tio);
+        cfmakeraw(&tio);
+        tcsetattr(fd, TCSANOW, &tio);
+        
+        printf("xbootemu listening on %s\n", ptsname(fd));
+        
+        if (link)
+        {
+                unlink(link);
+                if (symlink(ptsname(fd), link) < 0)
+                        perror(link);
+                else
+                        printf("linked to %s\n", link);
+        }
+        
+        return fd;
+}
+
+void usage(const char *name)
+{
+        printf("Usage: %s [options]\n", name);
+        printf("  -f file   flash image file (default xbootemu-flash.bin)\n");
+        printf("  -e file   EEPROM image file (default xbootemu-eeprom.bin)\n");
+        printf("  -l path   symlink to the pty slave, e.g. /tmp/ttyXBOOT\n");
+        printf("  -b baud   modeled link rate, 0 for unlimited (default %d)\n", DEFAULT_BAUD_RATE);
+        printf("  -w us     page write time (default %d)\n", DEFAULT_PAGE_WRITE_US);
+        printf("  -x us     chip erase time (default %d)\n", DEFAULT_ERASE_US);
+        printf("  -r n      UART receive FIFO depth, 0 for unlimited (default %d)\n", DEFAULT_RX_FIFO_DEPTH);
+        printf("  -a size   application section size (default 0x%x)\n", DEFAULT_APP_SIZE);
+        printf("  -B size   boot section size (default 0x%x)\n", DEFAULT_BOOT_SIZE);
+        printf("  -p size   page size (default %d)\n", DEFAULT_PAGE_SIZE);
+        printf("  -E size   EEPROM size (default %d)\n", DEFAULT_EEPROM_SIZE);
+        printf("  -s sig    device signature (default 0x%06x)\n", DEFAULT_SIGNATURE);
+        printf("  -i id     node ID for broadcast select (default 0)\n");
+}
+
+int main(int argc, char **argv)
+{
+        const char *flash_file = "xbootemu-flash.bin";
+        const char *eeprom_file = "xbootemu-eeprom.bin";
+        const char *link = 0;
+        pthread_t reader;
+        int opt;
+        
+        while ((opt = getopt(argc, argv, "f:e:l:b:w:x:r:a:B:p:E:s:i:h")) != -1)
+        {
+                switch (opt)
+                {
+                        case 'f': flash_file = optarg; break;
+                        case 'e': eeprom_file = optarg; break;
+                        case 'l': link = optarg; break;
+                        case 'b': baud_rate = strtoul(optarg, 0, 0); break;
+                        case 'w': page_write_us = strtoul(optarg, 0, 0); break;
+                        case 'x': erase_us = strtoul(optarg, 0, 0); break;
+                        case 'r': rx_fifo_depth = strtoul(optarg, 0, 0); break;
+                        case 'a': app_size = strtoul(optarg, 0, 0); break;
+                        case 'B': boot_size = strtoul(optarg, 0, 0); break;
+                        case 'p': page_size = strtoul(optarg, 0, 0); break;
+                        case 'E': eeprom_size = strtoul(optarg, 0, 0); break;
+                        case 's': signature = strtoul(optarg, 0, 0); break;
+                        case 'i': node_id = strtoul(optarg, 0, 0); break;
+                        default:
+                                usage(argv[0]);
+                                return 1;
+                }
+        }
+        
+        if (page_size == 0 || (page_size & (page_size - 1)) || app_size % page_size || eeprom_size == 0)
+        {
+                fprintf(stderr, "bad memory geometry\n");
+                return 1;
+        }
+        
+        // 8N1, 10 bits per character
+        byte_time = baud_rate ? 10000000000LL / baud_rate : 0;
+        
+        flash = map_file(flash_file, app_size + boot_size);
+        eeprom = map_file(eeprom_file, eeprom_size);
+        buffer = malloc(page_size);
+        
+        if (!flash || !eeprom || !buffer)
+                return 1;
+        
+        pty_fd = open_pty(link);
+        
+        if (pty_fd < 0)
+                return 1;
+        
+        pthread_create(&reader, 0, reader_thread, 0);
+        
+        while (1)
+        {
+                int exited = run_bootloader();
+                
+                if (exited)
+                        printf("exit bootloader\n");
+                else
+                        printf("client disconnected\n");
+                
+                print_stats();
+                
+                msync(flash, app_size + boot_size, MS_ASYNC);
+                msync(eeprom, eeprom_size, MS_ASYNC);
+        }
+        
+        return 0;
+}
@@ -83,6 +83,14 @@
 
 #define NODE_BAUD_RATE          115200
 
+// node link RTS/CTS handshake lines
+// define per port where wired, ports without
+// them use in-band flow control
+//#define USART_N0_RTS_PORT       PORTC
+//#define USART_N0_RTS_PIN        0
+//#define USART_N0_CTS_PORT       PORTC
+//#define USART_N0_CTS_PIN        1
+
 // I2C
 #define I2C_DEV                 TWIE
 
@@ -32,5 +32,12 @@
 #include "iostream.h"
 
 
+// in-band flow control, streams that can't do it ignore it
+void IOStream::set_inband_flow(char esc, char xoff, char xon, size_t room, size_t level)
+{
+        
+}
+
+
 
 
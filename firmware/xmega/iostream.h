@@ -40,6 +40,7 @@ class IOStream : public IStream, public OStream
 {
 public:
         // Public methods
+        virtual void set_inband_flow(char esc, char xoff, char xon, size_t room, size_t level);
         
 };
 
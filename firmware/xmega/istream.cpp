@@ -63,6 +63,12 @@ void IStream::read_string(char *dest)
 }
 
 
+size_t IStream::overruns()
+{
+        return 0;
+}
+
+
 size_t IStream::read(void *dest, size_t num)
 {
         size_t j = num;
@@ -44,6 +44,7 @@ public:
         virtual int peek(size_t index = 0);
         virtual void read_string(char *dest);
         virtual size_t read(void *dest, size_t num);
+        virtual size_t overruns();
         
 };
 
@@ -40,8 +40,10 @@ char usart_rxbuf[USART_RX_BUF_SIZE];
 CREATE_USART(usart, UART_DEVICE_PORT);
 FILE usart_stream;
 
+// transmit ring is refilled once per tick, which
+// limits node links to 32 bytes per ms
 #define NODE_TX_BUF_SIZE 32
-#define NODE_RX_BUF_SIZE 64
+#define NODE_RX_BUF_SIZE 128
 char usart_n0_txbuf[NODE_TX_BUF_SIZE];
 char usart_n0_rxbuf[NODE_RX_BUF_SIZE];
 CREATE_USART(usart_n0, USART_N0_DEVICE_PORT);
@@ -61,7 +63,12 @@ char usart_n5_txbuf[NODE_TX_BUF_SIZE];
 char usart_n5_rxbuf[NODE_RX_BUF_SIZE];
 CREATE_USART(usart_n5, USART_N5_DEVICE_PORT);
 
+Usart *node_usart[] = {&usart_n0, &usart_n1, &usart_n2, &usart_n3, &usart_n4, &usart_n5};
+
 Xgrid xgrid;
+XgridJobs jobs(&xgrid);
+XgridColl coll(&xgrid);
+XgridTime timesync(&xgrid, &coll);
 
 // SPI
 
@@ -104,9 +111,39 @@ ISR(TCC0_OVF_vect)
         if (jiffies % 50 == 0)
                 LED_PORT.OUTTGL = LED_USR_0_PIN_bm;
         
+        // restart ports held by CTS
+        for (uint8_t i = 0; i < 6; i++)
+                node_usart[i]->check_cts();
+        
+        // time requests are stamped right before they go out
+        timesync.tick();
+        
         xgrid.process();
 }
 
+// microseconds since start, the timer steps 8 us and
+// a tick is PER + 1 steps
+uint32_t local_us()
+{
+        uint8_t saved_status = SREG;
+        cli();
+        
+        uint32_t j = jiffies;
+        uint16_t cnt = TCC0.CNT;
+        uint16_t per = TCC0.PER + 1;
+        
+        // overflow not serviced yet
+        if (TCC0.INTFLAGS & TC0_OVFIF_bm)
+        {
+                j++;
+                cnt = TCC0.CNT;
+        }
+        
+        SREG = saved_status;
+        
+        return (j * per + cnt) * 8;
+}
+
 void rx_pkt(Xgrid::Packet *pkt)
 {
         usart.write_string("RX: ");
@@ -115,6 +152,33 @@ void rx_pkt(Xgrid::Packet *pkt)
         LED_PORT.OUTTGL = LED_USR_2_PIN_bm;
 }
 
+// example kernel, returns item data unchanged
+uint8_t echo_kernel(const uint8_t *in, uint16_t in_len, uint8_t *out, uint16_t *out_len)
+{
+        memcpy(out, in, in_len);
+        *out_len = in_len;
+        return XGRID_JOB_STATUS_OK;
+}
+
+// example combine function, sums 16 bit values
+void sum_combine(uint8_t *acc, const uint8_t *in, uint8_t len)
+{
+        for (uint8_t i = 0; i + 1 < len; i += 2)
+                *(uint16_t *)(acc + i) += *(const uint16_t *)(in + i);
+}
+
+uint8_t set_node_baud(uint8_t node, uint32_t baud)
+{
+        Usart *u = node_usart[node];
+        
+        if (!u->tx_idle())
+                return 0;
+        
+        // double speed only when needed
+        u->begin(baud, baud > (F_CPU) / 16);
+        return 1;
+}
+
 // Init everything
 void init(void)
 {
@@ -146,27 +210,63 @@ void init(void)
         usart_n0.set_tx_buffer(usart_n0_txbuf, NODE_TX_BUF_SIZE);
         usart_n0.set_rx_buffer(usart_n0_rxbuf, NODE_RX_BUF_SIZE);
         usart_n0.begin(NODE_BAUD_RATE);
+#ifdef USART_N0_RTS_PORT
+        usart_n0.set_rts_pin(&USART_N0_RTS_PORT, USART_N0_RTS_PIN);
+        usart_n0.set_cts_pin(&USART_N0_CTS_PORT, USART_N0_CTS_PIN);
+        xgrid.add_node(&usart_n0, XGRID_LINK_HW_FLOW);
+#else
         xgrid.add_node(&usart_n0);
+#endif
         usart_n1.set_tx_buffer(usart_n1_txbuf, NODE_TX_BUF_SIZE);
         usart_n1.set_rx_buffer(usart_n1_rxbuf, NODE_RX_BUF_SIZE);
         usart_n1.begin(NODE_BAUD_RATE);
+#ifdef USART_N1_RTS_PORT
+        usart_n1.set_rts_pin(&USART_N1_RTS_PORT, USART_N1_RTS_PIN);
+        usart_n1.set_cts_pin(&USART_N1_CTS_PORT, USART_N1_CTS_PIN);
+        xgrid.add_node(&usart_n1, XGRID_LINK_HW_FLOW);
+#else
         xgrid.add_node(&usart_n1);
+#endif
         usart_n2.set_tx_buffer(usart_n2_txbuf, NODE_TX_BUF_SIZE);
         usart_n2.set_rx_buffer(usart_n2_rxbuf, NODE_RX_BUF_SIZE);
         usart_n2.begin(NODE_BAUD_RATE);
+#ifdef USART_N2_RTS_PORT
+        usart_n2.set_rts_pin(&USART_N2_RTS_PORT, USART_N2_RTS_PIN);
+        usart_n2.set_cts_pin(&USART_N2_CTS_PORT, USART_N2_CTS_PIN);
+        xgrid.add_node(&usart_n2, XGRID_LINK_HW_FLOW);
+#else
         xgrid.add_node(&usart_n2);
+#endif
         usart_n3.set_tx_buffer(usart_n3_txbuf, NODE_TX_BUF_SIZE);
         usart_n3.set_rx_buffer(usart_n3_rxbuf, NODE_RX_BUF_SIZE);
         usart_n3.begin(NODE_BAUD_RATE);
+#ifdef USART_N3_RTS_PORT
+        usart_n3.set_rts_pin(&USART_N3_RTS_PORT, USART_N3_RTS_PIN);
+        usart_n3.set_cts_pin(&USART_N3_CTS_PORT, USART_N3_CTS_PIN);
+        xgrid.add_node(&usart_n3, XGRID_LINK_HW_FLOW);
+#else
         xgrid.add_node(&usart_n3);
+#endif
         usart_n4.set_tx_buffer(usart_n4_txbuf, NODE_TX_BUF_SIZE);
         usart_n4.set_rx_buffer(usart_n4_rxbuf, NODE_RX_BUF_SIZE);
         usart_n4.begin(NODE_BAUD_RATE);
+#ifdef USART_N4_RTS_PORT
+        usart_n4.set_rts_pin(&USART_N4_RTS_PORT, USART_N4_RTS_PIN);
+        usart_n4.set_cts_pin(&USART_N4_CTS_PORT, USART_N4_CTS_PIN);
+        xgrid.add_node(&usart_n4, XGRID_LINK_HW_FLOW);
+#else
         xgrid.add_node(&usart_n4);
+#endif
         usart_n5.set_tx_buffer(usart_n5_txbuf, NODE_TX_BUF_SIZE);
         usart_n5.set_rx_buffer(usart_n5_rxbuf, NODE_RX_BUF_SIZE);
         usart_n5.begin(NODE_BAUD_RATE);
+#ifdef USART_N5_RTS_PORT
+        usart_n5.set_rts_pin(&USART_N5_RTS_PORT, USART_N5_RTS_PIN);
+        usart_n5.set_cts_pin(&USART_N5_CTS_PORT, USART_N5_CTS_PIN);
+        xgrid.add_node(&usart_n5, XGRID_LINK_HW_FLOW);
+#else
         xgrid.add_node(&usart_n5);
+#endif
         
         // ADC setup
         ADCA.CTRLA = ADC_DMASEL_OFF_gc | ADC_FLUSH_bm;
@@ -242,6 +342,16 @@ int main(void)
         init();
         
         xgrid.rx_pkt = &rx_pkt;
+        xgrid.set_node_baud = &set_node_baud;
+        
+        jobs.begin();
+        jobs.register_kernel(0, &echo_kernel);
+        
+        coll.begin();
+        coll.register_func(0, &sum_combine);
+        
+        timesync.local_time = &local_us;
+        timesync.begin();
         
         LED_PORT.OUT = LED_USR_0_PIN_bm;
         
@@ -273,8 +383,16 @@ int main(void)
                 
                 old_btn = btn;
                 
+                // handle received packets and run
+                // work items while waiting
                 j = jiffies + 10;
-                while (j > jiffies) { };
+                while (j > jiffies)
+                {
+                        xgrid.dispatch();
+                        jobs.process();
+                        coll.process();
+                        timesync.process();
+                }
                 
         }
         
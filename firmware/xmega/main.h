@@ -39,6 +39,7 @@
 #include <avr/interrupt.h>
 
 #include <stdio.h>
+#include <string.h>
 
 #include "board.h"
 #include "usart.h"
@@ -46,6 +47,9 @@
 #include "i2c.h"
 #include "eeprom.h"
 #include "xgrid.h"
+#include "xgrid_jobs.h"
+#include "xgrid_coll.h"
+#include "xgrid_time.h"
 #include "../xboot/xbootapi.h"
 
 // Build information
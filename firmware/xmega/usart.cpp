@@ -200,6 +200,62 @@ char __attribute__ ((noinline)) Usart::get_txpin(char _usart)
         }
 }
 
+
+
+// pick BSCALE and BSEL for the closest rate, most
+// negative scale wins ties for best resolution
+void Usart::solve_baud(long baud, char clk2x, unsigned int *bsel, char *bscale)
+{
+        uint32_t div = (uint32_t)baud * (clk2x ? 8 : 16);
+        uint32_t best_err = 0xffffffff;
+        
+        *bsel = 0;
+        *bscale = 0;
+        
+        for (char s = -7; s <= 7; s++)
+        {
+                uint32_t b;
+                uint32_t rate;
+                uint32_t err;
+                
+                if (s < 0)
+                {
+                        // fbaud = fper / (div * (2^bscale * bsel + 1))
+                        uint32_t k = 1UL << -s;
+                        uint32_t q = ((F_CPU) * k + (div >> 1)) / div;
+                        
+                        if (q < k)
+                                continue;
+                        
+                        b = q - k;
+                        rate = (F_CPU) * k / ((uint32_t)(clk2x ? 8 : 16) * (b + k));
+                }
+                else
+                {
+                        // fbaud = fper / (2^bscale * div * (bsel + 1))
+                        uint32_t q = (((F_CPU) >> s) + (div >> 1)) / div;
+                        
+                        if (q == 0)
+                                continue;
+                        
+                        b = q - 1;
+                        rate = ((F_CPU) >> s) / ((uint32_t)(clk2x ? 8 : 16) * (b + 1));
+                }
+                
+                if (b > 4095)
+                        continue;
+                
+                err = rate > (uint32_t)baud ? rate - baud : baud - rate;
+                
+                if (err < best_err)
+                {
+                        best_err = err;
+                        *bsel = b;
+                        *bscale = s;
+                }
+        }
+}
+
 #endif // __AVR_XMEGA__
 
 #ifdef __AVR_XMEGA__
@@ -224,7 +280,17 @@ Usart::Usart(char _usart) :
         ctspin_bm(0),
 #endif // __AVR_XMEGA__
         nonblocking(0),
-        flags(USART_TX_QUEUE_FULL | USART_RX_QUEUE_FULL)
+        flags(USART_TX_QUEUE_FULL | USART_RX_QUEUE_FULL),
+        rx_overruns(0),
+        flow_esc(0),
+        flow_xoff(0),
+        flow_xon(0),
+        flow_room(0),
+        flow_level(0),
+        flow_send(0),
+        flow_ptr(0),
+        flow_cnt(0),
+        tx_last(0)
 {
 #ifdef __AVR_XMEGA__
         usart_ind = which_usart(_usart);
@@ -323,7 +389,7 @@ void Usart::update_rts()
 {
         if (rtsport == 0)
                 return;
-        if (txbuf_size == 0)
+        if (rxbuf_size == 0)
         {
                 // no buffer, so just assert it
                 rtsport->OUTCLR = rtspin_bm;
@@ -343,6 +409,83 @@ void Usart::update_rts()
 }
 
 
+// escape then xoff goes out ahead of queued data when
+// the receive queue has room or fewer bytes free, escape
+// then xon once it drains to level, escape of 0 turns
+// it off
+void Usart::set_inband_flow(char esc, char xoff, char xon, size_t room, size_t level)
+{
+        uint8_t saved_status = SREG;
+        cli();
+        
+        if (esc == 0)
+        {
+                flags &= ~USART_RX_PAUSED;
+                flow_send = 0;
+                flow_ptr = 0;
+        }
+        
+        flow_esc = esc;
+        flow_xoff = xoff;
+        flow_xon = xon;
+        flow_room = room;
+        flow_level = level;
+        
+        SREG = saved_status;
+}
+
+
+// must be called with interrupts disabled
+void Usart::update_flow()
+{
+        size_t level;
+        
+        if (flow_esc == 0 || rxbuf_size == 0)
+                return;
+        
+        level = available();
+        
+        if (rxbuf_size - level <= flow_room)
+        {
+                // send again after a few more bytes in case it was lost
+                if (!(flags & USART_RX_PAUSED) || ++flow_cnt >= USART_XOFF_REPEAT)
+                {
+                        flags |= USART_RX_PAUSED;
+                        flow_send = flow_xoff;
+                        flow_cnt = 0;
+                        start_xmit();
+                }
+        }
+        else if ((flags & USART_RX_PAUSED) && level <= flow_level)
+        {
+                flags &= ~USART_RX_PAUSED;
+                flow_send = flow_xon;
+                flow_cnt = 0;
+                start_xmit();
+        }
+}
+
+
+// must be called with interrupts disabled
+void Usart::start_xmit()
+{
+        // clear transmit complete for tx_idle
+#ifdef __AVR_XMEGA__
+        usart->STATUS = USART_TXCIF_bm;
+#else // __AVR_XMEGA__
+        *ucsra |= _BV(TXC0);
+#endif // __AVR_XMEGA__
+        flags |= USART_TX_ACTIVE;
+        
+#ifdef __AVR_XMEGA__
+        if (ctsport == 0 || !(ctsport->IN & ctspin_bm))
+                usart->CTRLA |= USART_DREINTLVL_MED_gc;
+#else // __AVR_XMEGA__
+        *ucsrb |= _BV(UDRIE0);
+#endif // __AVR_XMEGA__
+}
+
+
 void Usart::check_cts()
 {
         if (ctsport == 0)
@@ -431,17 +574,10 @@ void __attribute__ ((noinline)) Usart::begin(long baud, char _clk2x, char puen)
                 bscale = -6;
                 clk2x = 0;
         }
-        else if (_clk2x)
-        {
-                bsel = ((F_CPU) / ((uint32_t)baud * 8) - 1);
-                bscale = 0;
-                clk2x = 1;
-        }
         else
         {
-                bsel = ((F_CPU) / ((uint32_t)baud * 16) - 1);
-                bscale = 0;
-                clk2x = 0;
+                clk2x = _clk2x;
+                solve_baud(baud, clk2x, &bsel, &bscale);
         }
         
         usart->BAUDCTRLA = (bsel & USART_BSEL_gm);
@@ -517,6 +653,14 @@ void Usart::recv()
         if (*ucsra & _BV(RXC0))
 #endif // __AVR_XMEGA__
         {
+                // hardware lost a byte
+#ifdef __AVR_XMEGA__
+                if (usart->STATUS & USART_BUFOVF_bm)
+#else // __AVR_XMEGA__
+                if (*ucsra & _BV(DOR0))
+#endif // __AVR_XMEGA__
+                        rx_overruns++;
+                
 #ifdef __AVR_XMEGA__
                 tmp = usart->DATA;
 #else // __AVR_XMEGA__
@@ -531,21 +675,57 @@ void Usart::recv()
                         if (rxbuf_head == rxbuf_tail)
                                 flags |= USART_RX_QUEUE_FULL;
                 }
+                else
+                {
+                        // no room, byte dropped
+                        rx_overruns++;
+                }
 #ifdef __AVR_XMEGA__
                 update_rts();
 #endif // __AVR_XMEGA__
+                update_flow();
         }
 }
 
 
 void Usart::xmit()
 {
-        if (!(flags & USART_TX_QUEUE_EMPTY))
+#ifdef __AVR_XMEGA__
+        // stop when receiver deasserts CTS,
+        // check_cts restarts transmit
+        if (ctsport != 0 && (ctsport->IN & ctspin_bm))
+        {
+                usart->CTRLA &= ~USART_DREINTLVL_gm;
+                return;
+        }
+#endif // __AVR_XMEGA__
+        // flow control goes ahead of queued data, but
+        // never between an escape and the byte it escapes
+        if (flow_send && (flow_ptr || tx_last != flow_esc))
+        {
+                char c = flow_ptr ? flow_send : flow_esc;
+#ifdef __AVR_XMEGA__
+                usart->DATA = c;
+#else // __AVR_XMEGA__
+                *udr = c;
+#endif // __AVR_XMEGA__
+                if (flow_ptr)
+                {
+                        flow_send = 0;
+                        flow_ptr = 0;
+                }
+                else
+                {
+                        flow_ptr = 1;
+                }
+        }
+        else if (!(flags & USART_TX_QUEUE_EMPTY))
         {
+                tx_last = txbuf[txbuf_tail++];
 #ifdef __AVR_XMEGA__
-                usart->DATA = txbuf[txbuf_tail++];
+                usart->DATA = tx_last;
 #else // __AVR_XMEGA__
-                *udr = txbuf[txbuf_tail++];
+                *udr = tx_last;
 #endif // __AVR_XMEGA__
                 flags &= ~USART_TX_QUEUE_FULL;
                 if (txbuf_tail >= txbuf_size)
@@ -553,7 +733,9 @@ void Usart::xmit()
                 if (txbuf_head == txbuf_tail)
                         flags |= USART_TX_QUEUE_EMPTY;
         }
-        if (flags & USART_TX_QUEUE_EMPTY)
+        // a pending xoff or xon waiting on the byte after an
+        // escape goes out when that byte is queued
+        if ((flags & USART_TX_QUEUE_EMPTY) && !(flow_send && (flow_ptr || tx_last != flow_esc)))
         {
 #ifdef __AVR_XMEGA__
                 usart->CTRLA &= ~USART_DREINTLVL_gm;
@@ -573,6 +755,32 @@ size_t Usart::free()
 }
 
 
+// true once everything written has left the shift register
+uint8_t Usart::tx_idle()
+{
+        if (!(flags & USART_TX_QUEUE_EMPTY))
+                return 0;
+        
+        if (!(flags & USART_TX_ACTIVE))
+                return 1;
+        
+#ifdef __AVR_XMEGA__
+        if (!(usart->STATUS & USART_TXCIF_bm))
+                return 0;
+#else // __AVR_XMEGA__
+        if (!(*ucsra & _BV(TXC0)))
+                return 0;
+#endif // __AVR_XMEGA__
+        
+        uint8_t saved_status = SREG;
+        cli();
+        flags &= ~USART_TX_ACTIVE;
+        SREG = saved_status;
+        
+        return 1;
+}
+
+
 void Usart::put(char c)
 {
         uint8_t saved_status = 0;
@@ -602,6 +810,14 @@ void Usart::put(char c)
         saved_status = SREG;
         cli();
         
+        // clear transmit complete for tx_idle
+#ifdef __AVR_XMEGA__
+        usart->STATUS = USART_TXCIF_bm;
+#else // __AVR_XMEGA__
+        *ucsra |= _BV(TXC0);
+#endif // __AVR_XMEGA__
+        flags |= USART_TX_ACTIVE;
+        
         txbuf[txbuf_head++] = c;
         flags &= ~USART_TX_QUEUE_EMPTY;
         if (txbuf_head >= txbuf_size)
@@ -610,7 +826,8 @@ void Usart::put(char c)
                 flags |= USART_TX_QUEUE_FULL;
         
 #ifdef __AVR_XMEGA__
-        usart->CTRLA |= USART_DREINTLVL_MED_gc;
+        if (ctsport == 0 || !(ctsport->IN & ctspin_bm))
+                usart->CTRLA |= USART_DREINTLVL_MED_gc;
 #else // __AVR_XMEGA__
         *ucsrb |= _BV(UDRIE0);
 #endif // __AVR_XMEGA__
@@ -667,6 +884,7 @@ char Usart::get()
 #ifdef __AVR_XMEGA__
         update_rts();
 #endif // __AVR_XMEGA__
+        update_flow();
         
         SREG = saved_status;
         
@@ -674,6 +892,12 @@ char Usart::get()
 }
 
 
+size_t Usart::overruns()
+{
+        return rx_overruns;
+}
+
+
 int Usart::peek(size_t index)
 {
         uint8_t saved_status = 0;
@@ -93,6 +93,11 @@
 #define USART_RX_QUEUE_EMPTY 0x40
 #define USART_RX_QUEUE_FULL 0x80
 #define USART_RUNNING 0x01
+#define USART_TX_ACTIVE 0x02
+#define USART_RX_PAUSED 0x04
+
+// bytes received past the XOFF point before it is sent again
+#define USART_XOFF_REPEAT 16
 
 #ifdef __AVR_XMEGA__
 
@@ -167,6 +172,18 @@ private:
         uint8_t nonblocking;
         
         volatile char flags;
+        volatile size_t rx_overruns;
+        
+        // in-band flow control
+        char flow_esc;
+        char flow_xoff;
+        char flow_xon;
+        size_t flow_room;
+        size_t flow_level;
+        volatile char flow_send;
+        volatile uint8_t flow_ptr;
+        volatile uint8_t flow_cnt;
+        char tx_last;
         
         // Static data
         static Usart *usart_list[MAX_USART_IND+1];
@@ -176,6 +193,8 @@ private:
         void xmit();
         
         void update_rts();
+        void update_flow();
+        void start_xmit();
         
         // Private static methods
 #ifdef __AVR_XMEGA__
@@ -183,6 +202,7 @@ private:
         static USART_t *get_usart(char _usart);
         static PORT_t *get_port(char _usart);
         static char get_txpin(char _usart);
+        static void solve_baud(long baud, char clk2x, unsigned int *bsel, char *bscale);
 #endif // __AVR_XMEGA__
         
 public:
@@ -208,16 +228,20 @@ public:
         
         void check_cts();
         
+        void set_inband_flow(char esc, char xoff, char xon, size_t room, size_t level);
+        
         void begin(long baud, char _clk2x = 0, char puen = 1);
         void end();
         
         size_t free();
+        uint8_t tx_idle();
         void put(char c);
         
         size_t available();
         char get();
         int peek(size_t index = 0);
         int ungetc(int c);
+        size_t overruns();
         
         void setup_stream(FILE *stream);
         
@@ -34,6 +34,7 @@
 #include <avr/pgmspace.h>
 #include <util/crc16.h>
 #include <string.h>
+#include <stddef.h>
 
 #if PROGMEM_SIZE > 0x010000
 #define PGM_READ_BYTE pgm_read_byte_far
@@ -45,6 +46,15 @@
 #define PGM_READ_DWORD pgm_read_dword_near
 #endif
 
+// candidate node link rates, first is NODE_BAUD_RATE
+// ports are serviced once per 1 ms tick, so a port can
+// carry at most one transmit ring (32 bytes, 320 kbaud)
+// and about one packet in each direction per tick
+static const uint32_t xgrid_baud_rates[XGRID_BAUD_CNT] =
+{
+        115200, 250000
+};
+
 Xgrid::Xgrid() :
         cur_seq(0),
         timeout(0),
@@ -53,7 +63,30 @@ Xgrid::Xgrid() :
         firmware_updated(0),
         node_cnt(0),
         compare_buffer_ptr(0),
-        rx_pkt(0)
+        route_timer(XGRID_ROUTE_UPDATE_INTERVAL),
+        route_port(0),
+        mpr_mask(0),
+        hello_timer(XGRID_HELLO_INTERVAL),
+        ticks(0),
+        lg_wait(0),
+        stats_active(0),
+        frag_mask(0),
+        frag_offset(0),
+        frag_msg_id(0),
+        frag_busy(0),
+        msg_buffer(0),
+        msg_buffer_len(0),
+        msg_age(0),
+        msg_active(0),
+        msg_held(0),
+        deliver_head(0),
+        deliver_cnt(0),
+        rx_cur_buffer(XGRID_DELIVER_DIRECT),
+        rx_pkt(0),
+        aggregate_latency(XGRID_AGGREGATE_LATENCY),
+        rx_timeout(XGRID_RX_TIMEOUT),
+        set_node_baud(0),
+        load(0)
 {
         uint8_t b;
         uint16_t crc = 0;
@@ -61,12 +94,22 @@ Xgrid::Xgrid() :
         // zero compare buffer
         memset(compare_buffer, 0, sizeof(xgrid_header_minimal_t) * XGRID_COMPARE_BUFFER_SIZE);
         
+        // clear routing table
+        for (int i = 0; i < XGRID_ROUTE_TABLE_SIZE; i++)
+        {
+                route_table[i].id = 0;
+                route_table[i].port = 0xFF;
+                route_table[i].metric = XGRID_ROUTE_INFINITY;
+                route_table[i].age = 0;
+        }
+        
         // init packet buffers
         for (int i = 0; i < XGRID_SM_BUFFER_COUNT; i++)
         {
                 pkt_buffer[i].buffer = pkt_buffer_sm[i];
                 pkt_buffer[i].buffer_len = XGRID_SM_BUFFER_SIZE;
                 pkt_buffer[i].flags = 0;
+                pkt_buffer[i].deliver_refs = 0;
         }
         
         for (int i = 0; i < XGRID_LG_BUFFER_COUNT; i++)
@@ -74,8 +117,27 @@ Xgrid::Xgrid() :
                 pkt_buffer[XGRID_SM_BUFFER_COUNT+i].buffer = pkt_buffer_lg[i];
                 pkt_buffer[XGRID_SM_BUFFER_COUNT+i].buffer_len = XGRID_LG_BUFFER_SIZE;
                 pkt_buffer[XGRID_SM_BUFFER_COUNT+i].flags = 0;
+                pkt_buffer[XGRID_SM_BUFFER_COUNT+i].deliver_refs = 0;
+        }
+        
+        for (int i = 0; i < XGRID_SM_LENT_COUNT; i++)
+        {
+                xgrid_buffer_t *b = &(pkt_buffer[XGRID_LG_BUFFER_IND+1+i]);
+                
+                b->buffer = pkt_buffer_lg[0] + i * XGRID_SM_BUFFER_SIZE;
+                b->buffer_len = XGRID_SM_BUFFER_SIZE;
+                b->flags = 0;
+                b->deliver_refs = 0;
         }
         
+        memset(buffer_stats, 0, sizeof(buffer_stats));
+        
+        // no handlers
+        memset(handlers, 0, sizeof(handlers));
+        memset(handler_first, 0xFF, sizeof(handler_first));
+        buffer_stats[0].count = XGRID_SM_BUFFER_COUNT + XGRID_SM_LENT_COUNT;
+        buffer_stats[1].count = XGRID_LG_BUFFER_COUNT;
+        
         // calculate local id
         // simply crc of user sig row
         // likely to be unique and constant for each chip
@@ -113,16 +175,80 @@ uint16_t Xgrid::get_id()
 }
 
 
-int8_t Xgrid::add_node(IOStream *stream)
+// returns 1 if port n has a live two way neighbor
+uint8_t Xgrid::get_neighbor(uint8_t n, uint16_t *id, uint8_t *load)
+{
+        if (n >= node_cnt || nodes[n].hello_age > XGRID_HELLO_MAX_AGE || !nodes[n].link_sym)
+                return 0;
+        
+        *id = nodes[n].neighbor_id;
+        *load = nodes[n].load;
+        
+        return 1;
+}
+
+
+uint16_t Xgrid::get_ticks()
+{
+        uint8_t saved_status = SREG;
+        cli();
+        
+        uint16_t t = ticks;
+        
+        SREG = saved_status;
+        
+        return t;
+}
+
+
+int8_t Xgrid::add_node(IOStream *stream, uint8_t link_flags)
 {
         if (node_cnt < XGRID_MAX_NODES)
         {
                 nodes[node_cnt].stream = stream;
+                nodes[node_cnt].link_flags = link_flags;
                 nodes[node_cnt].tx_buffer = -1;
                 nodes[node_cnt].rx_buffer = -1;
                 nodes[node_cnt].drop_chars = 0;
+                nodes[node_cnt].rx_state = XGRID_RX_STATE_HUNT;
+                nodes[node_cnt].rx_ptr = 0;
+                nodes[node_cnt].rx_idle = 0;
+                nodes[node_cnt].rx_escaped = 0;
+                nodes[node_cnt].rx_esc = 0;
+                nodes[node_cnt].tx_escaped = 0;
+                nodes[node_cnt].tx_pause = 0;
+                nodes[node_cnt].overrun_last = stream->overruns();
+                nodes[node_cnt].credits[0] = 0;
+                nodes[node_cnt].credits[1] = 0;
+                nodes[node_cnt].credits_out[0] = 0;
+                nodes[node_cnt].credits_out[1] = 0;
+                nodes[node_cnt].tx_credit = -1;
+                nodes[node_cnt].credits_valid = 0;
+                nodes[node_cnt].credits_sent = 0;
+                nodes[node_cnt].credit_age = 0;
+                nodes[node_cnt].tx_ptr = 0;
                 nodes[node_cnt].build = 0;
                 nodes[node_cnt].crc = 0;
+                nodes[node_cnt].neighbor_id = 0;
+                nodes[node_cnt].hello_age = 0xFF;
+                nodes[node_cnt].mpr_selector = 0;
+                nodes[node_cnt].two_hop_cnt = 0;
+                nodes[node_cnt].caps = 0;
+                nodes[node_cnt].link_sym = 0;
+                nodes[node_cnt].rtt = 0;
+                nodes[node_cnt].ping_tx = 0;
+                nodes[node_cnt].ping_rx = 0;
+                nodes[node_cnt].queue = 0;
+                nodes[node_cnt].load = 0;
+                memset(&(nodes[node_cnt].stats), 0, sizeof(xgrid_pkt_stats_port_t));
+                nodes[node_cnt].agg_buffer = -1;
+                nodes[node_cnt].agg_deadline = 0;
+                nodes[node_cnt].baud_state = XGRID_BAUD_STATE_IDLE;
+                nodes[node_cnt].baud_cur = 0;
+                nodes[node_cnt].baud_next = 0;
+                nodes[node_cnt].baud_limit = XGRID_BAUD_CNT;
+                nodes[node_cnt].baud_timer = XGRID_BAUD_STEP_DELAY;
+                nodes[node_cnt].baud_errors = 0;
                 return node_cnt++;
         }
         
@@ -141,181 +267,2266 @@ void Xgrid::populate_packet(Packet *pkt, uint8_t *buffer)
         hdr->seq = pkt->seq;
         hdr->flags = pkt->flags;
         hdr->radius = pkt->radius;
+        
+        if (pkt->flags & XGRID_PKT_FLAG_UNICAST)
+                hdr->size += sizeof(xgrid_pkt_unicast_t);
 }
 
 
-uint8_t Xgrid::is_unique(Packet *pkt)
+int8_t Xgrid::find_compare(Packet *pkt)
 {
         for (uint8_t i = 0; i < XGRID_COMPARE_BUFFER_SIZE; i++)
         {
-                if (compare_buffer[i].seq == pkt->seq &&
+                uint16_t seq_mask = 0xFFFF;
+                
+                // only the low byte is known if
+                // either copy came over a v1 link
+                if (!compare_buffer[i].seq16 || !(pkt->m_flags & XGRID_PKT_M_SEQ16))
+                        seq_mask = 0x00FF;
+                
+                if (((compare_buffer[i].seq ^ pkt->seq) & seq_mask) == 0 &&
                         compare_buffer[i].source_id == pkt->source_id &&
                         compare_buffer[i].type == pkt->type)
                         
-                        return 0;
+                        return i;
         }
         
-        return 1;
+        return -1;
 }
 
 
+// seen and relayed are kept apart, so a later copy from
+// a node that selected us still gets relayed when the
+// first copy came from one that didn't
 uint8_t Xgrid::check_unique(Packet *pkt)
 {
-        uint8_t ret = is_unique(pkt);
+        int8_t i = find_compare(pkt);
         
-        if (ret)
+        if (i >= 0)
         {
-                compare_buffer[compare_buffer_ptr].source_id = pkt->source_id;
-                compare_buffer[compare_buffer_ptr].type = pkt->type;
-                compare_buffer[compare_buffer_ptr].seq = pkt->seq;
+                if (!compare_buffer[i].relayed &&
+                        !(pkt->flags & XGRID_PKT_FLAG_UNICAST) &&
+                        should_forward(pkt))
+                {
+                        pkt->m_flags |= XGRID_PKT_M_RELAY;
+                        return 1;
+                }
                 
-                compare_buffer_ptr++;
-                if (compare_buffer_ptr >= XGRID_COMPARE_BUFFER_SIZE)
-                        compare_buffer_ptr = 0;
+                return 0;
         }
         
-        return ret;
+        compare_buffer[compare_buffer_ptr].source_id = pkt->source_id;
+        compare_buffer[compare_buffer_ptr].type = pkt->type;
+        compare_buffer[compare_buffer_ptr].seq = pkt->seq;
+        compare_buffer[compare_buffer_ptr].seq16 = pkt->m_flags & XGRID_PKT_M_SEQ16;
+        compare_buffer[compare_buffer_ptr].relayed = 0;
+        
+        compare_buffer_ptr++;
+        if (compare_buffer_ptr >= XGRID_COMPARE_BUFFER_SIZE)
+                compare_buffer_ptr = 0;
+        
+        return 1;
+}
+
+
+void Xgrid::set_relayed(Packet *pkt)
+{
+        int8_t i = find_compare(pkt);
+        
+        if (i >= 0)
+                compare_buffer[i].relayed = 1;
 }
 
 
-int8_t Xgrid::get_free_buffer(uint16_t data_size)
+uint8_t Xgrid::get_priority(uint8_t type, uint8_t flags)
 {
+        // firmware blocks are maintenance traffic, but
+        // they are large and must not crowd out control packets
+        if (type == XGRID_PKT_FIRMWARE_BLOCK)
+                return XGRID_PRIO_NORMAL;
+        
+        // aggregates only carry bulk packets
+        if (type == XGRID_PKT_AGGREGATE)
+                return XGRID_PRIO_BULK;
+        
+        if ((type & 0xF0) == 0xF0)
+                return XGRID_PRIO_CONTROL;
+        
+        if (flags & XGRID_PKT_FLAG_PRIORITY)
+                return XGRID_PRIO_NORMAL;
+        
+        // services can put their type ahead of bulk
+        if (type_options(type) & XGRID_HANDLER_PRIORITY)
+                return XGRID_PRIO_NORMAL;
+        
+        return XGRID_PRIO_BULK;
+}
+
+
+uint8_t Xgrid::buffer_class(uint8_t i)
+{
+        return (i == XGRID_LG_BUFFER_IND) ? 1 : 0;
+}
+
+
+int8_t Xgrid::get_free_buffer(uint16_t data_size, uint8_t prio)
+{
+        uint8_t used[XGRID_BUFFER_CLASS_CNT] = {0, 0};
+        uint8_t lg_busy = pkt_buffer[XGRID_LG_BUFFER_IND].flags & XGRID_BUFFER_IN_USE;
+        uint8_t lent_busy = 0;
+        uint8_t sm_limit = XGRID_SM_BUFFER_COUNT;
+        
+        for (int i = 0; i < XGRID_BUFFER_COUNT; i++)
+        {
+                if (pkt_buffer[i].flags & XGRID_BUFFER_IN_USE)
+                {
+                        used[buffer_class(i)]++;
+                        
+                        if (i > XGRID_LG_BUFFER_IND)
+                                lent_busy = 1;
+                }
+        }
+        
+        // lent buffers only count while they can be had
+        if (!lg_busy && !lg_wait)
+                sm_limit += XGRID_SM_LENT_COUNT;
+        
+        // keep some small buffers in reserve for higher priority traffic
+        if (prio >= XGRID_PRIO_NORMAL)
+                sm_limit -= XGRID_SM_BUFFER_RESERVE_CONTROL;
+        if (prio >= XGRID_PRIO_BULK)
+                sm_limit -= XGRID_SM_BUFFER_RESERVE_NORMAL;
+        
         for (int i = 0; i < XGRID_BUFFER_COUNT; i++)
         {
+                uint8_t c = buffer_class(i);
+                
+                if (c == 0 && used[0] >= sm_limit)
+                        continue;
+                
+                // large buffer and the small ones lent
+                // out of it can't be used at the same time
+                if (i == XGRID_LG_BUFFER_IND && lent_busy)
+                        continue;
+                if (i > XGRID_LG_BUFFER_IND && (lg_busy || lg_wait))
+                        continue;
+                
                 if ((pkt_buffer[i].flags & XGRID_BUFFER_IN_USE) == 0 && pkt_buffer[i].buffer_len >= data_size)
+                {
+                        pkt_buffer[i].prio = prio;
+                        
+                        buffer_stats[c].allocs++;
+                        if (buffer_stats[c].max_used < used[c] + 1)
+                                buffer_stats[c].max_used = used[c] + 1;
+                        
                         return i;
+                }
         }
+        
+        buffer_stats[data_size > XGRID_SM_BUFFER_SIZE ? 1 : 0].alloc_fail++;
+        
+        // let the loans drain
+        if (data_size > XGRID_SM_BUFFER_SIZE && lent_busy)
+                lg_wait = XGRID_LG_WAIT;
+        
         return -1;
 }
 
 
-void Xgrid::send_packet(Packet *pkt, uint16_t mask)
+void Xgrid::update_route(uint16_t id, uint8_t port, uint8_t metric)
 {
-        pkt->source_id = my_id;
-        pkt->seq = cur_seq++;
-        pkt->rx_node = 0xFF;
+        int8_t ind = -1;
         
-        send_raw_packet(pkt, mask);
-}
-
-
-void Xgrid::send_raw_packet(Packet *pkt, uint16_t mask)
-{
-        uint8_t saved_status = SREG;
-        cli();
+        // no need for a route to ourselves
+        if (id == my_id)
+                return;
         
-        // drop packet if not firmware releated during update cycle
-        if (state == XGRID_STATE_FW_RX && ((pkt->type & 0xF0) != 0xF0))
+        if (metric > XGRID_ROUTE_INFINITY)
+                metric = XGRID_ROUTE_INFINITY;
+        
+        for (uint8_t i = 0; i < XGRID_ROUTE_TABLE_SIZE; i++)
         {
-                SREG = saved_status;
-                return;
+                xgrid_route_t *r = &(route_table[i]);
+                
+                if (r->id == id)
+                {
+                        // always believe the current next hop,
+                        // otherwise only take a shorter route
+                        if (r->port == port || metric < r->metric)
+                        {
+                                r->port = port;
+                                r->metric = metric;
+                                r->age = 0;
+                        }
+                        return;
+                }
+                
+                if (ind < 0 && r->metric >= XGRID_ROUTE_INFINITY)
+                        ind = i;
         }
-        // don't send extra packets to the node we're updating
-        if (state == XGRID_STATE_FW_TX && ((pkt->type & 0xF0) != 0xF0))
-                mask &= ~ update_node_mask;
         
-        // get buffer index
-        int8_t bi = get_free_buffer(pkt->data_len);
+        // don't add unreachable destinations
+        if (metric >= XGRID_ROUTE_INFINITY)
+                return;
         
-        if (bi < 0)
+        // table full, replace longest route if new one is shorter
+        if (ind < 0)
         {
-                SREG = saved_status;
-                return;
+                uint8_t worst = metric;
+                
+                for (uint8_t i = 0; i < XGRID_ROUTE_TABLE_SIZE; i++)
+                {
+                        if (route_table[i].metric > worst)
+                        {
+                                worst = route_table[i].metric;
+                                ind = i;
+                        }
+                }
+                
+                if (ind < 0)
+                        return;
         }
         
-        xgrid_buffer_t *buffer = &(pkt_buffer[bi]);
+        route_table[ind].id = id;
+        route_table[ind].port = port;
+        route_table[ind].metric = metric;
+        route_table[ind].age = 0;
+}
+
+
+void Xgrid::age_routes()
+{
+        for (uint8_t i = 0; i < XGRID_ROUTE_TABLE_SIZE; i++)
+        {
+                xgrid_route_t *r = &(route_table[i]);
+                
+                if (r->metric < XGRID_ROUTE_INFINITY)
+                {
+                        // expire routes that have not been refreshed
+                        if (++r->age > XGRID_ROUTE_MAX_AGE)
+                                r->metric = XGRID_ROUTE_INFINITY;
+                }
+        }
+}
+
+
+void Xgrid::send_route_update(uint8_t port)
+{
+        xgrid_pkt_route_entry_t buffer[XGRID_ROUTE_TABLE_SIZE];
+        uint8_t cnt = 0;
+        Packet pkt;
         
-        // flag it for use
-        buffer->flags |= XGRID_BUFFER_IN_USE_TX;
+        for (uint8_t i = 0; i < XGRID_ROUTE_TABLE_SIZE; i++)
+        {
+                xgrid_route_t *r = &(route_table[i]);
+                
+                if (r->metric < XGRID_ROUTE_INFINITY)
+                {
+                        buffer[cnt].id = r->id;
+                        
+                        // split horizon with poisoned reverse
+                        if (r->port == port)
+                                buffer[cnt].metric = XGRID_ROUTE_INFINITY;
+                        else
+                                buffer[cnt].metric = r->metric;
+                        
+                        cnt++;
+                }
+        }
         
-        xgrid_header_t *hdr = &(buffer->hdr);
+        // send even if empty so neighbor can learn our ID
+        pkt.type = XGRID_PKT_ROUTE_UPDATE;
+        pkt.flags = 0;
+        pkt.radius = 1;
+        pkt.data = (uint8_t *)buffer;
+        pkt.data_len = cnt * sizeof(xgrid_pkt_route_entry_t);
         
-        // packet header information
-        hdr->identifier = XGRID_IDENTIFIER;
-        hdr->size = pkt->data_len + sizeof(xgrid_header_short_t);
-        hdr->source_id = pkt->source_id;
-        hdr->type = pkt->type;
-        hdr->seq = pkt->seq;
-        hdr->flags = pkt->flags;
-        hdr->radius = pkt->radius;
+        send_packet(&pkt, (1 << port));
+}
+
+
+uint16_t Xgrid::get_route_mask(uint16_t dest_id, uint8_t rx_node)
+{
+        uint16_t mask = 0xFFFF;
         
-        buffer->mask = mask;
+        // we're the destination, don't forward
+        if (dest_id == my_id)
+                return 0;
         
-        // copy in data
-        for (uint16_t i = 0; i < pkt->data_len; i++)
+        for (uint8_t i = 0; i < XGRID_ROUTE_TABLE_SIZE; i++)
         {
-                buffer->buffer[i] = pkt->data[i];
+                xgrid_route_t *r = &(route_table[i]);
+                
+                if (r->id == dest_id && r->metric < XGRID_ROUTE_INFINITY)
+                {
+                        // route leads back where the packet came from,
+                        // flooding it would only bounce it around
+                        if (r->port == rx_node)
+                        {
+                                nodes[rx_node].stats.no_route++;
+                                return 0;
+                        }
+                        
+                        return (1 << r->port);
+                }
         }
         
-        // start at zero
-        buffer->ptr = 0;
+        // no route, fall back to flooding
+        if (rx_node < 16)
+                mask &= ~(1 << rx_node);
         
-        SREG = saved_status;
+        return mask;
 }
 
 
-uint8_t Xgrid::try_read_packet(Packet *pkt, IStream *stream)
+// route back to the source of a flooded request along
+// the port its first copy arrived on, radius is what the
+// source sent it with, so replies don't have to flood
+void Xgrid::learn_reverse_route(Packet *pkt, uint8_t radius)
 {
-        uint8_t buffer[XGRID_BUFFER_SIZE];
-        uint16_t len;
+        if (pkt->rx_node >= node_cnt || pkt->radius > radius)
+                return;
         
-        // don't do anything if data pointer is null
-        if (pkt->data == 0)
-                return 0;
+        update_route(pkt->source_id, pkt->rx_node, radius - pkt->radius + 1);
+}
+
+
+uint8_t Xgrid::is_neighbor(uint16_t id)
+{
+        if (id == my_id)
+                return 1;
         
-        // drop bytes until we get a XGRID_IDENTIFIER
-        while (stream->available() > 0 && stream->peek() != XGRID_IDENTIFIER)
-                stream->get();
+        for (uint8_t n = 0; n < node_cnt; n++)
+        {
+                if (nodes[n].hello_age <= XGRID_HELLO_MAX_AGE && nodes[n].neighbor_id == id)
+                        return 1;
+        }
         
-        // return if we're not looking at a packet
-        if (stream->peek() != XGRID_IDENTIFIER)
-                return 0;
+        return 0;
+}
+
+
+uint8_t Xgrid::node_reaches(uint8_t n, uint16_t id)
+{
+        for (uint8_t k = 0; k < nodes[n].two_hop_cnt; k++)
+        {
+                if (nodes[n].two_hop[k] == id)
+                        return 1;
+        }
         
-        // grab length
-        if (stream->available() < 3)
-                return 0;
+        return 0;
+}
+
+
+uint8_t Xgrid::link_caps(uint8_t n)
+{
+        xgrid_node_t *node = &(nodes[n]);
         
-        len = stream->peek(1) | (stream->peek(2) << 8);
+        // capabilities only count over a two way link
+        // to a neighbor heard from recently
+        if (node->hello_age <= XGRID_HELLO_MAX_AGE && node->link_sym)
+                return node->caps;
         
-        // return if the whole packet isn't available yet
-        if (stream->available() < len + 3)
-                return 0;
+        return 0;
+}
+
+
+void Xgrid::age_neighbors()
+{
+        for (uint8_t n = 0; n < node_cnt; n++)
+        {
+                if (nodes[n].hello_age <= XGRID_HELLO_MAX_AGE)
+                {
+                        // forget neighbors that have gone quiet
+                        if (++nodes[n].hello_age > XGRID_HELLO_MAX_AGE)
+                        {
+                                nodes[n].two_hop_cnt = 0;
+                                nodes[n].mpr_selector = 0;
+                                nodes[n].caps = 0;
+                                nodes[n].link_sym = 0;
+                                nodes[n].credits_valid = 0;
+                        }
+                }
+                
+                check_baud(n);
+        }
+}
+
+
+void Xgrid::select_mprs()
+{
+        uint16_t mask = 0;
         
-        // drop header
-        stream->get();
-        stream->get();
-        stream->get();
+        // always relay through ports where the neighborhood is unknown
+        for (uint8_t n = 0; n < node_cnt; n++)
+        {
+                if (nodes[n].hello_age > XGRID_HELLO_MAX_AGE)
+                        mask |= (1 << n);
+        }
         
-        // read data
-        stream->read(buffer, len);
+        // select neighbors that are the only path to a two-hop neighbor
+        for (uint8_t n = 0; n < node_cnt; n++)
+        {
+                if (mask & (1 << n))
+                        continue;
+                
+                for (uint8_t k = 0; k < nodes[n].two_hop_cnt; k++)
+                {
+                        uint16_t id = nodes[n].two_hop[k];
+                        uint8_t cnt = 0;
+                        
+                        if (is_neighbor(id))
+                                continue;
+                        
+                        for (uint8_t m = 0; m < node_cnt; m++)
+                        {
+                                if (node_reaches(m, id))
+                                        cnt++;
+                        }
+                        
+                        if (cnt == 1)
+                        {
+                                mask |= (1 << n);
+                                break;
+                        }
+                }
+        }
         
-        return try_parse_packet(pkt, buffer, len);
+        // greedily cover the rest
+        while (1)
+        {
+                uint8_t best = 0xFF;
+                uint8_t best_cnt = 0;
+                
+                for (uint8_t n = 0; n < node_cnt; n++)
+                {
+                        uint8_t cnt = 0;
+                        
+                        if (mask & (1 << n))
+                                continue;
+                        
+                        for (uint8_t k = 0; k < nodes[n].two_hop_cnt; k++)
+                        {
+                                uint16_t id = nodes[n].two_hop[k];
+                                uint8_t covered = is_neighbor(id);
+                                
+                                for (uint8_t m = 0; m < node_cnt && !covered; m++)
+                                {
+                                        if ((mask & (1 << m)) && node_reaches(m, id))
+                                                covered = 1;
+                                }
+                                
+                                if (!covered)
+                                        cnt++;
+                        }
+                        
+                        if (cnt > best_cnt)
+                        {
+                                best_cnt = cnt;
+                                best = n;
+                        }
+                }
+                
+                if (best == 0xFF)
+                        break;
+                
+                mask |= (1 << best);
+        }
+        
+        mpr_mask = mask;
 }
 
 
-uint8_t Xgrid::try_parse_packet(Packet *pkt, const uint8_t *buffer, uint16_t len)
+void Xgrid::send_hello()
 {
-        if (len < sizeof(xgrid_header_short_t))
+        uint8_t buffer[sizeof(xgrid_pkt_hello_t) + XGRID_MAX_NODES * sizeof(xgrid_pkt_hello_entry_t)];
+        xgrid_pkt_hello_t *hello = (xgrid_pkt_hello_t *)buffer;
+        uint8_t cnt = 0;
+        Packet pkt;
+        
+        hello->caps = XGRID_CAPS;
+        hello->load = load;
+        
+        if (set_node_baud)
+                hello->caps |= XGRID_CAP_BAUD;
+        
+        for (uint8_t n = 0; n < node_cnt; n++)
+        {
+                if (nodes[n].hello_age <= XGRID_HELLO_MAX_AGE)
+                {
+                        hello->neighbors[cnt].id = nodes[n].neighbor_id;
+                        hello->neighbors[cnt].flags = 0;
+                        
+                        if (mpr_mask & (1 << n))
+                                hello->neighbors[cnt].flags |= XGRID_HELLO_FLAG_MPR;
+                        
+                        cnt++;
+                }
+        }
+        
+        pkt.type = XGRID_PKT_HELLO;
+        pkt.flags = 0;
+        pkt.radius = 1;
+        pkt.data = buffer;
+        pkt.data_len = sizeof(xgrid_pkt_hello_t) + cnt * sizeof(xgrid_pkt_hello_entry_t);
+        
+        send_packet(&pkt);
+}
+
+
+uint8_t Xgrid::should_forward(Packet *pkt)
+{
+        if (pkt->radius <= 1)
+                return 0;
+        
+        // unicast packets go until they reach the destination
+        if (pkt->flags & XGRID_PKT_FLAG_UNICAST)
+                return pkt->dest_id != my_id;
+        
+        // service only wants broadcasts from its neighbors
+        int8_t h = find_handler(pkt);
+        
+        if (h >= 0 && (handlers[h].options & XGRID_HANDLER_LOCAL))
+                return 0;
+        
+        // classic flooding if we don't know the previous hop
+        if (pkt->rx_node >= node_cnt || nodes[pkt->rx_node].hello_age > XGRID_HELLO_MAX_AGE)
+                return 1;
+        
+        // otherwise only rebroadcast if the previous hop
+        // selected us as a multipoint relay
+        return nodes[pkt->rx_node].mpr_selector;
+}
+
+
+uint8_t Xgrid::get_queue_depth()
+{
+        uint8_t cnt = 0;
+        
+        for (uint8_t i = 0; i < XGRID_BUFFER_COUNT; i++)
+        {
+                if (pkt_buffer[i].flags & XGRID_BUFFER_IN_USE)
+                        cnt++;
+        }
+        
+        return cnt;
+}
+
+
+void Xgrid::send_topology_reply(Packet *pkt)
+{
+        uint8_t buffer[sizeof(xgrid_pkt_topology_reply_t) + XGRID_MAX_NODES * sizeof(xgrid_pkt_topology_entry_t)];
+        xgrid_pkt_topology_reply_t *r = (xgrid_pkt_topology_reply_t *)buffer;
+        uint8_t cnt = 0;
+        Packet reply;
+        
+        r->queue = get_queue_depth();
+        
+        for (uint8_t n = 0; n < node_cnt; n++)
+        {
+                xgrid_pkt_topology_entry_t *e = &(r->neighbors[cnt]);
+                
+                if (nodes[n].hello_age > XGRID_HELLO_MAX_AGE)
+                        continue;
+                
+                e->id = nodes[n].neighbor_id;
+                e->port = n;
+                e->rtt = nodes[n].rtt;
+                e->loss = 0;
+                if (nodes[n].ping_tx > 0)
+                        e->loss = ((uint16_t)(nodes[n].ping_tx - nodes[n].ping_rx) * 100) / nodes[n].ping_tx;
+                e->queue = nodes[n].queue;
+                e->errors = nodes[n].stats.resync_bytes + nodes[n].stats.rx_errors + nodes[n].stats.rx_timeouts;
+                
+                cnt++;
+        }
+        
+        // send straight back to requester
+        reply.type = XGRID_PKT_TOPOLOGY_REPLY;
+        reply.flags = XGRID_PKT_FLAG_UNICAST;
+        reply.dest_id = pkt->source_id;
+        reply.radius = XGRID_TOPOLOGY_RADIUS;
+        reply.data = buffer;
+        reply.data_len = sizeof(xgrid_pkt_topology_reply_t) + cnt * sizeof(xgrid_pkt_topology_entry_t);
+        
+        if (pkt->data_len >= sizeof(xgrid_pkt_topology_request_t))
+                reply.radius = ((xgrid_pkt_topology_request_t *)(pkt->data))->radius;
+        
+        learn_reverse_route(pkt, reply.radius);
+        
+        send_packet(&reply);
+}
+
+
+void Xgrid::reset_stats()
+{
+        for (uint8_t n = 0; n < node_cnt; n++)
+        {
+                memset(&(nodes[n].stats), 0, sizeof(xgrid_pkt_stats_port_t));
+                nodes[n].baud_errors = 0;
+        }
+        
+        for (uint8_t c = 0; c < XGRID_BUFFER_CLASS_CNT; c++)
+        {
+                buffer_stats[c].max_used = 0;
+                buffer_stats[c].allocs = 0;
+                buffer_stats[c].alloc_fail = 0;
+        }
+}
+
+
+void Xgrid::send_stats_reply(Packet *pkt)
+{
+        xgrid_pkt_stats_request_t *req = (xgrid_pkt_stats_request_t *)(pkt->data);
+        
+        // replies go out one part per tick from process(),
+        // a new request restarts them
+        stats_dest = pkt->source_id;
+        stats_radius = XGRID_TOPOLOGY_RADIUS;
+        stats_flags = 0;
+        stats_part = XGRID_STATS_PART_BUFFERS;
+        stats_active = 1;
+        
+        if (pkt->data_len >= sizeof(xgrid_pkt_stats_request_t))
+        {
+                stats_radius = req->radius;
+                stats_flags = req->flags;
+        }
+        
+        learn_reverse_route(pkt, stats_radius);
+}
+
+
+void Xgrid::send_stats_part()
+{
+        uint8_t buffer[sizeof(xgrid_pkt_stats_reply_t) + sizeof(xgrid_pkt_stats_port_t)];
+        xgrid_pkt_stats_reply_t *r = (xgrid_pkt_stats_reply_t *)buffer;
+        Packet reply;
+        
+        if (!stats_active)
+                return;
+        
+        r->ticks = ticks;
+        r->port_cnt = node_cnt;
+        r->class_cnt = XGRID_BUFFER_CLASS_CNT;
+        r->part = stats_part;
+        
+        reply.type = XGRID_PKT_STATS_REPLY;
+        reply.flags = XGRID_PKT_FLAG_UNICAST;
+        reply.dest_id = stats_dest;
+        reply.radius = stats_radius;
+        
+        if (stats_part == XGRID_STATS_PART_BUFFERS)
+        {
+                reply.data = (uint8_t *)buffer_stats;
+                reply.data_len = sizeof(buffer_stats);
+        }
+        else
+        {
+                reply.data = (uint8_t *)&(nodes[stats_part].stats);
+                reply.data_len = sizeof(xgrid_pkt_stats_port_t);
+        }
+        
+        // out of buffers, try again next tick
+        if (send_packet_gather(&reply, buffer, sizeof(xgrid_pkt_stats_reply_t)) == XGRID_SEND_NO_BUFFER)
+                return;
+        
+        stats_part++;
+        
+        if (stats_part < node_cnt)
+                return;
+        
+        stats_active = 0;
+        
+        if (stats_flags & XGRID_STATS_FLAG_RESET)
+                reset_stats();
+}
+
+
+uint16_t Xgrid::aggregate_packet(Packet *pkt, uint16_t mask)
+{
+        uint16_t item_len = sizeof(xgrid_header_short_t) + pkt->data_len;
+        
+        if (pkt->flags & XGRID_PKT_FLAG_UNICAST)
+                item_len += sizeof(xgrid_pkt_unicast_t);
+        
+        for (uint8_t n = 0; n < node_cnt; n++)
+        {
+                xgrid_node_t *node = &(nodes[n]);
+                xgrid_buffer_t *buffer;
+                
+                if (!(mask & (1 << n)))
+                        continue;
+                
+                // send current aggregate if packet won't fit
+                if (node->agg_buffer >= 0)
+                {
+                        buffer = &(pkt_buffer[node->agg_buffer]);
+                        
+                        if (buffer->hdr.size - sizeof(xgrid_header_short_t) + 1 + item_len > buffer->buffer_len)
+                                flush_aggregate(n);
+                }
+                
+                // start a new aggregate
+                if (node->agg_buffer < 0)
+                {
+                        int8_t bi = get_free_buffer(XGRID_SM_BUFFER_SIZE, XGRID_PRIO_BULK);
+                        
+                        // only use small buffers, otherwise send directly
+                        if (bi < 0 || buffer_class(bi) != 0)
+                                continue;
+                        
+                        buffer = &(pkt_buffer[bi]);
+                        
+                        buffer->flags |= XGRID_BUFFER_IN_USE_AGG;
+                        
+                        buffer->hdr.identifier = XGRID_IDENTIFIER;
+                        buffer->hdr.size = sizeof(xgrid_header_short_t);
+                        buffer->hdr.source_id = my_id;
+                        buffer->hdr.type = XGRID_PKT_AGGREGATE;
+                        buffer->hdr.seq = cur_seq;
+                        buffer->hdr.flags = 0;
+                        buffer->hdr.radius = 1;
+                        
+                        buffer->seq_hi = cur_seq >> 8;
+                        buffer->flags |= XGRID_BUFFER_SEQ16;
+                        cur_seq++;
+                        
+                        buffer->mask = (1 << n);
+                        buffer->timestamp = ticks;
+                        
+                        node->agg_buffer = bi;
+                        node->agg_deadline = ticks + aggregate_latency;
+                }
+                
+                buffer = &(pkt_buffer[node->agg_buffer]);
+                
+                // append item
+                xgrid_pkt_aggregate_item_t *item = (xgrid_pkt_aggregate_item_t *)(buffer->buffer + buffer->hdr.size - sizeof(xgrid_header_short_t));
+                uint8_t *ptr = item->data;
+                
+                item->len = item_len;
+                item->source_id = pkt->source_id;
+                item->type = pkt->type;
+                item->seq = pkt->seq;
+                item->flags = pkt->flags;
+                item->radius = pkt->radius;
+                
+                if (pkt->flags & XGRID_PKT_FLAG_UNICAST)
+                {
+                        ((xgrid_pkt_unicast_t *)ptr)->dest_id = pkt->dest_id;
+                        ptr += sizeof(xgrid_pkt_unicast_t);
+                }
+                
+                memcpy(ptr, pkt->data, pkt->data_len);
+                
+                buffer->hdr.size += 1 + item_len;
+                
+                mask &= ~(1 << n);
+        }
+        
+        return mask;
+}
+
+
+void Xgrid::flush_aggregate(uint8_t n)
+{
+        xgrid_buffer_t *buffer = &(pkt_buffer[nodes[n].agg_buffer]);
+        
+        // hand off to transmit
+        buffer->flags &= ~XGRID_BUFFER_IN_USE_AGG;
+        queue_buffer(buffer, buffer->mask);
+        
+        nodes[n].agg_buffer = -1;
+}
+
+
+uint8_t Xgrid::send_packet(Packet *pkt, uint16_t mask)
+{
+        pkt->source_id = my_id;
+        pkt->seq = cur_seq++;
+        pkt->rx_node = 0xFF;
+        pkt->m_flags = XGRID_PKT_M_SEQ16;
+        
+        return send_raw_packet(pkt, mask);
+}
+
+
+uint8_t Xgrid::send_raw_packet(Packet *pkt, uint16_t mask)
+{
+        if (pkt->data_len > XGRID_LG_BUFFER_SIZE)
+                return XGRID_SEND_TOO_LARGE;
+        
+        uint8_t saved_status = SREG;
+        cli();
+        
+        uint8_t ret = route_packet(pkt, &mask);
+        
+        if (ret != XGRID_SEND_OK && ret != XGRID_SEND_CONGESTED)
+        {
+                SREG = saved_status;
+                return ret;
+        }
+        
+        uint16_t data_len = pkt->data_len;
+        
+        if (pkt->flags & XGRID_PKT_FLAG_UNICAST)
+                data_len += sizeof(xgrid_pkt_unicast_t);
+        
+        // combine small bulk packets
+        if (aggregate_latency > 0 &&
+                get_priority(pkt->type, pkt->flags) == XGRID_PRIO_BULK &&
+                data_len + sizeof(xgrid_header_short_t) <= XGRID_AGGREGATE_MAX_ITEM)
+        {
+                mask = aggregate_packet(pkt, mask);
+        }
+        
+        SREG = saved_status;
+        
+        if (mask == 0)
+                return ret;
+        
+        Packet p = *pkt;
+        int8_t bi = reserve_packet(&p);
+        
+        if (bi < 0)
+                return XGRID_SEND_NO_BUFFER;
+        
+        // copy in data with interrupts enabled
+        memcpy(p.data, pkt->data, pkt->data_len);
+        
+        return commit_raw_packet(&p, bi, mask);
+}
+
+
+uint8_t Xgrid::send_port_packet(Packet *pkt, uint8_t port, uint16_t mask)
+{
+        return send_packet_gather(pkt, &port, 1, mask);
+}
+
+
+uint8_t Xgrid::send_packet_gather(Packet *pkt, const uint8_t *head, uint16_t head_len, uint16_t mask)
+{
+        Packet p = *pkt;
+        
+        p.data_len = head_len + pkt->data_len;
+        
+        int8_t bi = reserve_packet(&p);
+        
+        if (bi < 0)
+                return p.data_len > XGRID_LG_BUFFER_SIZE ? XGRID_SEND_TOO_LARGE : XGRID_SEND_NO_BUFFER;
+        
+        memcpy(p.data, head, head_len);
+        memcpy(p.data + head_len, pkt->data, pkt->data_len);
+        
+        return commit_packet(&p, bi, mask);
+}
+
+
+// must be called with interrupts disabled
+uint8_t Xgrid::route_packet(Packet *pkt, uint16_t *mask)
+{
+        // drop packet if not firmware releated during update cycle
+        if (state == XGRID_STATE_FW_RX && ((pkt->type & 0xF0) != 0xF0))
+                return XGRID_SEND_BLOCKED;
+        // don't send extra packets to the node we're updating
+        if (state == XGRID_STATE_FW_TX && ((pkt->type & 0xF0) != 0xF0))
+                *mask &= ~ update_node_mask;
+        
+        // unicast packets follow the routing table
+        uint16_t data_len = pkt->data_len;
+        uint8_t prio = get_priority(pkt->type, pkt->flags);
+        
+        if (pkt->flags & XGRID_PKT_FLAG_UNICAST)
+        {
+                *mask &= get_route_mask(pkt->dest_id, pkt->rx_node);
+                data_len += sizeof(xgrid_pkt_unicast_t);
+        }
+        
+        *mask &= (1 << node_cnt) - 1;
+        
+        if (*mask == 0)
+                return XGRID_SEND_NO_ROUTE;
+        
+        // tell the sender to back off if any
+        // neighbor on the way is out of room
+        for (uint8_t n = 0; n < node_cnt; n++)
+        {
+                int8_t c = credit_class(n, data_len, prio);
+                
+                if ((*mask & (1 << n)) && c >= 0 && nodes[n].credits[c] == 0)
+                        return XGRID_SEND_CONGESTED;
+        }
+        
+        return XGRID_SEND_OK;
+}
+
+
+int8_t Xgrid::reserve_packet(Packet *pkt)
+{
+        uint16_t data_len = pkt->data_len;
+        
+        if (pkt->flags & XGRID_PKT_FLAG_UNICAST)
+                data_len += sizeof(xgrid_pkt_unicast_t);
+        
+        if (data_len > XGRID_LG_BUFFER_SIZE)
+                return -1;
+        
+        uint8_t saved_status = SREG;
+        cli();
+        
+        int8_t bi = get_free_buffer(data_len, get_priority(pkt->type, pkt->flags));
+        
+        // held by the caller until commit or cancel
+        if (bi >= 0)
+                pkt_buffer[bi].flags |= XGRID_BUFFER_IN_USE_APP;
+        
+        SREG = saved_status;
+        
+        if (bi < 0)
+                return -1;
+        
+        // destination goes ahead of data
+        pkt->data = pkt_buffer[bi].buffer;
+        
+        if (pkt->flags & XGRID_PKT_FLAG_UNICAST)
+                pkt->data += sizeof(xgrid_pkt_unicast_t);
+        
+        return bi;
+}
+
+
+uint8_t Xgrid::commit_packet(Packet *pkt, int8_t handle, uint16_t mask)
+{
+        pkt->source_id = my_id;
+        pkt->seq = cur_seq++;
+        pkt->rx_node = 0xFF;
+        pkt->m_flags = XGRID_PKT_M_SEQ16;
+        
+        return commit_raw_packet(pkt, handle, mask);
+}
+
+
+uint8_t Xgrid::commit_raw_packet(Packet *pkt, int8_t handle, uint16_t mask)
+{
+        xgrid_buffer_t *buffer = &(pkt_buffer[handle]);
+        xgrid_header_t *hdr = &(buffer->hdr);
+        uint16_t data_len = pkt->data_len;
+        
+        if (pkt->flags & XGRID_PKT_FLAG_UNICAST)
+                data_len += sizeof(xgrid_pkt_unicast_t);
+        
+        if (data_len > buffer->buffer_len)
+        {
+                cancel_packet(handle);
+                return XGRID_SEND_TOO_LARGE;
+        }
+        
+        uint8_t saved_status = SREG;
+        cli();
+        
+        uint8_t ret = route_packet(pkt, &mask);
+        
+        if (ret != XGRID_SEND_OK && ret != XGRID_SEND_CONGESTED)
+        {
+                buffer->flags &= ~ XGRID_BUFFER_IN_USE;
+                SREG = saved_status;
+                return ret;
+        }
+        
+        // packet header information
+        hdr->identifier = XGRID_IDENTIFIER;
+        hdr->size = data_len + sizeof(xgrid_header_short_t);
+        hdr->source_id = pkt->source_id;
+        hdr->type = pkt->type;
+        hdr->seq = pkt->seq;
+        hdr->flags = pkt->flags;
+        hdr->radius = pkt->radius;
+        
+        buffer->seq_hi = pkt->seq >> 8;
+        
+        if (pkt->m_flags & XGRID_PKT_M_SEQ16)
+                buffer->flags |= XGRID_BUFFER_SEQ16;
+        else
+                buffer->flags &= ~XGRID_BUFFER_SEQ16;
+        
+        // destination goes ahead of data
+        if (pkt->flags & XGRID_PKT_FLAG_UNICAST)
+                ((xgrid_pkt_unicast_t *)buffer->buffer)->dest_id = pkt->dest_id;
+        
+        // hand off to transmit
+        buffer->flags &= ~XGRID_BUFFER_IN_USE_APP;
+        buffer->timestamp = ticks;
+        queue_buffer(buffer, mask);
+        
+        SREG = saved_status;
+        
+        return ret;
+}
+
+
+void Xgrid::cancel_packet(int8_t handle)
+{
+        uint8_t saved_status = SREG;
+        cli();
+        
+        pkt_buffer[handle].flags &= ~ XGRID_BUFFER_IN_USE;
+        
+        SREG = saved_status;
+}
+
+
+uint8_t Xgrid::send_message(Packet *pkt, uint16_t mask)
+{
+        uint16_t max_len = XGRID_SM_BUFFER_SIZE;
+        
+        if (pkt->flags & XGRID_PKT_FLAG_UNICAST)
+                max_len -= sizeof(xgrid_pkt_unicast_t);
+        
+        // fits in one small buffer
+        if (pkt->data_len <= max_len)
+                return send_packet(pkt, mask);
+        
+        if (pkt->data_len > XGRID_FRAG_MAX_SIZE)
+                return XGRID_SEND_TOO_LARGE;
+        
+        uint8_t saved_status = SREG;
+        cli();
+        
+        if (frag_busy)
+        {
+                SREG = saved_status;
+                return XGRID_SEND_BUSY;
+        }
+        
+        frag_pkt = *pkt;
+        frag_mask = mask;
+        frag_offset = 0;
+        frag_msg_id++;
+        frag_busy = 1;
+        
+        SREG = saved_status;
+        
+        return XGRID_SEND_OK;
+}
+
+
+uint8_t Xgrid::message_pending()
+{
+        return frag_busy;
+}
+
+
+void Xgrid::set_message_buffer(uint8_t *buffer, uint16_t len)
+{
+        uint8_t saved_status = SREG;
+        cli();
+        
+        msg_buffer = buffer;
+        msg_buffer_len = len;
+        msg_active = 0;
+        msg_held = 0;
+        
+        SREG = saved_status;
+}
+
+
+void Xgrid::send_fragments()
+{
+        xgrid_pkt_fragment_t f;
+        
+        while (frag_busy)
+        {
+                Packet pkt = frag_pkt;
+                uint16_t len = frag_pkt.data_len - frag_offset;
+                
+                if (len > XGRID_FRAG_DATA_SIZE)
+                        len = XGRID_FRAG_DATA_SIZE;
+                
+                f.msg_id = frag_msg_id;
+                f.offset = frag_offset;
+                f.total = frag_pkt.data_len;
+                
+                pkt.flags |= XGRID_PKT_FLAG_FRAGMENT;
+                pkt.data = frag_pkt.data + frag_offset;
+                pkt.data_len = len;
+                
+                uint8_t ret = send_packet_gather(&pkt, (uint8_t *)&f, sizeof(xgrid_pkt_fragment_t), frag_mask);
+                
+                // out of buffers, try again next cycle
+                if (ret == XGRID_SEND_NO_BUFFER)
+                        break;
+                
+                // message can't get through
+                if (ret != XGRID_SEND_OK && ret != XGRID_SEND_CONGESTED)
+                {
+                        frag_busy = 0;
+                        break;
+                }
+                
+                frag_offset += len;
+                
+                if (frag_offset >= frag_pkt.data_len)
+                        frag_busy = 0;
+                
+                // queued, but back off until there is room
+                if (ret == XGRID_SEND_CONGESTED)
+                        break;
+        }
+}
+
+
+void Xgrid::receive_fragment(Packet *pkt)
+{
+        // last message not handled yet
+        if (msg_buffer == 0 || msg_held || pkt->data_len < sizeof(xgrid_pkt_fragment_t))
+                return;
+        
+        xgrid_pkt_fragment_t *f = (xgrid_pkt_fragment_t *)(pkt->data);
+        uint16_t len = pkt->data_len - sizeof(xgrid_pkt_fragment_t);
+        uint16_t idx = f->offset / XGRID_FRAG_DATA_SIZE;
+        
+        // drop anything that won't fit, and empty messages
+        if (f->total == 0 || f->total > msg_buffer_len || f->offset % XGRID_FRAG_DATA_SIZE ||
+                (uint32_t)f->offset + len > f->total || idx >= XGRID_FRAG_MAX_COUNT)
+                return;
+        
+        // one message at a time, a stalled one
+        // gives way once it times out
+        if (msg_active && (msg_source_id != pkt->source_id || msg_id != f->msg_id))
+        {
+                if (msg_age < XGRID_FRAG_TIMEOUT)
+                        return;
+                
+                msg_active = 0;
+        }
+        
+        if (!msg_active)
+        {
+                msg_source_id = pkt->source_id;
+                msg_id = f->msg_id;
+                msg_total = f->total;
+                msg_received = 0;
+                memset(msg_map, 0, sizeof(msg_map));
+                msg_active = 1;
+        }
+        
+        msg_age = 0;
+        
+        // skip repeats
+        if (msg_map[idx >> 3] & (1 << (idx & 7)))
+                return;
+        
+        msg_map[idx >> 3] |= 1 << (idx & 7);
+        memcpy(msg_buffer + f->offset, f->data, len);
+        msg_received += len;
+        
+        if (msg_received >= msg_total)
+        {
+                Packet msg = *pkt;
+                
+                msg.flags &= ~XGRID_PKT_FLAG_FRAGMENT;
+                msg.data = msg_buffer;
+                msg.data_len = msg_total;
+                
+                msg_active = 0;
+                
+                deliver_packet(&msg, XGRID_DELIVER_MESSAGE);
+        }
+}
+
+
+// bi is the buffer holding the data, or where the
+// data is not ours to hold, XGRID_DELIVER_DIRECT
+void Xgrid::deliver_packet(Packet *pkt, int8_t bi)
+{
+        int8_t h = find_handler(pkt);
+        
+        // small handlers can ask to run right away
+        if (bi == XGRID_DELIVER_DIRECT || (h >= 0 && (handlers[h].options & XGRID_HANDLER_IMMEDIATE)))
+        {
+                call_handler(pkt);
+                return;
+        }
+        
+        uint8_t saved_status = SREG;
+        cli();
+        
+        // nobody to take it or no room, drop
+        if ((h < 0 && rx_pkt == 0) || deliver_cnt >= XGRID_DELIVER_QUEUE_SIZE)
+        {
+                SREG = saved_status;
+                return;
+        }
+        
+        uint8_t tail = (deliver_head + deliver_cnt) % XGRID_DELIVER_QUEUE_SIZE;
+        
+        deliver_queue[tail] = *pkt;
+        deliver_buffer[tail] = bi;
+        deliver_cnt++;
+        
+        if (bi >= 0)
+        {
+                pkt_buffer[bi].deliver_refs++;
+                pkt_buffer[bi].flags |= XGRID_BUFFER_IN_USE_DELIVER;
+        }
+        else
+        {
+                msg_held = 1;
+        }
+        
+        SREG = saved_status;
+}
+
+
+// handler for type and port, falling back to one
+// registered for any port, fragments match by type
+int8_t Xgrid::find_handler(Packet *pkt)
+{
+        if (pkt->type >= XGRID_HANDLER_TYPES)
+                return -1;
+        
+        uint8_t port = XGRID_PORT_ANY;
+        int8_t any = -1;
+        
+        if (pkt->data_len > 0 && !(pkt->flags & XGRID_PKT_FLAG_FRAGMENT))
+                port = pkt->data[0];
+        
+        for (int8_t h = handler_first[pkt->type & (XGRID_HANDLER_BUCKETS - 1)]; h >= 0; h = handlers[h].next)
+        {
+                if (handlers[h].type != pkt->type)
+                        continue;
+                
+                if (handlers[h].port == XGRID_PORT_ANY)
+                {
+                        if (any < 0)
+                                any = h;
+                }
+                else if (handlers[h].port == port)
+                {
+                        return h;
+                }
+        }
+        
+        return any;
+}
+
+
+uint8_t Xgrid::type_options(uint8_t type)
+{
+        uint8_t options = 0;
+        
+        if (type >= XGRID_HANDLER_TYPES)
+                return 0;
+        
+        for (int8_t h = handler_first[type & (XGRID_HANDLER_BUCKETS - 1)]; h >= 0; h = handlers[h].next)
+        {
+                if (handlers[h].type == type)
+                        options |= handlers[h].options;
+        }
+        
+        return options;
+}
+
+
+void Xgrid::call_handler(Packet *pkt)
+{
+        int8_t h = find_handler(pkt);
+        
+        if (h < 0)
+        {
+                if (rx_pkt)
+                        (*rx_pkt)(pkt);
+                return;
+        }
+        
+        Packet p = *pkt;
+        
+        // strip port
+        if (handlers[h].port != XGRID_PORT_ANY)
+        {
+                p.data++;
+                p.data_len--;
+        }
+        
+        (*handlers[h].func)(&p);
+}
+
+
+int8_t Xgrid::register_handler(uint8_t type, uint8_t port, void (*func)(Packet *pkt), uint8_t options)
+{
+        if (type >= XGRID_HANDLER_TYPES || func == 0)
+                return -1;
+        
+        uint8_t saved_status = SREG;
+        cli();
+        
+        for (int8_t h = 0; h < XGRID_MAX_HANDLERS; h++)
+        {
+                if (handlers[h].func == 0)
+                {
+                        handlers[h].func = func;
+                        handlers[h].type = type;
+                        handlers[h].port = port;
+                        handlers[h].options = options;
+                        
+                        // newest registration wins
+                        handlers[h].next = handler_first[type & (XGRID_HANDLER_BUCKETS - 1)];
+                        handler_first[type & (XGRID_HANDLER_BUCKETS - 1)] = h;
+                        
+                        SREG = saved_status;
+                        return h;
+                }
+        }
+        
+        SREG = saved_status;
+        
+        return -1;
+}
+
+
+void Xgrid::unregister_handler(int8_t handle)
+{
+        if (handle < 0 || handle >= XGRID_MAX_HANDLERS || handlers[handle].func == 0)
+                return;
+        
+        uint8_t saved_status = SREG;
+        cli();
+        
+        int8_t *p = &(handler_first[handlers[handle].type & (XGRID_HANDLER_BUCKETS - 1)]);
+        
+        // unlink from bucket chain
+        while (*p >= 0 && *p != handle)
+                p = &(handlers[*p].next);
+        
+        if (*p == handle)
+                *p = handlers[handle].next;
+        
+        handlers[handle].func = 0;
+        
+        SREG = saved_status;
+}
+
+
+uint8_t Xgrid::dispatch()
+{
+        uint8_t cnt = 0;
+        
+        // only the main loop takes from the head
+        while (deliver_cnt > 0)
+        {
+                Packet pkt = deliver_queue[deliver_head];
+                int8_t bi = deliver_buffer[deliver_head];
+                
+                call_handler(&pkt);
+                
+                uint8_t saved_status = SREG;
+                cli();
+                
+                deliver_head = (deliver_head + 1) % XGRID_DELIVER_QUEUE_SIZE;
+                deliver_cnt--;
+                
+                // release buffer
+                if (bi >= 0)
+                {
+                        if (--pkt_buffer[bi].deliver_refs == 0)
+                                pkt_buffer[bi].flags &= ~ XGRID_BUFFER_IN_USE_DELIVER;
+                }
+                else
+                {
+                        msg_held = 0;
+                }
+                
+                SREG = saved_status;
+                
+                cnt++;
+        }
+        
+        return cnt;
+}
+
+
+uint8_t Xgrid::try_read_packet(Packet *pkt, IStream *stream)
+{
+        uint8_t buffer[XGRID_BUFFER_SIZE];
+        uint16_t len;
+        
+        // don't do anything if data pointer is null
+        if (pkt->data == 0)
+                return 0;
+        
+        // drop bytes until we get a XGRID_IDENTIFIER
+        while (stream->available() > 0 && stream->peek() != XGRID_IDENTIFIER)
+                stream->get();
+        
+        // return if we're not looking at a packet
+        if (stream->peek() != XGRID_IDENTIFIER)
+                return 0;
+        
+        // grab length
+        if (stream->available() < 3)
+                return 0;
+        
+        len = stream->peek(1) | (stream->peek(2) << 8);
+        
+        // return if the whole packet isn't available yet
+        if (stream->available() < len + 3)
+                return 0;
+        
+        // drop header
+        stream->get();
+        stream->get();
+        stream->get();
+        
+        // read data
+        stream->read(buffer, len);
+        
+        return try_parse_packet(pkt, buffer, len);
+}
+
+
+uint8_t Xgrid::try_parse_packet(Packet *pkt, const uint8_t *buffer, uint16_t len)
+{
+        if (len < sizeof(xgrid_header_short_t))
+                return 0;
+        
+        xgrid_header_short_t *hdr = (xgrid_header_short_t *)buffer;
+        
+        pkt->source_id = hdr->source_id;
+        pkt->type = hdr->type;
+        pkt->seq = hdr->seq;
+        pkt->flags = hdr->flags;
+        pkt->radius = hdr->radius;
+        pkt->m_flags = 0;
+        
+        len -= sizeof(xgrid_header_short_t);
+        buffer += sizeof(xgrid_header_short_t);
+        
+        // strip destination
+        if (pkt->flags & XGRID_PKT_FLAG_UNICAST)
+        {
+                if (len < sizeof(xgrid_pkt_unicast_t))
+                        return 0;
+                
+                pkt->dest_id = ((xgrid_pkt_unicast_t *)buffer)->dest_id;
+                
+                len -= sizeof(xgrid_pkt_unicast_t);
+                buffer += sizeof(xgrid_pkt_unicast_t);
+        }
+        
+        for (uint16_t i = 0; i < len; i++)
+        {
+                pkt->data[i] = buffer[i];
+        }
+        
+        pkt->data_len = len;
+        
+        return 1;
+}
+
+
+void Xgrid::queue_buffer(xgrid_buffer_t *buffer, uint16_t mask)
+{
+        buffer->mask = mask;
+        buffer->pending = mask & ((1 << node_cnt) - 1);
+        buffer->flags |= XGRID_BUFFER_IN_USE_TX;
+}
+
+
+uint8_t Xgrid::encode_header(xgrid_buffer_t *buffer, uint8_t n, uint8_t *out)
+{
+        xgrid_node_t *node = &(nodes[n]);
+        xgrid_header_t *hdr = &(buffer->hdr);
+        uint16_t data_len = hdr->size - sizeof(xgrid_header_short_t);
+        uint8_t caps = 0;
+        uint8_t credits_due = 0;
+        
+        // other formats only over a two way link to a
+        // neighbor that advertised support, hellos always
+        // go out in full so anyone can read them
+        if (hdr->type != XGRID_PKT_HELLO)
+                caps = link_caps(n);
+        
+        node->tx_data_off = 0;
+        node->tx_escaped = (caps & XGRID_CAP_ESCAPE) != 0;
+        
+        if ((caps & XGRID_CAP_V2) && (caps & XGRID_CAP_CREDITS))
+                credits_due = get_credits(n) != node->credits_sent;
+        
+        // compact header drops the high byte of seq,
+        // so prefer v2 for packets that will be forwarded
+        // or when the neighbor needs fresh credits
+        if ((caps & XGRID_CAP_COMPACT) &&
+                (hdr->radius <= 1 || !(caps & XGRID_CAP_V2)) &&
+                !credits_due && data_len <= XGRID_COMPACT_MAX_DATA)
+        {
+                uint8_t *ptr = out + XGRID_COMPACT_HEADER_SIZE;
+                uint8_t fmt = 0;
+                
+                // omit fields that match the defaults
+                if (hdr->source_id != my_id)
+                {
+                        fmt |= XGRID_COMPACT_SOURCE;
+                        *ptr++ = hdr->source_id;
+                        *ptr++ = hdr->source_id >> 8;
+                }
+                
+                if (hdr->flags != 0)
+                {
+                        fmt |= XGRID_COMPACT_FLAGS;
+                        *ptr++ = hdr->flags;
+                }
+                
+                if (hdr->radius != 1)
+                {
+                        fmt |= XGRID_COMPACT_RADIUS;
+                        *ptr++ = hdr->radius;
+                }
+                
+                // length counts everything after the length byte
+                out[0] = XGRID_IDENTIFIER_COMPACT;
+                out[1] = (ptr - out) - 2 + data_len;
+                out[2] = hdr->type;
+                out[3] = hdr->seq;
+                out[4] = fmt;
+                
+                return ptr - out;
+        }
+        
+        if (caps & XGRID_CAP_V2)
+        {
+                xgrid_header_v2_t *v2 = (xgrid_header_v2_t *)out;
+                
+                v2->identifier = XGRID_IDENTIFIER_V2;
+                v2->hflags = 0;
+                v2->size = data_len;
+                v2->source_id = hdr->source_id;
+                v2->dest_id = 0xFFFF;
+                v2->type = hdr->type;
+                v2->seq = hdr->seq;
+                v2->flags = hdr->flags;
+                v2->radius = hdr->radius;
+                
+                if (buffer->flags & XGRID_BUFFER_SEQ16)
+                {
+                        v2->hflags |= XGRID_V2_SEQ16;
+                        v2->seq |= buffer->seq_hi << 8;
+                }
+                
+                // destination moves from data into header
+                if (hdr->flags & XGRID_PKT_FLAG_UNICAST)
+                {
+                        v2->dest_id = ((xgrid_pkt_unicast_t *)buffer->buffer)->dest_id;
+                        v2->size -= sizeof(xgrid_pkt_unicast_t);
+                        node->tx_data_off = sizeof(xgrid_pkt_unicast_t);
+                }
+                
+                seal_header_v2(n, out);
+                
+                return sizeof(xgrid_header_v2_t);
+        }
+        
+        memcpy(out, hdr, sizeof(xgrid_header_t));
+        
+        return sizeof(xgrid_header_t);
+}
+
+
+int8_t Xgrid::decode_header(uint8_t n)
+{
+        xgrid_node_t *node = &(nodes[n]);
+        xgrid_header_t *hdr = &(node->rx_hdr);
+        uint8_t *raw = node->rx_raw;
+        
+        node->rx_seq_hi = 0;
+        node->rx_seq16 = 0;
+        
+        if (raw[0] == XGRID_IDENTIFIER)
+        {
+                memcpy(hdr, raw, sizeof(xgrid_header_t));
+                
+                if (hdr->size < sizeof(xgrid_header_short_t))
+                        return -1;
+        }
+        else if (raw[0] == XGRID_IDENTIFIER_V2)
+        {
+                xgrid_header_v2_t *v2 = (xgrid_header_v2_t *)raw;
+                uint8_t crc = 0;
+                
+                for (uint8_t i = 0; i < sizeof(xgrid_header_v2_t) - 1; i++)
+                        crc = _crc_ibutton_update(crc, raw[i]);
+                
+                if (crc != v2->crc || (v2->hflags & ~XGRID_V2_MASK))
+                        return -1;
+                
+                hdr->identifier = XGRID_IDENTIFIER;
+                hdr->size = v2->size + sizeof(xgrid_header_short_t);
+                hdr->source_id = v2->source_id;
+                hdr->type = v2->type;
+                hdr->seq = v2->seq;
+                hdr->flags = v2->flags;
+                hdr->radius = v2->radius;
+                
+                node->rx_dest_id = v2->dest_id;
+                
+                // room at the neighbor as of this frame, less what
+                // was sent since its last one, some of which it
+                // may have counted already, so this errs low
+                uint8_t avail[XGRID_BUFFER_CLASS_CNT] = {(uint8_t)(v2->credits >> 4), (uint8_t)(v2->credits & 0x0F)};
+                
+                for (uint8_t c = 0; c < XGRID_BUFFER_CLASS_CNT; c++)
+                {
+                        node->credits[c] = avail[c] > node->credits_out[c] ? avail[c] - node->credits_out[c] : 0;
+                        node->credits_out[c] = 0;
+                }
+                
+                node->credits_valid = 1;
+                node->credit_age = 0;
+                
+                if (v2->hflags & XGRID_V2_SEQ16)
+                {
+                        node->rx_seq_hi = v2->seq >> 8;
+                        node->rx_seq16 = 1;
+                }
+                
+                // destination goes back ahead of data
+                if (hdr->flags & XGRID_PKT_FLAG_UNICAST)
+                        hdr->size += sizeof(xgrid_pkt_unicast_t);
+        }
+        else
+        {
+                uint8_t fmt = raw[4];
+                uint8_t len = XGRID_COMPACT_HEADER_SIZE;
+                uint8_t *ptr = raw + XGRID_COMPACT_HEADER_SIZE;
+                
+                if (fmt & ~XGRID_COMPACT_MASK)
+                        return -1;
+                
+                if (fmt & XGRID_COMPACT_SOURCE)
+                        len += 2;
+                if (fmt & XGRID_COMPACT_FLAGS)
+                        len++;
+                if (fmt & XGRID_COMPACT_RADIUS)
+                        len++;
+                
+                // wait for optional fields
+                if (node->rx_raw_len < len)
+                {
+                        node->rx_raw_len = len;
+                        return 0;
+                }
+                
+                if (raw[1] < len - 2)
+                        return -1;
+                
+                // fill in defaults
+                hdr->identifier = XGRID_IDENTIFIER;
+                hdr->size = raw[1] - (len - 2) + sizeof(xgrid_header_short_t);
+                hdr->source_id = node->neighbor_id;
+                hdr->type = raw[2];
+                hdr->seq = raw[3];
+                hdr->flags = 0;
+                hdr->radius = 1;
+                
+                if (fmt & XGRID_COMPACT_SOURCE)
+                {
+                        hdr->source_id = ptr[0] | (ptr[1] << 8);
+                        ptr += 2;
+                }
+                
+                if (fmt & XGRID_COMPACT_FLAGS)
+                        hdr->flags = *ptr++;
+                
+                if (fmt & XGRID_COMPACT_RADIUS)
+                        hdr->radius = *ptr++;
+        }
+        
+        // packet must fit in a buffer
+        if (hdr->size - sizeof(xgrid_header_short_t) > XGRID_LG_BUFFER_SIZE)
+                return -1;
+        
+        return 1;
+}
+
+
+uint8_t Xgrid::transmit(uint8_t n, xgrid_buffer_t *buffer)
+{
+        xgrid_node_t *node = &(nodes[n]);
+        uint16_t len = node->tx_hdr_len;
+        uint16_t cnt = node->stream->free();
+        uint16_t ptr = node->tx_ptr;
+        
+        // neighbor asked us to hold off
+        if (node->tx_pause > 0)
+                return 0;
+        
+        // no buffer for header only frames
+        if (buffer)
+                len += buffer->hdr.size - sizeof(xgrid_header_short_t) - node->tx_data_off;
+        
+        while (ptr < len)
+        {
+                uint8_t b;
+                uint8_t esc = 0;
+                
+                // header, then data
+                if (ptr < node->tx_hdr_len)
+                        b = node->tx_hdr[ptr];
+                else
+                        b = buffer->buffer[ptr - node->tx_hdr_len + node->tx_data_off];
+                
+                // frame marker or reserved byte
+                if (node->tx_escaped && (ptr == 0 || b == XGRID_ESCAPE || is_identifier(b)))
+                        esc = 1;
+                
+                if (cnt < 1 + esc)
+                        break;
+                
+                if (esc)
+                {
+                        node->stream->put(XGRID_ESCAPE);
+                        if (ptr > 0)
+                                b ^= XGRID_ESCAPE_XOR;
+                }
+                
+                node->stream->put(b);
+                
+                cnt -= 1 + esc;
+                node->stats.bytes_out += 1 + esc;
+                ptr++;
+        }
+        
+        node->tx_ptr = ptr;
+        
+        return ptr >= len;
+}
+
+
+uint8_t Xgrid::is_identifier(uint8_t b)
+{
+        return b == XGRID_IDENTIFIER || b == XGRID_IDENTIFIER_COMPACT || b == XGRID_IDENTIFIER_V2;
+}
+
+
+uint8_t Xgrid::start_frame(uint8_t n, uint8_t b, uint8_t escaped)
+{
+        xgrid_node_t *node = &(nodes[n]);
+        
+        if (b == XGRID_IDENTIFIER)
+                node->rx_raw_len = sizeof(xgrid_header_t);
+        else if (b == XGRID_IDENTIFIER_COMPACT)
+                node->rx_raw_len = XGRID_COMPACT_HEADER_SIZE;
+        else if (b == XGRID_IDENTIFIER_V2)
+                node->rx_raw_len = sizeof(xgrid_header_v2_t);
+        else
                 return 0;
         
-        xgrid_header_short_t *hdr = (xgrid_header_short_t *)buffer;
+        node->rx_raw[0] = b;
+        node->rx_raw_ptr = 1;
+        node->rx_state = XGRID_RX_STATE_HEADER;
+        node->rx_escaped = escaped;
+        node->rx_esc = 0;
+        
+        return 1;
+}
+
+
+// returns next byte of current frame, -1 if none available,
+// or -2 if a new frame started and the current one was dropped
+int16_t Xgrid::read_byte(uint8_t n)
+{
+        xgrid_node_t *node = &(nodes[n]);
+        IOStream *stream = node->stream;
+        
+        while (stream->available())
+        {
+                uint8_t b = stream->get();
+                node->stats.bytes_in++;
+                
+                if (!node->rx_escaped)
+                        return b;
+                
+                if (b == XGRID_ESCAPE && !node->rx_esc)
+                {
+                        node->rx_esc = 1;
+                        continue;
+                }
+                
+                // in-band flow control
+                if (node->rx_esc && (b == XGRID_XON || b == XGRID_XOFF))
+                {
+                        node->rx_esc = 0;
+                        node->tx_pause = (b == XGRID_XOFF) ? XGRID_XOFF_TIMEOUT : 0;
+                        continue;
+                }
+                
+                // identifiers never appear inside an escaped
+                // frame, so this must be the start of the next one
+                if (is_identifier(b))
+                {
+                        if (node->rx_buffer >= 0)
+                        {
+                                pkt_buffer[node->rx_buffer].flags &= ~ XGRID_BUFFER_IN_USE;
+                                node->rx_buffer = -1;
+                        }
+                        
+                        node->stats.rx_errors++;
+                        start_frame(n, b, node->rx_esc);
+                        
+                        return -2;
+                }
+                
+                if (node->rx_esc)
+                {
+                        node->rx_esc = 0;
+                        b ^= XGRID_ESCAPE_XOR;
+                }
+                
+                return b;
+        }
+        
+        return -1;
+}
+
+
+void Xgrid::send_baud(uint8_t n, uint8_t cmd, uint8_t rate)
+{
+        xgrid_pkt_baud_t b;
+        Packet pkt;
+        
+        b.cmd = cmd;
+        b.rate = rate;
+        
+        pkt.type = XGRID_PKT_BAUD;
+        pkt.flags = 0;
+        pkt.radius = 1;
+        pkt.data = (uint8_t *)&b;
+        pkt.data_len = sizeof(xgrid_pkt_baud_t);
+        
+        send_packet(&pkt, 1 << n);
+}
+
+
+void Xgrid::process_baud(uint8_t n)
+{
+        xgrid_node_t *node = &(nodes[n]);
+        
+        if (set_node_baud == 0)
+                return;
+        
+        if (node->baud_timer > 0)
+                node->baud_timer--;
+        
+        if (node->baud_state == XGRID_BAUD_STATE_IDLE)
+        {
+                // lower ID steps the link up
+                if (node->baud_timer == 0 &&
+                        node->hello_age <= XGRID_HELLO_MAX_AGE && node->link_sym &&
+                        (node->caps & XGRID_CAP_BAUD) && my_id < node->neighbor_id &&
+                        node->baud_cur + 1 < node->baud_limit)
+                {
+                        node->baud_next = node->baud_cur + 1;
+                        node->baud_state = XGRID_BAUD_STATE_PROPOSED;
+                        node->baud_timer = XGRID_BAUD_TIMEOUT;
+                        
+                        send_baud(n, XGRID_BAUD_PROPOSE, node->baud_next);
+                }
+        }
+        else if (node->baud_state == XGRID_BAUD_STATE_PROPOSED)
+        {
+                // no answer, try again later
+                if (node->baud_timer == 0)
+                {
+                        node->baud_state = XGRID_BAUD_STATE_IDLE;
+                        node->baud_timer = XGRID_BAUD_STEP_DELAY;
+                }
+        }
+        else if (node->baud_state == XGRID_BAUD_STATE_SWITCH || node->baud_state == XGRID_BAUD_STATE_REVERT)
+        {
+                // finish current frame and any queued rate messages
+                if (node->tx_buffer >= 0)
+                        return;
+                
+                for (uint8_t i = 0; i < XGRID_BUFFER_COUNT; i++)
+                {
+                        if ((pkt_buffer[i].flags & XGRID_BUFFER_IN_USE_TX) &&
+                                (pkt_buffer[i].pending & (1 << n)) &&
+                                pkt_buffer[i].hdr.type == XGRID_PKT_BAUD)
+                                return;
+                }
+                
+                if (!set_node_baud(n, xgrid_baud_rates[node->baud_next]))
+                        return;
+                
+                node->baud_cur = node->baud_next;
+                node->baud_errors = node->stats.rx_errors;
+                
+                if (node->baud_state == XGRID_BAUD_STATE_SWITCH)
+                {
+                        node->baud_state = XGRID_BAUD_STATE_TEST;
+                        node->baud_timer = XGRID_BAUD_TEST_TIME;
+                }
+                else
+                {
+                        node->baud_state = XGRID_BAUD_STATE_IDLE;
+                        node->baud_timer = XGRID_BAUD_STEP_DELAY;
+                }
+        }
+        else if (node->baud_state == XGRID_BAUD_STATE_TEST)
+        {
+                if (node->baud_timer == 0)
+                {
+                        // no answer at new rate, step back down
+                        // and don't try this rate again
+                        node->baud_limit = node->baud_cur;
+                        node->baud_next = node->baud_cur - 1;
+                        node->baud_state = XGRID_BAUD_STATE_REVERT;
+                }
+                else if (my_id < node->neighbor_id && node->baud_timer % XGRID_BAUD_TEST_INTERVAL == 0)
+                {
+                        send_baud(n, XGRID_BAUD_TEST, node->baud_cur);
+                }
+        }
+}
+
+
+void Xgrid::check_baud(uint8_t n)
+{
+        xgrid_node_t *node = &(nodes[n]);
+        
+        if (node->baud_state != XGRID_BAUD_STATE_IDLE || node->baud_cur == 0)
+                return;
+        
+        // drop back to the base rate if the neighbor went
+        // quiet or the link is taking errors, the neighbor
+        // will do the same once it stops hearing us
+        if (node->hello_age > XGRID_HELLO_MAX_AGE ||
+                (uint16_t)(node->stats.rx_errors - node->baud_errors) > XGRID_BAUD_MAX_ERRORS)
+        {
+                node->baud_limit = node->baud_cur;
+                node->baud_next = 0;
+                node->baud_state = XGRID_BAUD_STATE_REVERT;
+        }
+        
+        node->baud_errors = node->stats.rx_errors;
+}
+
+
+void Xgrid::process_flow(uint8_t n)
+{
+        xgrid_node_t *node = &(nodes[n]);
+        uint16_t ovr = node->stream->overruns();
+        
+        // pick up bytes lost by the port
+        node->stats.rx_overruns += ovr - node->overrun_last;
+        node->overrun_last = ovr;
+        
+        if (node->tx_pause > 0)
+                node->tx_pause--;
+        
+        // hardware handshake needs no help, in-band
+        // needs escaped framing on both sides and
+        // can't go inside an unescaped frame
+        if ((node->link_flags & XGRID_LINK_HW_FLOW) ||
+                node->hello_age > XGRID_HELLO_MAX_AGE || !node->link_sym ||
+                !(node->caps & XGRID_CAP_ESCAPE) || !(node->caps & XGRID_CAP_XONXOFF) ||
+                (node->tx_buffer >= 0 && node->tx_ptr > 0 && !node->tx_escaped))
+        {
+                node->stream->set_inband_flow(0, 0, 0, 0, 0);
+                return;
+        }
+        
+        // the port sends XOFF and XON from its receive
+        // interrupt, a tick is too slow to catch the level
+        node->stream->set_inband_flow(XGRID_ESCAPE, XGRID_XOFF, XGRID_XON, XGRID_XOFF_ROOM, XGRID_XON_LEVEL);
+}
+
+
+// credits offered to the neighbor on port n
+uint8_t Xgrid::get_credits(uint8_t n)
+{
+        uint8_t avail[XGRID_BUFFER_CLASS_CNT] = {0, 0};
+        uint8_t lg_busy = pkt_buffer[XGRID_LG_BUFFER_IND].flags & XGRID_BUFFER_IN_USE;
+        uint8_t lent_busy = 0;
+        uint8_t cnt = 0;
+        uint8_t rank = 0;
+        
+        for (uint8_t i = 0; i < XGRID_BUFFER_COUNT; i++)
+        {
+                if (i > XGRID_LG_BUFFER_IND && (pkt_buffer[i].flags & XGRID_BUFFER_IN_USE))
+                        lent_busy = 1;
+        }
+        
+        for (uint8_t i = 0; i < XGRID_BUFFER_COUNT; i++)
+        {
+                if (pkt_buffer[i].flags & XGRID_BUFFER_IN_USE)
+                        continue;
+                
+                // same rules as get_free_buffer for the shared space
+                if (i == XGRID_LG_BUFFER_IND && lent_busy)
+                        continue;
+                if (i > XGRID_LG_BUFFER_IND && (lg_busy || lg_wait))
+                        continue;
+                
+                avail[buffer_class(i)]++;
+        }
+        
+        // control traffic is not metered, so
+        // its reserve is not offered to neighbors
+        if (avail[0] > XGRID_SM_BUFFER_RESERVE_CONTROL)
+                avail[0] -= XGRID_SM_BUFFER_RESERVE_CONTROL;
+        else
+                avail[0] = 0;
+        
+        // every metered neighbor gets its own share so
+        // together they can't send more than we can hold,
+        // the remainder goes to the lowest ports
+        for (uint8_t m = 0; m < node_cnt; m++)
+        {
+                if (m == n || (link_caps(m) & XGRID_CAP_CREDITS))
+                {
+                        if (m < n)
+                                rank++;
+                        cnt++;
+                }
+        }
+        
+        for (uint8_t c = 0; c < XGRID_BUFFER_CLASS_CNT; c++)
+        {
+                avail[c] = avail[c] / cnt + (rank < avail[c] % cnt ? 1 : 0);
+                
+                if (avail[c] > XGRID_CREDIT_MAX)
+                        avail[c] = XGRID_CREDIT_MAX;
+        }
+        
+        return (avail[0] << 4) | avail[1];
+}
+
+
+// returns buffer class metered by credits toward
+// port n, or -1 if the packet can go out regardless
+int8_t Xgrid::credit_class(uint8_t n, uint16_t data_size, uint8_t prio)
+{
+        if (prio == XGRID_PRIO_CONTROL || !nodes[n].credits_valid ||
+                !(link_caps(n) & XGRID_CAP_CREDITS))
+                return -1;
+        
+        return data_size > XGRID_SM_BUFFER_SIZE ? 1 : 0;
+}
+
+
+uint8_t Xgrid::take_credit(uint8_t n, xgrid_buffer_t *buffer)
+{
+        xgrid_node_t *node = &(nodes[n]);
+        int8_t c = credit_class(n, buffer->hdr.size - sizeof(xgrid_header_short_t), buffer->prio);
+        
+        if (c < 0)
+        {
+                node->tx_credit = -1;
+                return 1;
+        }
+        
+        if (node->credits[c] == 0)
+        {
+                // update may have been lost, let one through
+                if (node->credit_age < XGRID_CREDIT_TIMEOUT)
+                        return 0;
+                
+                node->credit_age = 0;
+                node->tx_credit = -1;
+        }
+        else
+        {
+                node->credits[c]--;
+                node->tx_credit = c;
+        }
+        
+        if (node->credits_out[c] < 0xFF)
+                node->credits_out[c]++;
+        
+        return 1;
+}
+
+
+// packet was taken off the port before any of it went out
+void Xgrid::return_credit(uint8_t n, int8_t c)
+{
+        xgrid_node_t *node = &(nodes[n]);
+        
+        if (c < 0)
+                return;
+        
+        node->credits[c]++;
+        
+        if (node->credits_out[c] > 0)
+                node->credits_out[c]--;
+}
+
+
+void Xgrid::seal_header_v2(uint8_t n, uint8_t *out)
+{
+        xgrid_header_v2_t *v2 = (xgrid_header_v2_t *)out;
+        
+        v2->credits = get_credits(n);
+        nodes[n].credits_sent = v2->credits;
+        
+        v2->crc = 0;
+        for (uint8_t i = 0; i < sizeof(xgrid_header_v2_t) - 1; i++)
+                v2->crc = _crc_ibutton_update(v2->crc, out[i]);
+}
+
+
+void Xgrid::send_credits(uint8_t n)
+{
+        xgrid_node_t *node = &(nodes[n]);
+        xgrid_header_v2_t *v2 = (xgrid_header_v2_t *)node->tx_hdr;
+        
+        // worst case every byte escaped
+        if (node->tx_pause > 0 || node->stream->free() < 2 * sizeof(xgrid_header_v2_t))
+                return;
+        
+        v2->identifier = XGRID_IDENTIFIER_V2;
+        v2->hflags = 0;
+        v2->size = 0;
+        v2->source_id = my_id;
+        v2->dest_id = 0xFFFF;
+        v2->type = XGRID_PKT_CREDITS;
+        v2->seq = 0;
+        v2->flags = 0;
+        v2->radius = 1;
+        
+        seal_header_v2(n, node->tx_hdr);
+        
+        node->tx_hdr_len = sizeof(xgrid_header_v2_t);
+        node->tx_data_off = 0;
+        node->tx_escaped = (link_caps(n) & XGRID_CAP_ESCAPE) != 0;
+        node->tx_ptr = 0;
+        
+        transmit(n, 0);
+        
+        node->tx_ptr = 0;
+}
+
+
+void Xgrid::process_credits(uint8_t n)
+{
+        xgrid_node_t *node = &(nodes[n]);
+        uint8_t caps = link_caps(n);
+        
+        if (node->credit_age < 0xFF)
+                node->credit_age++;
+        
+        if (!(caps & XGRID_CAP_V2) || !(caps & XGRID_CAP_CREDITS))
+                return;
+        
+        // only between frames
+        if (node->tx_buffer >= 0)
+                return;
+        
+        uint8_t credits = get_credits(n);
+        
+        // neighbor last heard no room in a class that now has some
+        if (((node->credits_sent & 0xF0) == 0 && (credits & 0xF0)) ||
+                ((node->credits_sent & 0x0F) == 0 && (credits & 0x0F)))
+                send_credits(n);
+}
+
+
+void Xgrid::receive_packet(uint8_t n)
+{
+        xgrid_buffer_t *buffer = &(pkt_buffer[nodes[n].rx_buffer]);
+        Packet pkt;
+        
+        nodes[n].rx_buffer = -1;
+        nodes[n].stats.packets_in++;
+        
+        // grab header
+        pkt.source_id = buffer->hdr.source_id;
+        pkt.type = buffer->hdr.type;
+        pkt.seq = buffer->hdr.seq | (buffer->seq_hi << 8);
+        pkt.flags = buffer->hdr.flags;
+        pkt.radius = buffer->hdr.radius;
+        pkt.rx_node = n;
+        pkt.m_flags = 0;
         
-        pkt->source_id = hdr->source_id;
-        pkt->type = hdr->type;
-        pkt->seq = hdr->seq;
-        pkt->flags = hdr->flags;
-        pkt->radius = hdr->radius;
+        if (buffer->flags & XGRID_BUFFER_SEQ16)
+                pkt.m_flags |= XGRID_PKT_M_SEQ16;
+        if (buffer->flags & XGRID_BUFFER_RELAY)
+                pkt.m_flags |= XGRID_PKT_M_RELAY;
         
-        len -= sizeof(xgrid_header_short_t);
+        // set up data reference
+        pkt.data = buffer->buffer;
+        pkt.data_len = buffer->hdr.size - sizeof(xgrid_header_short_t);
         
-        for (uint16_t i = 0; i < len; i++)
+        // strip destination
+        if (pkt.flags & XGRID_PKT_FLAG_UNICAST)
         {
-                pkt->data[i] = buffer[i + sizeof(xgrid_header_short_t)];
+                if (pkt.data_len < sizeof(xgrid_pkt_unicast_t))
+                {
+                        // runt packet, release buffer
+                        nodes[n].stats.rx_errors++;
+                        buffer->flags &= ~ XGRID_BUFFER_IN_USE;
+                        
+                        return;
+                }
+                
+                pkt.dest_id = ((xgrid_pkt_unicast_t *)buffer->buffer)->dest_id;
+                pkt.data += sizeof(xgrid_pkt_unicast_t);
+                pkt.data_len -= sizeof(xgrid_pkt_unicast_t);
         }
         
-        pkt->data_len = len;
+        // process packet
+        if (should_forward(&pkt))
+        {
+                uint8_t use_current = 1;
+                uint16_t mask = 0xFFFF;
+                if (pkt.flags & XGRID_PKT_FLAG_UNICAST)
+                        mask = get_route_mask(pkt.dest_id, pkt.rx_node);
+                else if (pkt.rx_node < 16)
+                        mask &= ~(1 << pkt.rx_node);
+                
+                if (buffer->hdr.flags & XGRID_PKT_FLAG_TRACE)
+                {
+                        buffer->hdr.size++;
+                        if (buffer->hdr.size - sizeof(xgrid_header_short_t) <= buffer->buffer_len)
+                        {
+                                buffer->buffer[buffer->hdr.size - sizeof(xgrid_header_short_t) - 1] = pkt.rx_node;
+                        }
+                        else
+                        {
+                                // TODO
+                        }
+                }
+                
+                if (use_current && mask)
+                {
+                        buffer->hdr.radius--;
+                        buffer->timestamp = ticks;
+                        queue_buffer(buffer, mask);
+                        set_relayed(&pkt);
+                        
+                        nodes[n].stats.forwarded++;
+                }
+        }
         
-        return 1;
+        // copies kept only for relaying were delivered already
+        if (pkt.m_flags & XGRID_PKT_M_RELAY)
+        {
+                buffer->flags &= ~ XGRID_BUFFER_IN_USE_RX;
+                return;
+        }
+        
+        // unicast packets are only delivered at the destination
+        // application packets keep the buffer until dispatched
+        if (!(pkt.flags & XGRID_PKT_FLAG_UNICAST) || pkt.dest_id == my_id)
+        {
+                rx_cur_buffer = buffer - pkt_buffer;
+                internal_process_packet(&pkt);
+                rx_cur_buffer = XGRID_DELIVER_DIRECT;
+        }
+        
+        // release buffer
+        buffer->flags &= ~ XGRID_BUFFER_IN_USE_RX;
 }
 
 
@@ -326,224 +2537,351 @@ void Xgrid::process()
         // process nodes
         for (uint8_t i = 0; i < node_cnt; i++)
         {
-                IOStream *stream = nodes[i].stream;
+                xgrid_node_t *node = &(nodes[i]);
+                IOStream *stream = node->stream;
                 
-                // drop chars if necessary
-                // for discarding duplicate packets
-                while (nodes[i].drop_chars > 0 && stream->available())
+                // give up on a partial packet if the link goes
+                // quiet, packets waiting on a buffer are left alone
+                if (node->rx_state != XGRID_RX_STATE_HUNT &&
+                        node->rx_state != XGRID_RX_STATE_ALLOC &&
+                        !stream->available())
+                {
+                        if (rx_timeout > 0 && ++node->rx_idle >= rx_timeout)
+                        {
+                                // release buffer
+                                if (node->rx_buffer >= 0)
+                                {
+                                        pkt_buffer[node->rx_buffer].flags &= ~ XGRID_BUFFER_IN_USE;
+                                        node->rx_buffer = -1;
+                                }
+                                
+                                // look for next identifier
+                                node->rx_state = XGRID_RX_STATE_HUNT;
+                                node->rx_idle = 0;
+                                node->rx_esc = 0;
+                                node->stats.rx_timeouts++;
+                        }
+                }
+                else
                 {
-                        stream->get();
-                        nodes[i].drop_chars--;
+                        node->rx_idle = 0;
                 }
                 
-                if (nodes[i].stream->available())
+                while (1)
                 {
-                        // Process receive data
-                        if (nodes[i].rx_buffer == -1)
+                        if (node->rx_state == XGRID_RX_STATE_ALLOC)
                         {
-                                uint16_t len;
+                                // get buffer for packet data
+                                int8_t bi = get_free_buffer(node->rx_hdr.size - sizeof(xgrid_header_short_t),
+                                        get_priority(node->rx_hdr.type, node->rx_hdr.flags));
                                 
-                                // drop chars to get to identifier
-                                while (stream->available() > 0 && stream->peek() != XGRID_IDENTIFIER)
-                                        stream->get();
+                                if (bi < 0)
+                                {
+                                        // try again next cycle
+                                        node->stats.alloc_fail++;
+                                        break;
+                                }
                                 
-                                // continue if we're not looking at a packet
-                                if (stream->peek() != XGRID_IDENTIFIER)
-                                        continue;
+                                xgrid_buffer_t *buffer = &(pkt_buffer[bi]);
                                 
-                                // grab length
-                                if (stream->available() < 3)
-                                        continue;
+                                node->rx_buffer = bi;
+                                node->rx_ptr = 0;
+                                node->rx_state = XGRID_RX_STATE_DATA;
                                 
-                                len = stream->peek(1) | (stream->peek(2) << 8);
+                                buffer->flags |= XGRID_BUFFER_IN_USE_RX;
+                                buffer->hdr = node->rx_hdr;
+                                buffer->seq_hi = node->rx_seq_hi;
                                 
-                                int8_t bi = get_free_buffer(len-sizeof(xgrid_header_short_t));
+                                if (node->rx_seq16)
+                                        buffer->flags |= XGRID_BUFFER_SEQ16;
+                                else
+                                        buffer->flags &= ~XGRID_BUFFER_SEQ16;
                                 
-                                if (bi < 0)
+                                if (node->rx_relay)
+                                        buffer->flags |= XGRID_BUFFER_RELAY;
+                                else
+                                        buffer->flags &= ~XGRID_BUFFER_RELAY;
+                                
+                                // v2 carries destination in header
+                                if (node->rx_raw[0] == XGRID_IDENTIFIER_V2 && (buffer->hdr.flags & XGRID_PKT_FLAG_UNICAST))
+                                {
+                                        ((xgrid_pkt_unicast_t *)buffer->buffer)->dest_id = node->rx_dest_id;
+                                        node->rx_ptr = sizeof(xgrid_pkt_unicast_t);
+                                }
+                        }
+                        else if (node->rx_state == XGRID_RX_STATE_DATA)
+                        {
+                                xgrid_buffer_t *buffer = &(pkt_buffer[node->rx_buffer]);
+                                uint16_t len = buffer->hdr.size - sizeof(xgrid_header_short_t);
+                                int16_t b = 0;
+                                
+                                // read data
+                                while (node->rx_ptr < len && (b = read_byte(i)) >= 0)
+                                {
+                                        buffer->buffer[node->rx_ptr++] = b;
+                                }
+                                
+                                // frame cut short by next frame
+                                if (b == -2)
                                         continue;
                                 
-                                nodes[i].rx_buffer = bi;
+                                if (node->rx_ptr < len)
+                                        break;
                                 
-                                pkt_buffer[bi].flags |= XGRID_BUFFER_IN_USE_RX;
-                                pkt_buffer[bi].flags &= ~XGRID_BUFFER_UNIQUE;
-                                pkt_buffer[bi].ptr = 0;
+                                // one packet per port per cycle
+                                node->rx_state = XGRID_RX_STATE_HUNT;
+                                receive_packet(i);
+                                break;
                         }
-                        
-                        xgrid_buffer_t *buffer = &(pkt_buffer[nodes[i].rx_buffer]);
-                        
-                        // read header
-                        while (buffer->ptr < sizeof(xgrid_header_t) && nodes[i].stream->available())
+                        else if (!stream->available())
                         {
-                                ((uint8_t *)&(buffer->hdr))[buffer->ptr++] = nodes[i].stream->get();
+                                break;
                         }
-                        
-                        if (buffer->ptr < sizeof(xgrid_header_t))
-                                continue;
-                        
-                        // grab header
-                        pkt.source_id = buffer->hdr.source_id;
-                        pkt.type = buffer->hdr.type;
-                        pkt.seq = buffer->hdr.seq;
-                        pkt.flags = buffer->hdr.flags;
-                        pkt.radius = buffer->hdr.radius;
-                        pkt.rx_node = i;
-                        
-                        // is packet unique?
-                        if (!(buffer->flags & XGRID_BUFFER_UNIQUE))
+                        else if (node->rx_state == XGRID_RX_STATE_DROP)
+                        {
+                                // drop chars for discarding duplicate packets
+                                int16_t b = read_byte(i);
+                                
+                                if (b == -1)
+                                        break;
+                                if (b < 0)
+                                        continue;
+                                
+                                if (--node->drop_chars == 0)
+                                        node->rx_state = XGRID_RX_STATE_HUNT;
+                        }
+                        else if (node->rx_state == XGRID_RX_STATE_HEADER)
                         {
+                                // read header
+                                int16_t b = read_byte(i);
+                                
+                                if (b == -1)
+                                        break;
+                                if (b < 0)
+                                        continue;
+                                
+                                node->rx_raw[node->rx_raw_ptr++] = b;
+                                
+                                if (node->rx_raw_ptr < node->rx_raw_len)
+                                        continue;
+                                
+                                int8_t ret = decode_header(i);
+                                
+                                // header continues
+                                if (ret == 0)
+                                        continue;
+                                
+                                if (ret < 0)
+                                {
+                                        // bad header, look for next identifier
+                                        node->stats.rx_errors++;
+                                        node->rx_state = XGRID_RX_STATE_HUNT;
+                                        continue;
+                                }
+                                
+                                // credits were taken from header
+                                if (node->rx_hdr.type == XGRID_PKT_CREDITS && node->rx_raw[0] == XGRID_IDENTIFIER_V2)
+                                {
+                                        node->drop_chars = node->rx_hdr.size - sizeof(xgrid_header_short_t);
+                                        node->rx_state = node->drop_chars > 0 ? XGRID_RX_STATE_DROP : XGRID_RX_STATE_HUNT;
+                                        continue;
+                                }
+                                
+                                // grab header
+                                pkt.source_id = node->rx_hdr.source_id;
+                                pkt.type = node->rx_hdr.type;
+                                pkt.seq = node->rx_hdr.seq | (node->rx_seq_hi << 8);
+                                pkt.flags = node->rx_hdr.flags;
+                                pkt.radius = node->rx_hdr.radius;
+                                pkt.rx_node = i;
+                                pkt.m_flags = node->rx_seq16 ? XGRID_PKT_M_SEQ16 : 0;
+                                
+                                // is packet unique?
                                 if (pkt.type == XGRID_PKT_FLUSH_COMPARE_BUFFER ||
                                         ((pkt.type != XGRID_PKT_FIRMWARE_BLOCK || (state == XGRID_STATE_FW_RX && update_node_mask == pkt.rx_node)) &&
                                         !(state == XGRID_STATE_FW_RX && ((pkt.type & 0xF0) != 0xF0)) &&
                                         check_unique(&pkt)))
                                 {
-                                        buffer->flags |= XGRID_BUFFER_UNIQUE;
+                                        node->rx_relay = (pkt.m_flags & XGRID_PKT_M_RELAY) != 0;
+                                        node->rx_state = XGRID_RX_STATE_ALLOC;
                                 }
                                 else
                                 {
                                         // drop remainder
-                                        nodes[i].drop_chars = (buffer->hdr.size+3) - buffer->ptr;
+                                        node->drop_chars = node->rx_hdr.size - sizeof(xgrid_header_short_t);
                                         
-                                        // release buffer
-                                        buffer->flags &= ~ XGRID_BUFFER_IN_USE;
-                                        nodes[i].rx_buffer = -1;
+                                        // v2 destination was in header
+                                        if (node->rx_raw[0] == XGRID_IDENTIFIER_V2 && (node->rx_hdr.flags & XGRID_PKT_FLAG_UNICAST))
+                                                node->drop_chars -= sizeof(xgrid_pkt_unicast_t);
+                                        node->stats.duplicates++;
                                         
-                                        continue;
+                                        node->rx_state = node->drop_chars > 0 ? XGRID_RX_STATE_DROP : XGRID_RX_STATE_HUNT;
                                 }
                         }
-                        
-                        // read data
-                        while (buffer->ptr < buffer->hdr.size+3 && nodes[i].stream->available())
-                        {
-                                buffer->buffer[buffer->ptr++ - sizeof(xgrid_header_t)] = nodes[i].stream->get();
-                        }
-                        
-                        // are we done?
-                        if (buffer->ptr >= buffer->hdr.size+3)
+                        else
                         {
-                                // set up data reference
-                                pkt.data = buffer->buffer;
-                                pkt.data_len = buffer->hdr.size - sizeof(xgrid_header_short_t);
+                                // drop chars to get to identifier
+                                uint8_t b = stream->get();
+                                node->stats.bytes_in++;
                                 
-                                // process packet
-                                if (pkt.radius > 1)
+                                // in-band flow control
+                                if (node->rx_esc && (b == XGRID_XON || b == XGRID_XOFF))
                                 {
-                                        uint8_t use_current = 1;
-                                        uint16_t mask = 0xFFFF;
-                                        if (pkt.rx_node < 16)
-                                                mask &= ~(1 << pkt.rx_node);
-                                        
-                                        if (buffer->hdr.flags & XGRID_PKT_FLAG_TRACE)
-                                        {
-                                                buffer->hdr.size++;
-                                                if (buffer->hdr.size - sizeof(xgrid_header_short_t) <= buffer->buffer_len)
-                                                {
-                                                        buffer->buffer[buffer->hdr.size - sizeof(xgrid_header_short_t) - 1] = pkt.rx_node;
-                                                }
-                                                else
-                                                {
-                                                        // TODO
-                                                }
-                                        }
-                                        
-                                        if (use_current)
-                                        {
-                                                buffer->hdr.radius--;
-                                                buffer->mask = mask;
-                                                buffer->flags |= XGRID_BUFFER_IN_USE_TX;
-                                                buffer->ptr = 0;
-                                        }
+                                        node->rx_esc = 0;
+                                        node->tx_pause = (b == XGRID_XOFF) ? XGRID_XOFF_TIMEOUT : 0;
+                                        continue;
                                 }
                                 
-                                internal_process_packet(&pkt);
+                                // escape ahead of identifier marks escaped frame
+                                if (start_frame(i, b, node->rx_esc))
+                                        continue;
+                                
+                                node->rx_esc = (b == XGRID_ESCAPE);
                                 
-                                // release buffer
-                                buffer->flags &= ~ XGRID_BUFFER_IN_USE_RX;
-                                nodes[i].rx_buffer = -1;
+                                if (!node->rx_esc)
+                                        node->stats.resync_bytes++;
                         }
                 }
         }
         
+        // send aggregates that have used up their latency budget
+        for (uint8_t n = 0; n < node_cnt; n++)
+        {
+                if (nodes[n].agg_buffer >= 0 && (int16_t)(ticks - nodes[n].agg_deadline) >= 0)
+                        flush_aggregate(n);
+        }
+        
+        // next fragments of a large message
+        send_fragments();
+        
+        // next part of a statistics reply
+        send_stats_part();
+        
+        if (msg_age < 0xFFFF)
+                msg_age++;
+        
+        if (lg_wait > 0)
+                lg_wait--;
+        
+        // link rate negotiation and flow control
+        for (uint8_t n = 0; n < node_cnt; n++)
+        {
+                process_baud(n);
+                process_flow(n);
+                process_credits(n);
+        }
+        
         // process transmit buffers
-        for (uint8_t i = 0; i < XGRID_BUFFER_COUNT; i++)
+        // strict priority, highest class first
+        for (uint8_t p = 0; p < XGRID_PRIO_CNT; p++)
         {
-                xgrid_buffer_t *buffer = &(pkt_buffer[i]);
-                
-                if (buffer->flags & XGRID_BUFFER_IN_USE_TX)
+                for (uint8_t i = 0; i < XGRID_BUFFER_COUNT; i++)
                 {
-                        // process for transmit buffer
+                        xgrid_buffer_t *buffer = &(pkt_buffer[i]);
                         
-                        // find minimum free
-                        uint16_t f = 0xffff;
-                        
-                        for (uint8_t n = 0; n < node_cnt; n++)
+                        if ((buffer->flags & XGRID_BUFFER_IN_USE_TX) && buffer->prio == p)
                         {
-                                if (buffer->mask & (1 << n))
+                                // process for transmit buffer
+                                // each port proceeds independently
+                                for (uint8_t n = 0; n < node_cnt; n++)
                                 {
-                                        // check node buffer assignment
-                                        if (nodes[n].tx_buffer == -1)
-                                        {
-                                                // if not assigned, set
-                                                nodes[n].tx_buffer = i;
-                                        }
-                                        else if (nodes[n].tx_buffer != i)
-                                        {
-                                                // if assigned to different buffer, hold packet
-                                                f = 0;
-                                        }
+                                        xgrid_node_t *node = &(nodes[n]);
                                         
-                                        uint16_t f2 = nodes[n].stream->free();
-                                        if (f > f2)
-                                                f = f2;
-                                }
-                        }
-                        
-                        // send as much of packet as possible
-                        for (uint8_t n = 0; n < node_cnt; n++)
-                        {
-                                if (buffer->mask & (1 << n))
-                                {
-                                        uint16_t cnt = f;
-                                        uint16_t ptr = buffer->ptr;
+                                        if (!(buffer->pending & (1 << n)))
+                                                continue;
                                         
-                                        // header
-                                        while (cnt > 0 && ptr < sizeof(xgrid_header_t))
+                                        // check node buffer assignment
+                                        if (node->tx_buffer != i)
                                         {
-                                                nodes[n].stream->put(((uint8_t *)&(buffer->hdr))[ptr]);
-                                                ptr++;
-                                                cnt--;
+                                                // hold new frames while the port changes rate
+                                                if ((node->baud_state == XGRID_BAUD_STATE_SWITCH ||
+                                                        node->baud_state == XGRID_BAUD_STATE_REVERT) &&
+                                                        buffer->hdr.type != XGRID_PKT_BAUD)
+                                                        continue;
+                                                
+                                                // take over from lower priority
+                                                // packet that has not started yet,
+                                                // otherwise hold packet
+                                                if (node->tx_buffer != -1 &&
+                                                        (node->tx_ptr > 0 || pkt_buffer[node->tx_buffer].prio <= buffer->prio))
+                                                        continue;
+                                                
+                                                // hold packets the neighbor has no room for
+                                                int8_t old_credit = node->tx_credit;
+                                                
+                                                if (!take_credit(n, buffer))
+                                                        continue;
+                                                
+                                                // lower priority packet goes back in
+                                                // line, so it gets its credit back
+                                                if (node->tx_buffer != -1)
+                                                        return_credit(n, old_credit);
+                                                
+                                                node->tx_buffer = i;
+                                                node->tx_ptr = 0;
+                                                node->tx_hdr_len = encode_header(buffer, n, node->tx_hdr);
                                         }
                                         
-                                        // data
-                                        while (cnt > 0 && ptr < buffer->hdr.size+3)
+                                        // send as much of packet as possible
+                                        if (transmit(n, buffer))
                                         {
-                                                nodes[n].stream->put(buffer->buffer[ptr-sizeof(xgrid_header_t)]);
-                                                ptr++;
-                                                cnt--;
+                                                uint16_t wait = ticks - buffer->timestamp;
+                                                
+                                                // remove buffer assigment
+                                                node->tx_buffer = -1;
+                                                buffer->pending &= ~(1 << n);
+                                                
+                                                node->stats.packets_out++;
+                                                if (node->stats.max_tx_wait < wait)
+                                                        node->stats.max_tx_wait = wait;
                                         }
-                                        
                                 }
-                        }
-                        
-                        buffer->ptr += f;
-                        
-                        // are we done?
-                        if (buffer->ptr >= buffer->hdr.size+3)
-                        {
-                                // turn off flag
-                                buffer->flags &= ~XGRID_BUFFER_IN_USE;
                                 
-                                // remove buffer assigments
-                                for (uint8_t n = 0; n < node_cnt; n++)
+                                // are we done?
+                                if (buffer->pending == 0)
                                 {
-                                        if (buffer->mask & (1 << n))
-                                        {
-                                                nodes[n].tx_buffer = -1;
-                                        }
+                                        // turn off flag
+                                        buffer->flags &= ~XGRID_BUFFER_IN_USE_TX;
                                 }
                         }
                 }
         }
         
+        ticks++;
+        
+        // neighbor discovery and relay selection
+        if (hello_timer > 0)
+        {
+                hello_timer--;
+        }
+        else
+        {
+                age_neighbors();
+                select_mprs();
+                send_hello();
+                
+                hello_timer = XGRID_HELLO_INTERVAL;
+        }
+        
+        // routing updates
+        // one port at a time to spread out buffer usage
+        if (route_timer > 0)
+        {
+                route_timer--;
+        }
+        else if (node_cnt > 0)
+        {
+                send_route_update(route_port++);
+                
+                if (route_port >= node_cnt)
+                {
+                        route_port = 0;
+                        age_routes();
+                }
+                
+                route_timer = XGRID_ROUTE_UPDATE_INTERVAL / node_cnt;
+        }
+        
         // state machine timeout
         if (timeout > 0)
         {
@@ -589,13 +2927,30 @@ void Xgrid::process()
 #endif // DEBUG
                 // if we're idle, send a ping request
                 // to get neighbor firmware information
+                // and link statistics
+                xgrid_pkt_ping_request_t d;
+                d.timestamp = ticks;
+                
                 pkt.type = XGRID_PKT_PING_REQUEST;
                 pkt.flags = 0;
                 pkt.radius = 1;
-                pkt.data_len = 0;
+                pkt.data = (uint8_t *)&d;
+                pkt.data_len = sizeof(xgrid_pkt_ping_request_t);
                 
                 send_packet(&pkt);
                 
+                for (uint8_t n = 0; n < node_cnt; n++)
+                {
+                        // keep a sliding window
+                        if (nodes[n].ping_tx >= XGRID_PING_WINDOW)
+                        {
+                                nodes[n].ping_tx >>= 1;
+                                nodes[n].ping_rx >>= 1;
+                        }
+                        
+                        nodes[n].ping_tx++;
+                }
+                
                 // wait 100 cycles
                 delay = 100;
                 state = XGRID_STATE_CHECK_VER;
@@ -768,17 +3123,24 @@ void Xgrid::process_packet(Packet *pkt)
 {
         if (check_unique(pkt))
         {
-                if (pkt->radius > 1)
+                if (should_forward(pkt))
                 {
                         pkt->radius--;
                         uint16_t mask = 0xFFFF;
                         if (pkt->rx_node < 16)
                                 mask &= ~(1 << pkt->rx_node);
                         send_raw_packet(pkt, mask);
+                        set_relayed(pkt);
                         pkt->radius++;
                 }
                 
-                internal_process_packet(pkt);
+                // copies kept only for relaying were delivered already
+                if (pkt->m_flags & XGRID_PKT_M_RELAY)
+                        return;
+                
+                // unicast packets are only delivered at the destination
+                if (!(pkt->flags & XGRID_PKT_FLAG_UNICAST) || pkt->dest_id == my_id)
+                        internal_process_packet(pkt);
         }
 }
 
@@ -793,6 +3155,11 @@ void Xgrid::internal_process_packet(Packet *pkt)
                 xgrid_pkt_ping_reply_t d;
                 d.build = build_number;
                 d.crc = firmware_crc;
+                d.timestamp = 0;
+                d.queue = get_queue_depth();
+                
+                if (pkt->data_len >= sizeof(xgrid_pkt_ping_request_t))
+                        d.timestamp = ((xgrid_pkt_ping_request_t *)(pkt->data))->timestamp;
                 
                 Packet reply;
                 reply.type = XGRID_PKT_PING_REPLY;
@@ -812,6 +3179,24 @@ void Xgrid::internal_process_packet(Packet *pkt)
                 
                 nodes[pkt->rx_node].build = d->build;
                 nodes[pkt->rx_node].crc = d->crc;
+                
+                // link statistics from newer nodes
+                if (pkt->data_len >= sizeof(xgrid_pkt_ping_reply_t))
+                {
+                        xgrid_node_t *node = &(nodes[pkt->rx_node]);
+                        uint16_t rtt = ticks - d->timestamp;
+                        
+                        // smoothed round trip time
+                        if (node->rtt == 0)
+                                node->rtt = rtt;
+                        else
+                                node->rtt = (3 * node->rtt + rtt) / 4;
+                        
+                        if (node->ping_rx < node->ping_tx)
+                                node->ping_rx++;
+                        
+                        node->queue = d->queue;
+                }
         }
         else if (pkt->type == XGRID_PKT_MAINT_CMD)
         {
@@ -925,12 +3310,200 @@ void Xgrid::internal_process_packet(Packet *pkt)
 #endif // DEBUG
                 memset(compare_buffer, 0, sizeof(xgrid_header_minimal_t) * XGRID_COMPARE_BUFFER_SIZE);
         }
+        else if (pkt->type == XGRID_PKT_TOPOLOGY_REQUEST)
+        {
+#ifdef DEBUG
+                printf_P(PSTR("rx topology req\n"));
+#endif // DEBUG
+                send_topology_reply(pkt);
+        }
+        else if (pkt->type == XGRID_PKT_AGGREGATE)
+        {
+                uint8_t *ptr = pkt->data;
+                uint16_t len = pkt->data_len;
+                
+                // contents are application packets
+                if (state == XGRID_STATE_FW_RX)
+                        return;
+                
+                // split apart and process individually
+                while (len > 0)
+                {
+                        xgrid_pkt_aggregate_item_t *item = (xgrid_pkt_aggregate_item_t *)ptr;
+                        Packet sub;
+                        
+                        if (item->len < sizeof(xgrid_header_short_t) || item->len + 1 > len)
+                                break;
+                        
+                        sub.source_id = item->source_id;
+                        sub.type = item->type;
+                        sub.seq = item->seq;
+                        sub.flags = item->flags;
+                        sub.radius = item->radius;
+                        sub.data = item->data;
+                        sub.data_len = item->len - sizeof(xgrid_header_short_t);
+                        sub.rx_node = pkt->rx_node;
+                        sub.m_flags = 0;
+                        
+                        ptr += item->len + 1;
+                        len -= item->len + 1;
+                        
+                        if (sub.flags & XGRID_PKT_FLAG_UNICAST)
+                        {
+                                if (sub.data_len < sizeof(xgrid_pkt_unicast_t))
+                                        continue;
+                                
+                                sub.dest_id = ((xgrid_pkt_unicast_t *)sub.data)->dest_id;
+                                sub.data += sizeof(xgrid_pkt_unicast_t);
+                                sub.data_len -= sizeof(xgrid_pkt_unicast_t);
+                        }
+                        
+                        process_packet(&sub);
+                }
+        }
+        else if (pkt->type == XGRID_PKT_STATS_REQUEST)
+        {
+#ifdef DEBUG
+                printf_P(PSTR("rx stats req\n"));
+#endif // DEBUG
+                send_stats_reply(pkt);
+        }
+        else if (pkt->type == XGRID_PKT_BAUD)
+        {
+                // only accept from direct neighbors
+                if (pkt->rx_node >= node_cnt || set_node_baud == 0 ||
+                        pkt->data_len < sizeof(xgrid_pkt_baud_t))
+                        return;
+                
+                xgrid_pkt_baud_t *b = (xgrid_pkt_baud_t *)(pkt->data);
+                xgrid_node_t *node = &(nodes[pkt->rx_node]);
+                
+                if (b->cmd == XGRID_BAUD_PROPOSE)
+                {
+                        if (node->baud_state == XGRID_BAUD_STATE_IDLE &&
+                                b->rate == node->baud_cur + 1 && b->rate < node->baud_limit)
+                        {
+                                send_baud(pkt->rx_node, XGRID_BAUD_ACCEPT, b->rate);
+                                
+                                node->baud_next = b->rate;
+                                node->baud_state = XGRID_BAUD_STATE_SWITCH;
+                        }
+                        else
+                        {
+                                send_baud(pkt->rx_node, XGRID_BAUD_REJECT, b->rate);
+                        }
+                }
+                else if (b->cmd == XGRID_BAUD_ACCEPT)
+                {
+                        if (node->baud_state == XGRID_BAUD_STATE_PROPOSED && b->rate == node->baud_next)
+                                node->baud_state = XGRID_BAUD_STATE_SWITCH;
+                }
+                else if (b->cmd == XGRID_BAUD_REJECT)
+                {
+                        if (node->baud_state == XGRID_BAUD_STATE_PROPOSED && b->rate == node->baud_next)
+                        {
+                                // neighbor can't go any faster
+                                node->baud_limit = b->rate;
+                                node->baud_state = XGRID_BAUD_STATE_IDLE;
+                        }
+                }
+                else if (b->cmd == XGRID_BAUD_TEST)
+                {
+                        // answer repeats in case an ack was lost
+                        if ((node->baud_state == XGRID_BAUD_STATE_TEST || node->baud_state == XGRID_BAUD_STATE_IDLE) &&
+                                b->rate == node->baud_cur)
+                        {
+                                send_baud(pkt->rx_node, XGRID_BAUD_TEST_ACK, b->rate);
+                                
+                                if (node->baud_state == XGRID_BAUD_STATE_TEST)
+                                {
+                                        node->baud_state = XGRID_BAUD_STATE_IDLE;
+                                        node->baud_errors = node->stats.rx_errors;
+                                }
+                        }
+                }
+                else if (b->cmd == XGRID_BAUD_TEST_ACK)
+                {
+                        if (node->baud_state == XGRID_BAUD_STATE_TEST && b->rate == node->baud_cur)
+                        {
+                                // new rate works, try next step later
+                                node->baud_state = XGRID_BAUD_STATE_IDLE;
+                                node->baud_timer = XGRID_BAUD_STEP_DELAY;
+                                node->baud_errors = node->stats.rx_errors;
+                        }
+                }
+        }
+        else if (pkt->type == XGRID_PKT_HELLO)
+        {
+                // only accept hellos from direct neighbors
+                if (pkt->rx_node >= node_cnt)
+                        return;
+                
+                if (pkt->data_len < sizeof(xgrid_pkt_hello_t))
+                        return;
+                
+                xgrid_pkt_hello_t *hello = (xgrid_pkt_hello_t *)(pkt->data);
+                xgrid_pkt_hello_entry_t *h = hello->neighbors;
+                uint8_t cnt = (pkt->data_len - sizeof(xgrid_pkt_hello_t)) / sizeof(xgrid_pkt_hello_entry_t);
+                xgrid_node_t *node = &(nodes[pkt->rx_node]);
+                
+                // new neighbor gets a fresh try at every rate
+                if (node->neighbor_id != pkt->source_id)
+                        node->baud_limit = XGRID_BAUD_CNT;
+                
+                node->neighbor_id = pkt->source_id;
+                node->hello_age = 0;
+                node->mpr_selector = 0;
+                node->two_hop_cnt = 0;
+                node->caps = hello->caps & (XGRID_CAPS | XGRID_CAP_BAUD);
+                node->load = hello->load;
+                node->link_sym = 0;
+                
+                for (uint8_t i = 0; i < cnt; i++)
+                {
+                        if (h[i].id == my_id)
+                        {
+                                // neighbor hears us too
+                                node->link_sym = 1;
+                                
+                                // did the neighbor pick us as a relay?
+                                if (h[i].flags & XGRID_HELLO_FLAG_MPR)
+                                        node->mpr_selector = 1;
+                        }
+                        else if (node->two_hop_cnt < XGRID_MAX_NODES)
+                        {
+                                node->two_hop[node->two_hop_cnt++] = h[i].id;
+                        }
+                }
+        }
+        else if (pkt->type == XGRID_PKT_ROUTE_UPDATE)
+        {
+                // only accept updates from direct neighbors
+                if (pkt->rx_node >= node_cnt)
+                        return;
+                
+                xgrid_pkt_route_entry_t *r = (xgrid_pkt_route_entry_t *)(pkt->data);
+                uint8_t cnt = pkt->data_len / sizeof(xgrid_pkt_route_entry_t);
+                
+                // sender is one hop away
+                update_route(pkt->source_id, pkt->rx_node, 1);
+                
+                for (uint8_t i = 0; i < cnt; i++)
+                {
+                        if (r[i].metric < XGRID_ROUTE_INFINITY)
+                                update_route(r[i].id, pkt->rx_node, r[i].metric + 1);
+                        else
+                                update_route(r[i].id, pkt->rx_node, XGRID_ROUTE_INFINITY);
+                }
+        }
         else
         {
                 // if we haven't processed the packet internally,
                 // pass it to the application
-                if (rx_pkt)
-                        (*rx_pkt)(pkt);
+                if (pkt->flags & XGRID_PKT_FLAG_FRAGMENT)
+                        receive_fragment(pkt);
+                else
+                        deliver_packet(pkt, rx_cur_buffer);
         }
 }
 
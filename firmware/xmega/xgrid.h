@@ -51,19 +51,190 @@ extern char   __BUILD_NUMBER;
 #define XGRID_SM_BUFFER_SIZE    64
 #define XGRID_LG_BUFFER_COUNT   1
 #define XGRID_LG_BUFFER_SIZE    (512+2)
-#define XGRID_BUFFER_COUNT      (XGRID_SM_BUFFER_COUNT + XGRID_LG_BUFFER_COUNT)
+// messages go out as small fragments, so the large buffer
+// is only needed for firmware blocks and the odd packet
+// sent whole, while it is idle its space is lent out as
+// more small buffers, a large request holds back new
+// loans for the wait in ms so they can drain
+#define XGRID_LG_BUFFER_IND     XGRID_SM_BUFFER_COUNT
+#define XGRID_SM_LENT_COUNT     (XGRID_LG_BUFFER_SIZE / XGRID_SM_BUFFER_SIZE)
+#define XGRID_LG_WAIT           2
+#define XGRID_BUFFER_COUNT      (XGRID_SM_BUFFER_COUNT + XGRID_LG_BUFFER_COUNT + XGRID_SM_LENT_COUNT)
+#define XGRID_BUFFER_CLASS_CNT  2
 
-#define XGRID_BUFFER_IN_USE     0x03
+// priority classes
+// control is network and maintenance traffic (types 0xF*)
+// normal is firmware blocks and flagged application packets
+// bulk is everything else
+#define XGRID_PRIO_CONTROL      0
+#define XGRID_PRIO_NORMAL       1
+#define XGRID_PRIO_BULK         2
+#define XGRID_PRIO_CNT          3
+
+// small buffers held back from lower priority classes
+#define XGRID_SM_BUFFER_RESERVE_CONTROL 2
+#define XGRID_SM_BUFFER_RESERVE_NORMAL  2
+
+#define XGRID_BUFFER_IN_USE     0x3B
 #define XGRID_BUFFER_IN_USE_TX  0x01
 #define XGRID_BUFFER_IN_USE_RX  0x02
-#define XGRID_BUFFER_UNIQUE     0x04
+#define XGRID_BUFFER_SEQ16      0x04
+#define XGRID_BUFFER_IN_USE_AGG 0x08
+#define XGRID_BUFFER_IN_USE_APP 0x10
+#define XGRID_BUFFER_IN_USE_DELIVER 0x20
+#define XGRID_BUFFER_RELAY      0x40
+
+// application packets waiting for dispatch(),
+// each holds its buffer until handled
+#define XGRID_DELIVER_QUEUE_SIZE 4
+#define XGRID_DELIVER_DIRECT    -1
+#define XGRID_DELIVER_MESSAGE   -2
+
+// application handlers
+// registered by packet type and optional port, the
+// first data byte, types from 0xF0 up are reserved
+#define XGRID_MAX_HANDLERS      8
+#define XGRID_HANDLER_TYPES     0xF0
+
+// handlers are chained in buckets by the low bits of
+// the type, must be a power of two
+#define XGRID_HANDLER_BUCKETS   16
+#define XGRID_PORT_ANY          0xFF
+
+// handler options
+// local: broadcasts are not passed on
+// priority: type goes in the normal class ahead of bulk
+// immediate: called from process() instead of dispatch()
+#define XGRID_HANDLER_LOCAL     0x01
+#define XGRID_HANDLER_PRIORITY  0x02
+#define XGRID_HANDLER_IMMEDIATE 0x04
+
+// aggregation of small bulk packets
+// default latency budget in ms, 0 to disable
+#define XGRID_AGGREGATE_LATENCY  5
+#define XGRID_AGGREGATE_MAX_ITEM 32
+
+#define XGRID_ROUTE_TABLE_SIZE  16
+#define XGRID_ROUTE_INFINITY    16
+#define XGRID_ROUTE_UPDATE_INTERVAL 5000
+#define XGRID_ROUTE_MAX_AGE     3
+
+#define XGRID_HELLO_INTERVAL    2000
+#define XGRID_HELLO_MAX_AGE     3
+
+#define XGRID_PING_WINDOW       16
+
+// fragmentation
+// fragments fit a small buffer so transit nodes never
+// need a large one, reassembly gives up after the
+// timeout in ms without a new fragment
+#define XGRID_FRAG_DATA_SIZE    (XGRID_SM_BUFFER_SIZE - sizeof(xgrid_pkt_unicast_t) - sizeof(xgrid_pkt_fragment_t))
+#define XGRID_FRAG_MAX_COUNT    128
+#define XGRID_FRAG_MAX_SIZE     (XGRID_FRAG_MAX_COUNT * XGRID_FRAG_DATA_SIZE)
+#define XGRID_FRAG_TIMEOUT      500
+
+// default receive idle timeout in ms, 0 to disable
+#define XGRID_RX_TIMEOUT        10
+
+// baud rate negotiation, times in ms
+#define XGRID_BAUD_CNT          2
+#define XGRID_BAUD_TIMEOUT      100
+#define XGRID_BAUD_TEST_TIME    200
+#define XGRID_BAUD_TEST_INTERVAL 10
+#define XGRID_BAUD_STEP_DELAY   500
+#define XGRID_BAUD_MAX_ERRORS   16
+
+#define XGRID_BAUD_STATE_IDLE     0x00
+#define XGRID_BAUD_STATE_PROPOSED 0x01
+#define XGRID_BAUD_STATE_SWITCH   0x02
+#define XGRID_BAUD_STATE_TEST     0x03
+#define XGRID_BAUD_STATE_REVERT   0x04
 
 #define XGRID_IDENTIFIER 0x5A
 #define XGRID_ESCAPE 0x55
 
+// compact header
+// identifier, length, type, seq, format, then
+// source, flags, and radius if present in format
+// defaults are sending neighbor, 0, and 1
+#define XGRID_IDENTIFIER_COMPACT   0x5B
+#define XGRID_COMPACT_HEADER_SIZE  5
+#define XGRID_COMPACT_MAX_DATA     (255 - 7)
+#define XGRID_COMPACT_SOURCE       0x01
+#define XGRID_COMPACT_FLAGS        0x02
+#define XGRID_COMPACT_RADIUS       0x04
+#define XGRID_COMPACT_MASK         0x07
+
+// header v2
+// carries destination, 16 bit sequence number, and
+// buffer credits, protected by a CRC-8 checked
+// before allocation
+#define XGRID_IDENTIFIER_V2     0x59
+#define XGRID_V2_SEQ16          0x01
+#define XGRID_V2_MASK           0x01
+
+#define XGRID_MAX_HEADER_SIZE 15
+
+// buffer credits
+// free small buffers in the high nibble and large
+// in the low nibble, shared out between the neighbors
+// that use credits, a neighbor out of credit is
+// probed with one packet after the timeout in ms
+#define XGRID_CREDIT_MAX        15
+#define XGRID_CREDIT_TIMEOUT    20
+
+// escaped framing
+// frame starts with escape then identifier, any escape
+// or identifier byte inside the frame is sent as
+// escape followed by the byte xor 0x20
+#define XGRID_ESCAPE_XOR        0x20
+
+// in-band flow control on escaped links
+// escape followed by XON or XOFF, sent by the port when
+// its receive queue is down to XOFF_ROOM free bytes and
+// again once it drains to XON_LEVEL, room covers the
+// neighbor's transmit ring still going out after XOFF,
+// a pause lapses after the timeout in ms in case XON
+// is lost
+#define XGRID_XON               0x11
+#define XGRID_XOFF              0x13
+#define XGRID_XOFF_ROOM         48
+#define XGRID_XON_LEVEL         32
+#define XGRID_XOFF_TIMEOUT      10
+
+// link flags
+// port has RTS/CTS wired, no in-band flow control
+#define XGRID_LINK_HW_FLOW      0x01
+
+// receive states
+#define XGRID_RX_STATE_HUNT     0x00
+#define XGRID_RX_STATE_HEADER   0x01
+#define XGRID_RX_STATE_ALLOC    0x02
+#define XGRID_RX_STATE_DATA     0x03
+#define XGRID_RX_STATE_DROP     0x04
+
 // packet types
 #include "xgrid_types.h"
 
+// supported link capabilities
+#define XGRID_CAPS (XGRID_CAP_COMPACT | XGRID_CAP_V2 | XGRID_CAP_ESCAPE | XGRID_CAP_XONXOFF | XGRID_CAP_CREDITS)
+
+// send status
+// congested means queued but a neighbor is out of credit
+#define XGRID_SEND_OK           0x00
+#define XGRID_SEND_CONGESTED    0x01
+#define XGRID_SEND_NO_BUFFER    0x02
+#define XGRID_SEND_NO_ROUTE     0x03
+#define XGRID_SEND_BLOCKED      0x04
+#define XGRID_SEND_BUSY         0x05
+#define XGRID_SEND_TOO_LARGE    0x06
+
+// packet metadata flags
+// high byte of seq is valid
+#define XGRID_PKT_M_SEQ16       0x01
+// seen before, only kept so it can be relayed
+#define XGRID_PKT_M_RELAY       0x02
+
 // states
 #define XGRID_STATE_IDLE        0x00
 #define XGRID_STATE_INIT        0x01
@@ -82,8 +253,9 @@ public:
         {
                 // Packet parameters
                 uint16_t source_id;
+                uint16_t dest_id;
                 uint8_t type;
-                uint8_t seq;
+                uint16_t seq;
                 uint8_t flags;
                 uint8_t radius;
                 // data
@@ -117,36 +289,122 @@ private:
                 uint8_t radius;
         } __attribute__ ((__packed__)) xgrid_header_short_t;
         
+        typedef struct
+        {
+                uint8_t identifier;
+                uint8_t hflags;
+                uint16_t size;
+                uint16_t source_id;
+                uint16_t dest_id;
+                uint8_t type;
+                uint16_t seq;
+                uint8_t flags;
+                uint8_t radius;
+                uint8_t credits;
+                uint8_t crc;
+        } __attribute__ ((__packed__)) xgrid_header_v2_t;
+        
         typedef struct
         {
                 uint16_t source_id;
                 uint8_t type;
-                uint8_t seq;
+                uint16_t seq;
+                uint8_t seq16;
+                uint8_t relayed;
         } __attribute__ ((__packed__)) xgrid_header_minimal_t;
         
         typedef struct
         {
                 IOStream *stream;
+                uint8_t link_flags;
                 int8_t rx_buffer;
                 int8_t tx_buffer;
                 uint16_t drop_chars;
+                uint8_t rx_state;
+                uint8_t rx_raw[XGRID_MAX_HEADER_SIZE];
+                uint8_t rx_raw_ptr;
+                uint8_t rx_raw_len;
+                xgrid_header_t rx_hdr;
+                uint8_t rx_seq_hi;
+                uint8_t rx_seq16;
+                uint8_t rx_relay;
+                uint16_t rx_dest_id;
+                uint16_t rx_ptr;
+                uint16_t rx_idle;
+                uint8_t rx_escaped;
+                uint8_t rx_esc;
+                uint8_t tx_hdr[XGRID_MAX_HEADER_SIZE];
+                uint8_t tx_hdr_len;
+                uint8_t tx_data_off;
+                uint8_t tx_escaped;
+                uint8_t tx_pause;
+                uint16_t overrun_last;
+                uint8_t credits[XGRID_BUFFER_CLASS_CNT];
+                uint8_t credits_out[XGRID_BUFFER_CLASS_CNT];
+                int8_t tx_credit;
+                uint8_t credits_valid;
+                uint8_t credits_sent;
+                uint8_t credit_age;
+                uint16_t tx_ptr;
                 uint32_t build;
                 uint16_t crc;
+                uint16_t neighbor_id;
+                uint8_t hello_age;
+                uint8_t mpr_selector;
+                uint8_t two_hop_cnt;
+                uint16_t two_hop[XGRID_MAX_NODES];
+                uint8_t caps;
+                uint8_t link_sym;
+                uint16_t rtt;
+                uint8_t ping_tx;
+                uint8_t ping_rx;
+                uint8_t queue;
+                uint8_t load;
+                xgrid_pkt_stats_port_t stats;
+                int8_t agg_buffer;
+                uint16_t agg_deadline;
+                uint8_t baud_state;
+                uint8_t baud_cur;
+                uint8_t baud_next;
+                uint8_t baud_limit;
+                uint16_t baud_timer;
+                uint16_t baud_errors;
         } xgrid_node_t;
         
+        typedef struct
+        {
+                uint16_t id;
+                uint8_t port;
+                uint8_t metric;
+                uint8_t age;
+        } xgrid_route_t;
+        
         typedef struct
         {
                 xgrid_header_t hdr;
+                uint8_t seq_hi;
                 uint8_t *buffer;
                 uint16_t buffer_len;
-                uint16_t ptr;
                 uint16_t mask;
+                uint16_t pending;
                 uint8_t flags;
+                uint16_t timestamp;
+                uint8_t prio;
+                uint8_t deliver_refs;
         } xgrid_buffer_t;
         
+        typedef struct
+        {
+                void (*func)(Packet *pkt);
+                uint8_t type;
+                uint8_t port;
+                uint8_t options;
+                int8_t next;
+        } xgrid_handler_t;
+        
         // Per object data
         uint16_t my_id;
-        uint8_t cur_seq;
+        uint16_t cur_seq;
         
         uint16_t firmware_crc;
         uint32_t build_number;
@@ -169,44 +427,200 @@ private:
         xgrid_header_minimal_t compare_buffer[XGRID_COMPARE_BUFFER_SIZE];
         int8_t compare_buffer_ptr;
         
+        // routing table
+        xgrid_route_t route_table[XGRID_ROUTE_TABLE_SIZE];
+        uint16_t route_timer;
+        uint8_t route_port;
+        
+        // multipoint relays
+        uint16_t mpr_mask;
+        uint16_t hello_timer;
+        
+        // free running 1 kHz tick
+        uint16_t ticks;
+        
         // transmit and receive packet buffers
         uint8_t pkt_buffer_sm[XGRID_SM_BUFFER_COUNT][XGRID_SM_BUFFER_SIZE];
         uint8_t pkt_buffer_lg[XGRID_LG_BUFFER_COUNT][XGRID_LG_BUFFER_SIZE];
         xgrid_buffer_t pkt_buffer[XGRID_BUFFER_COUNT];
+        uint8_t lg_wait;
+        
+        // buffer statistics, small and large
+        xgrid_pkt_stats_buffer_t buffer_stats[XGRID_BUFFER_CLASS_CNT];
+        
+        // statistics reply in progress
+        uint16_t stats_dest;
+        uint8_t stats_radius;
+        uint8_t stats_flags;
+        uint8_t stats_part;
+        uint8_t stats_active;
+        
+        // fragmented message being sent
+        Packet frag_pkt;
+        uint16_t frag_mask;
+        uint16_t frag_offset;
+        uint16_t frag_msg_id;
+        uint8_t frag_busy;
+        
+        // message being reassembled
+        uint8_t *msg_buffer;
+        uint16_t msg_buffer_len;
+        uint16_t msg_source_id;
+        uint16_t msg_id;
+        uint16_t msg_total;
+        uint16_t msg_received;
+        uint16_t msg_age;
+        uint8_t msg_active;
+        uint8_t msg_held;
+        uint8_t msg_map[XGRID_FRAG_MAX_COUNT / 8];
+        
+        // application delivery queue
+        Packet deliver_queue[XGRID_DELIVER_QUEUE_SIZE];
+        int8_t deliver_buffer[XGRID_DELIVER_QUEUE_SIZE];
+        uint8_t deliver_head;
+        uint8_t deliver_cnt;
+        int8_t rx_cur_buffer;
+        
+        // application handlers, chained per bucket
+        xgrid_handler_t handlers[XGRID_MAX_HANDLERS];
+        int8_t handler_first[XGRID_HANDLER_BUCKETS];
         
         // Static data
         
         // Private methods
         void populate_packet(Packet *pkt, uint8_t *buffer);
-        uint8_t is_unique(Packet *pkt);
+        int8_t find_compare(Packet *pkt);
         uint8_t check_unique(Packet *pkt);
-        int8_t get_free_buffer(uint16_t data_size);
+        void set_relayed(Packet *pkt);
+        uint8_t get_priority(uint8_t type, uint8_t flags);
+        uint8_t buffer_class(uint8_t i);
+        int8_t get_free_buffer(uint16_t data_size, uint8_t prio);
+        
+        void update_route(uint16_t id, uint8_t port, uint8_t metric);
+        void age_routes();
+        void send_route_update(uint8_t port);
+        uint16_t get_route_mask(uint16_t dest_id, uint8_t rx_node);
+        void learn_reverse_route(Packet *pkt, uint8_t radius);
+        
+        uint8_t link_caps(uint8_t n);
+        uint8_t is_neighbor(uint16_t id);
+        uint8_t node_reaches(uint8_t n, uint16_t id);
+        void age_neighbors();
+        void select_mprs();
+        void send_hello();
+        uint8_t should_forward(Packet *pkt);
+        
+        uint8_t get_queue_depth();
+        void send_topology_reply(Packet *pkt);
+        void reset_stats();
+        void send_stats_reply(Packet *pkt);
+        void send_stats_part();
+        
+        uint16_t aggregate_packet(Packet *pkt, uint16_t mask);
+        void flush_aggregate(uint8_t n);
+        
+        uint8_t route_packet(Packet *pkt, uint16_t *mask);
+        
+        void send_fragments();
+        void receive_fragment(Packet *pkt);
+        
+        void deliver_packet(Packet *pkt, int8_t bi);
+        int8_t find_handler(Packet *pkt);
+        uint8_t type_options(uint8_t type);
+        void call_handler(Packet *pkt);
+        
+        void queue_buffer(xgrid_buffer_t *buffer, uint16_t mask);
+        uint8_t encode_header(xgrid_buffer_t *buffer, uint8_t n, uint8_t *out);
+        int8_t decode_header(uint8_t n);
+        uint8_t transmit(uint8_t n, xgrid_buffer_t *buffer);
+        uint8_t start_frame(uint8_t n, uint8_t b, uint8_t escaped);
+        int16_t read_byte(uint8_t n);
+        void receive_packet(uint8_t n);
+        
+        void send_baud(uint8_t n, uint8_t cmd, uint8_t rate);
+        void process_baud(uint8_t n);
+        void check_baud(uint8_t n);
+        void process_flow(uint8_t n);
+        
+        uint8_t get_credits(uint8_t n);
+        int8_t credit_class(uint8_t n, uint16_t data_size, uint8_t prio);
+        uint8_t take_credit(uint8_t n, xgrid_buffer_t *buffer);
+        void return_credit(uint8_t n, int8_t c);
+        void seal_header_v2(uint8_t n, uint8_t *out);
+        void send_credits(uint8_t n);
+        void process_credits(uint8_t n);
         
         void internal_process_packet(Packet *pkt);
         
         // Private static methods
+        static uint8_t is_identifier(uint8_t b);
         
 public:
         // Public variables
         
         // receive packet callback
+        // called from dispatch(), data valid until it returns
         void (*rx_pkt)(Packet *pkt);
         
+        // aggregation latency budget in ms
+        uint8_t aggregate_latency;
+        
+        // receive idle timeout in ms
+        uint16_t rx_timeout;
+        
+        // set node port baud rate callback
+        // return 0 if transmitter still busy
+        uint8_t (*set_node_baud)(uint8_t node, uint32_t baud);
+        
+        // application load hint sent with hellos
+        uint8_t load;
+        
         // Public methods
         Xgrid();
         ~Xgrid();
         
         uint16_t get_id();
+        uint16_t get_ticks();
+        uint8_t get_neighbor(uint8_t n, uint16_t *id, uint8_t *load);
+        
+        int8_t add_node(IOStream *stream, uint8_t link_flags = 0);
+        
+        uint8_t send_packet(Packet *pkt, uint16_t mask = 0xFFFF);
+        uint8_t send_raw_packet(Packet *pkt, uint16_t mask = 0xFFFF);
         
-        int8_t add_node(IOStream *stream);
+        // zero copy send, reserve sets pkt->data to space for
+        // pkt->data_len bytes and returns a handle or -1, build
+        // the payload in place then commit or cancel
+        int8_t reserve_packet(Packet *pkt);
+        uint8_t commit_packet(Packet *pkt, int8_t handle, uint16_t mask = 0xFFFF);
+        uint8_t commit_raw_packet(Packet *pkt, int8_t handle, uint16_t mask = 0xFFFF);
+        void cancel_packet(int8_t handle);
         
-        void send_packet(Packet *pkt, uint16_t mask = 0xFFFF);
-        void send_raw_packet(Packet *pkt, uint16_t mask = 0xFFFF);
+        // payload is head followed by pkt->data
+        uint8_t send_packet_gather(Packet *pkt, const uint8_t *head, uint16_t head_len, uint16_t mask = 0xFFFF);
+        uint8_t send_port_packet(Packet *pkt, uint8_t port, uint16_t mask = 0xFFFF);
+        
+        // large messages go out in fragments from process(),
+        // data must stay valid until message_pending() clears
+        uint8_t send_message(Packet *pkt, uint16_t mask = 0xFFFF);
+        uint8_t message_pending();
+        
+        // reassembled messages are passed to rx_pkt with
+        // data in this buffer, valid until rx_pkt returns
+        void set_message_buffer(uint8_t *buffer, uint16_t len);
         uint8_t try_read_packet(Packet *pkt, IStream *stream);
         uint8_t try_parse_packet(Packet *pkt, const uint8_t *buffer, uint16_t len);
         
         void process();
         void process_packet(Packet *pkt);
+        
+        // hand queued packets to handlers, call from main loop
+        uint8_t dispatch();
+        
+        // packets with no matching handler go to rx_pkt,
+        // port handlers get data without the port byte
+        int8_t register_handler(uint8_t type, uint8_t port, void (*func)(Packet *pkt), uint8_t options = 0);
+        void unregister_handler(int8_t handle);
 };
 
 // Prototypes
@@ -0,0 +1,682 @@
+/************************************************************************/
+/* xgrid collectives                                                    */
+/*                                                                      */
+/* xgrid_coll.cpp                                                       */
+/*                                                                      */
+/* Alex Forencich <alex@alexforencich.com>                              */
+/*                                                                      */
+/* Copyright (c) 2011 Alex Forencich                                    */
+/*                                                                      */
+/* Permission is hereby granted, free of charge, to any person          */
+/* obtaining a copy of this software and associated documentation       */
+/* files(the "Software"), to deal in the Software without restriction,  */
+/* including without limitation the rights to use, copy, modify, merge, */
+/* publish, distribute, sublicense, and/or sell copies of the Software, */
+/* and to permit persons to whom the Software is furnished to do so,    */
+/* subject to the following conditions:                                 */
+/*                                                                      */
+/* The above copyright notice and this permission notice shall be       */
+/* included in all copies or substantial portions of the Software.      */
+/*                                                                      */
+/* THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,      */
+/* EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF   */
+/* MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND                */
+/* NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS  */
+/* BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN   */
+/* ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN    */
+/* CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE     */
+/* SOFTWARE.                                                            */
+/*                                                                      */
+/************************************************************************/
+
+#include "xgrid_coll.h"
+
+#include <string.h>
+
+// Statics
+XgridColl *XgridColl::instance = 0;
+
+
+XgridColl::XgridColl(Xgrid *_xgrid) :
+        xgrid(_xgrid),
+        func_cnt(0),
+        root(0),
+        epoch(0),
+        depth(0),
+        joined(0),
+        parent(-1),
+        children(0),
+        tree_time(0),
+        rx_result(0)
+{
+        reset_ops();
+}
+
+
+XgridColl::~XgridColl()
+{
+        
+}
+
+
+void XgridColl::begin()
+{
+        instance = this;
+        
+        xgrid->register_handler(XGRID_PKT_COLL_TREE, XGRID_PORT_ANY, &handle_tree);
+        xgrid->register_handler(XGRID_PKT_COLL_JOIN, XGRID_PORT_ANY, &handle_join);
+        xgrid->register_handler(XGRID_PKT_COLL_UP, XGRID_PORT_ANY, &handle_up);
+        xgrid->register_handler(XGRID_PKT_COLL_DOWN, XGRID_PORT_ANY, &handle_down);
+}
+
+
+int8_t XgridColl::register_func(uint8_t id, Combine func)
+{
+        int8_t f = find_func(id);
+        
+        // replace existing
+        if (f >= 0)
+        {
+                funcs[f].func = func;
+                return f;
+        }
+        
+        if (func_cnt >= XGRID_COLL_MAX_FUNCS)
+                return -1;
+        
+        funcs[func_cnt].id = id;
+        funcs[func_cnt].func = func;
+        
+        return func_cnt++;
+}
+
+
+int8_t XgridColl::find_func(uint8_t id)
+{
+        for (uint8_t f = 0; f < func_cnt; f++)
+        {
+                if (funcs[f].id == id)
+                        return f;
+        }
+        
+        return -1;
+}
+
+
+void XgridColl::reset_ops()
+{
+        memset(slots, 0, sizeof(slots));
+        
+        done_cnt = 0;
+        
+        bar_gen = 0;
+        bar_local = 0;
+        bar_sent = 0;
+        bar_have = 0;
+        bar_time = 0;
+}
+
+
+void XgridColl::build_tree()
+{
+        reset_ops();
+        
+        root = xgrid->get_id();
+        epoch++;
+        depth = 0;
+        joined = 1;
+        parent = -1;
+        children = 0;
+        tree_time = xgrid->get_ticks();
+        
+        send_tree(0xFFFF);
+}
+
+
+uint8_t XgridColl::tree_ready()
+{
+        return joined && (uint16_t)(xgrid->get_ticks() - tree_time) >= XGRID_COLL_SETTLE;
+}
+
+
+uint8_t XgridColl::is_root()
+{
+        return joined && parent < 0;
+}
+
+
+uint16_t XgridColl::get_root()
+{
+        return root;
+}
+
+
+int8_t XgridColl::get_parent()
+{
+        return joined ? parent : -1;
+}
+
+
+void XgridColl::send_tree(uint16_t mask)
+{
+        xgrid_pkt_coll_tree_t t;
+        Xgrid::Packet pkt;
+        
+        t.root = root;
+        t.epoch = epoch;
+        t.depth = depth;
+        
+        pkt.type = XGRID_PKT_COLL_TREE;
+        pkt.flags = 0;
+        pkt.radius = 1;
+        pkt.data = (uint8_t *)&t;
+        pkt.data_len = sizeof(xgrid_pkt_coll_tree_t);
+        
+        xgrid->send_packet(&pkt, mask);
+}
+
+
+void XgridColl::receive_tree(uint8_t n, xgrid_pkt_coll_tree_t *t)
+{
+        // already in this tree, the sender is not our parent
+        if (joined && t->root == root && t->epoch == epoch)
+                return;
+        
+        // late offer for an older tree from the same root
+        if (joined && t->root == root && (int8_t)(t->epoch - epoch) < 0)
+                return;
+        
+        reset_ops();
+        
+        root = t->root;
+        epoch = t->epoch;
+        depth = t->depth + 1;
+        joined = 1;
+        parent = n;
+        children = 0;
+        tree_time = xgrid->get_ticks();
+        
+        // join the parent, pass the offer on
+        Xgrid::Packet pkt;
+        
+        pkt.type = XGRID_PKT_COLL_JOIN;
+        pkt.flags = 0;
+        pkt.radius = 1;
+        pkt.data = (uint8_t *)t;
+        pkt.data_len = sizeof(xgrid_pkt_coll_tree_t);
+        
+        xgrid->send_packet(&pkt, 1 << n);
+        
+        send_tree(0xFFFF & ~(1 << n));
+}
+
+
+uint8_t XgridColl::send_coll(uint8_t type, uint16_t mask, uint8_t op, uint8_t kind, uint8_t func,
+        uint16_t source, const uint8_t *data, uint8_t len)
+{
+        xgrid_pkt_coll_t c;
+        Xgrid::Packet pkt;
+        
+        c.root = root;
+        c.epoch = epoch;
+        c.op = op;
+        c.kind = kind;
+        c.func = func;
+        c.source = source;
+        
+        pkt.type = type;
+        pkt.flags = 0;
+        pkt.radius = 1;
+        pkt.data = (uint8_t *)data;
+        pkt.data_len = len;
+        
+        return xgrid->send_packet_gather(&pkt, (uint8_t *)&c, sizeof(xgrid_pkt_coll_t), mask);
+}
+
+
+void XgridColl::deliver(uint8_t kind, uint8_t op, uint16_t source, const uint8_t *data, uint8_t len)
+{
+        if (rx_result)
+                (*rx_result)(kind, op, source, data, len);
+}
+
+
+int8_t XgridColl::get_slot(uint8_t op, uint8_t kind, uint8_t func)
+{
+        int8_t free_slot = -1;
+        
+        for (uint8_t i = 0; i < XGRID_COLL_MAX_OPS; i++)
+        {
+                if (!slots[i].in_use)
+                {
+                        if (free_slot < 0)
+                                free_slot = i;
+                        continue;
+                }
+                
+                if (slots[i].op == op)
+                        return i;
+        }
+        
+        if (free_slot < 0)
+                return -1;
+        
+        xgrid_coll_slot_t *s = &(slots[free_slot]);
+        
+        s->in_use = 1;
+        s->op = op;
+        s->kind = kind;
+        s->func = func;
+        s->local = 0;
+        s->have = 0;
+        s->started = xgrid->get_ticks();
+        s->len = 0;
+        
+        return free_slot;
+}
+
+
+int8_t XgridColl::find_done(uint8_t op)
+{
+        for (uint8_t i = 0; i < done_cnt; i++)
+        {
+                if (done_ops[i] == op)
+                        return i;
+        }
+        
+        return -1;
+}
+
+
+void XgridColl::set_done(uint8_t op)
+{
+        // oldest falls off the front
+        if (done_cnt >= XGRID_COLL_DONE_CNT)
+                clear_done(0);
+        
+        done_ops[done_cnt++] = op;
+}
+
+
+void XgridColl::clear_done(int8_t d)
+{
+        done_cnt--;
+        
+        for (uint8_t i = d; i < done_cnt; i++)
+                done_ops[i] = done_ops[i + 1];
+}
+
+
+void XgridColl::merge(xgrid_coll_slot_t *s, const uint8_t *data, uint8_t len)
+{
+        // first value seeds the accumulator
+        if (!s->local && s->have == 0)
+        {
+                memcpy(s->acc, data, len);
+                s->len = len;
+                return;
+        }
+        
+        int8_t f = find_func(s->func);
+        
+        if (f < 0)
+                return;
+        
+        if (len > s->len)
+                len = s->len;
+        
+        (*funcs[f].func)(s->acc, data, len);
+}
+
+
+void XgridColl::check_slot(int8_t i, uint8_t force)
+{
+        xgrid_coll_slot_t *s = &(slots[i]);
+        
+        // wait for our own value and every child
+        if (!force && (!s->local || (s->have & children) != children))
+                return;
+        
+        if (s->local || s->have)
+        {
+                if (parent >= 0)
+                {
+                        // partial result goes up
+                        if (send_coll(XGRID_PKT_COLL_UP, 1 << parent, s->op, s->kind, s->func,
+                                xgrid->get_id(), s->acc, s->len) == XGRID_SEND_NO_BUFFER)
+                                return;
+                }
+                else
+                {
+                        if (s->kind == XGRID_COLL_ALLREDUCE && children)
+                        {
+                                if (send_coll(XGRID_PKT_COLL_DOWN, children, s->op, s->kind, s->func,
+                                        root, s->acc, s->len) == XGRID_SEND_NO_BUFFER)
+                                        return;
+                        }
+                        
+                        deliver(s->kind, s->op, root, s->acc, s->len);
+                }
+        }
+        
+        set_done(s->op);
+        s->in_use = 0;
+}
+
+
+uint8_t XgridColl::contribute(uint8_t op, uint8_t kind, uint8_t func, const uint8_t *data, uint8_t len)
+{
+        if (!joined)
+                return XGRID_COLL_NO_TREE;
+        
+        if (len > XGRID_COLL_DATA_SIZE || find_func(func) < 0)
+                return XGRID_COLL_ERROR;
+        
+        // op is being reused
+        int8_t d = find_done(op);
+        
+        if (d >= 0)
+                clear_done(d);
+        
+        int8_t i = get_slot(op, kind, func);
+        
+        if (i < 0)
+                return XGRID_COLL_BUSY;
+        
+        xgrid_coll_slot_t *s = &(slots[i]);
+        
+        // one value per node and op
+        if (s->local)
+                return XGRID_COLL_ERROR;
+        
+        // children may have arrived first
+        merge(s, data, len);
+        s->local = 1;
+        
+        check_slot(i, 0);
+        
+        return XGRID_COLL_OK;
+}
+
+
+uint8_t XgridColl::reduce(uint8_t op, uint8_t func, const uint8_t *data, uint8_t len)
+{
+        return contribute(op, XGRID_COLL_REDUCE, func, data, len);
+}
+
+
+uint8_t XgridColl::allreduce(uint8_t op, uint8_t func, const uint8_t *data, uint8_t len)
+{
+        return contribute(op, XGRID_COLL_ALLREDUCE, func, data, len);
+}
+
+
+uint8_t XgridColl::broadcast(uint8_t op, const uint8_t *data, uint8_t len)
+{
+        if (!joined)
+                return XGRID_COLL_NO_TREE;
+        
+        if (parent >= 0)
+                return XGRID_COLL_NOT_ROOT;
+        
+        if (len > XGRID_COLL_DATA_SIZE)
+                return XGRID_COLL_ERROR;
+        
+        if (children && send_coll(XGRID_PKT_COLL_DOWN, children, op, XGRID_COLL_BROADCAST, 0,
+                root, data, len) == XGRID_SEND_NO_BUFFER)
+                return XGRID_COLL_BUSY;
+        
+        deliver(XGRID_COLL_BROADCAST, op, root, data, len);
+        
+        return XGRID_COLL_OK;
+}
+
+
+uint8_t XgridColl::gather(uint8_t op, const uint8_t *data, uint8_t len)
+{
+        if (!joined)
+                return XGRID_COLL_NO_TREE;
+        
+        if (len > XGRID_COLL_DATA_SIZE)
+                return XGRID_COLL_ERROR;
+        
+        if (parent < 0)
+        {
+                deliver(XGRID_COLL_GATHER, op, root, data, len);
+                return XGRID_COLL_OK;
+        }
+        
+        if (send_coll(XGRID_PKT_COLL_UP, 1 << parent, op, XGRID_COLL_GATHER, 0,
+                xgrid->get_id(), data, len) == XGRID_SEND_NO_BUFFER)
+                return XGRID_COLL_BUSY;
+        
+        return XGRID_COLL_OK;
+}
+
+
+uint8_t XgridColl::barrier()
+{
+        if (!joined)
+                return XGRID_COLL_NO_TREE;
+        
+        if (bar_local)
+                return XGRID_COLL_BUSY;
+        
+        bar_local = 1;
+        bar_sent = 0;
+        
+        check_barrier();
+        
+        return XGRID_COLL_OK;
+}
+
+
+uint8_t XgridColl::barrier_waiting()
+{
+        return bar_local;
+}
+
+
+void XgridColl::check_barrier()
+{
+        // wait for our own arrival and every child
+        if (!bar_local || bar_sent || (bar_have & children) != children)
+                return;
+        
+        if (parent < 0)
+        {
+                release_barrier();
+                return;
+        }
+        
+        if (send_coll(XGRID_PKT_COLL_UP, 1 << parent, bar_gen, XGRID_COLL_BARRIER, 0,
+                xgrid->get_id(), 0, 0) == XGRID_SEND_NO_BUFFER)
+                return;
+        
+        bar_sent = 1;
+        bar_time = xgrid->get_ticks();
+}
+
+
+void XgridColl::release_barrier()
+{
+        if (children && send_coll(XGRID_PKT_COLL_DOWN, children, bar_gen, XGRID_COLL_BARRIER, 0,
+                root, 0, 0) == XGRID_SEND_NO_BUFFER)
+                return;
+        
+        uint8_t gen = bar_gen;
+        
+        // next generation before the callback so it
+        // can enter the next barrier right away
+        bar_gen++;
+        bar_local = 0;
+        bar_sent = 0;
+        bar_have = 0;
+        
+        deliver(XGRID_COLL_BARRIER, gen, root, 0, 0);
+}
+
+
+void XgridColl::receive_up(uint8_t n, xgrid_pkt_coll_t *c, uint8_t len)
+{
+        if (n == parent)
+                return;
+        
+        // join may have been lost
+        children |= 1 << n;
+        
+        if (c->kind == XGRID_COLL_BARRIER)
+        {
+                // child missed the last release
+                if (c->op == (uint8_t)(bar_gen - 1))
+                        send_coll(XGRID_PKT_COLL_DOWN, 1 << n, c->op, XGRID_COLL_BARRIER, 0, root, 0, 0);
+                
+                if (c->op != bar_gen)
+                        return;
+                
+                bar_have |= 1 << n;
+                check_barrier();
+                return;
+        }
+        
+        // relayed as it arrives
+        if (c->kind == XGRID_COLL_GATHER)
+        {
+                if (parent < 0)
+                        deliver(XGRID_COLL_GATHER, c->op, c->source, c->data, len);
+                else
+                        send_coll(XGRID_PKT_COLL_UP, 1 << parent, c->op, XGRID_COLL_GATHER, 0,
+                                c->source, c->data, len);
+                return;
+        }
+        
+        if (c->kind != XGRID_COLL_REDUCE && c->kind != XGRID_COLL_ALLREDUCE)
+                return;
+        
+        // late partial for an op already passed on
+        if (find_done(c->op) >= 0)
+                return;
+        
+        int8_t i = get_slot(c->op, c->kind, c->func);
+        
+        if (i < 0)
+                return;
+        
+        xgrid_coll_slot_t *s = &(slots[i]);
+        
+        // repeat from this child
+        if (s->have & (1 << n))
+                return;
+        
+        merge(s, c->data, len);
+        s->have |= 1 << n;
+        
+        check_slot(i, 0);
+}
+
+
+void XgridColl::receive_down(uint8_t n, xgrid_pkt_coll_t *c, uint8_t len)
+{
+        if (n != parent)
+                return;
+        
+        // repeats of an old release are dropped
+        if (c->kind == XGRID_COLL_BARRIER)
+        {
+                if (c->op == bar_gen)
+                        release_barrier();
+                return;
+        }
+        
+        if (children)
+                send_coll(XGRID_PKT_COLL_DOWN, children, c->op, c->kind, c->func, c->source, c->data, len);
+        
+        deliver(c->kind, c->op, c->source, c->data, len);
+}
+
+
+void XgridColl::handle_tree(Xgrid::Packet *pkt)
+{
+        if (instance == 0 || pkt->data_len < sizeof(xgrid_pkt_coll_tree_t) || pkt->rx_node >= XGRID_MAX_NODES)
+                return;
+        
+        instance->receive_tree(pkt->rx_node, (xgrid_pkt_coll_tree_t *)(pkt->data));
+}
+
+
+void XgridColl::handle_join(Xgrid::Packet *pkt)
+{
+        if (instance == 0 || pkt->data_len < sizeof(xgrid_pkt_coll_tree_t) || pkt->rx_node >= XGRID_MAX_NODES)
+                return;
+        
+        xgrid_pkt_coll_tree_t *t = (xgrid_pkt_coll_tree_t *)(pkt->data);
+        
+        if (!instance->joined || t->root != instance->root || t->epoch != instance->epoch)
+                return;
+        
+        instance->children |= 1 << pkt->rx_node;
+        instance->tree_time = instance->xgrid->get_ticks();
+}
+
+
+void XgridColl::handle_up(Xgrid::Packet *pkt)
+{
+        if (instance == 0 || pkt->data_len < sizeof(xgrid_pkt_coll_t) || pkt->rx_node >= XGRID_MAX_NODES)
+                return;
+        
+        xgrid_pkt_coll_t *c = (xgrid_pkt_coll_t *)(pkt->data);
+        uint16_t len = pkt->data_len - sizeof(xgrid_pkt_coll_t);
+        
+        if (!instance->joined || c->root != instance->root || c->epoch != instance->epoch || len > XGRID_COLL_DATA_SIZE)
+                return;
+        
+        instance->receive_up(pkt->rx_node, c, len);
+}
+
+
+void XgridColl::handle_down(Xgrid::Packet *pkt)
+{
+        if (instance == 0 || pkt->data_len < sizeof(xgrid_pkt_coll_t) || pkt->rx_node >= XGRID_MAX_NODES)
+                return;
+        
+        xgrid_pkt_coll_t *c = (xgrid_pkt_coll_t *)(pkt->data);
+        uint16_t len = pkt->data_len - sizeof(xgrid_pkt_coll_t);
+        
+        if (!instance->joined || c->root != instance->root || c->epoch != instance->epoch || len > XGRID_COLL_DATA_SIZE)
+                return;
+        
+        instance->receive_down(pkt->rx_node, c, len);
+}
+
+
+uint16_t XgridColl::slot_timeout()
+{
+        uint8_t left = 1;
+        
+        if (depth < XGRID_COLL_MAX_DEPTH)
+                left = XGRID_COLL_MAX_DEPTH - depth;
+        
+        return XGRID_COLL_STEP * left;
+}
+
+
+void XgridColl::process()
+{
+        uint16_t now = xgrid->get_ticks();
+        
+        // finish complete or stale reductions, retry
+        // ones that were out of buffers
+        for (uint8_t i = 0; i < XGRID_COLL_MAX_OPS; i++)
+        {
+                if (slots[i].in_use)
+                        check_slot(i, (uint16_t)(now - slots[i].started) >= slot_timeout());
+        }
+        
+        // resend an arrival that may have been lost
+        if (bar_sent && (uint16_t)(now - bar_time) >= XGRID_COLL_BARRIER_RETRY)
+                bar_sent = 0;
+        
+        check_barrier();
+}
+
+
@@ -0,0 +1,218 @@
+/************************************************************************/
+/* xgrid collectives                                                    */
+/*                                                                      */
+/* xgrid_coll.h                                                         */
+/*                                                                      */
+/* Alex Forencich <alex@alexforencich.com>                              */
+/*                                                                      */
+/* Copyright (c) 2011 Alex Forencich                                    */
+/*                                                                      */
+/* Permission is hereby granted, free of charge, to any person          */
+/* obtaining a copy of this software and associated documentation       */
+/* files(the "Software"), to deal in the Software without restriction,  */
+/* including without limitation the rights to use, copy, modify, merge, */
+/* publish, distribute, sublicense, and/or sell copies of the Software, */
+/* and to permit persons to whom the Software is furnished to do so,    */
+/* subject to the following conditions:                                 */
+/*                                                                      */
+/* The above copyright notice and this permission notice shall be       */
+/* included in all copies or substantial portions of the Software.      */
+/*                                                                      */
+/* THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,      */
+/* EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF   */
+/* MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND                */
+/* NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS  */
+/* BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN   */
+/* ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN    */
+/* CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE     */
+/* SOFTWARE.                                                            */
+/*                                                                      */
+/************************************************************************/
+
+#ifndef __XGRID_COLL_H
+#define __XGRID_COLL_H
+
+#include <avr/io.h>
+
+#include "xgrid.h"
+
+// defines
+#define XGRID_COLL_MAX_FUNCS    4
+#define XGRID_COLL_MAX_OPS      2
+
+// finished reductions remembered per tree so late
+// partials for them are dropped, don't reuse an op
+// until this many others have finished
+#define XGRID_COLL_DONE_CNT     8
+
+// values fit in one small buffer
+#define XGRID_COLL_DATA_SIZE    (XGRID_SM_BUFFER_SIZE - sizeof(xgrid_pkt_coll_t))
+
+// timing in ms
+// joins arriving within the settle time after the
+// tree offer still count, a reduction missing a child
+// passes on what it has after one step per level left
+// below it up to the max depth, so every node gives up
+// a step before its parent does
+#define XGRID_COLL_SETTLE       100
+#define XGRID_COLL_STEP         100
+#define XGRID_COLL_MAX_DEPTH    16
+
+// barrier arrival not released within this time in
+// ms is sent again, a barrier never times out
+#define XGRID_COLL_BARRIER_RETRY 200
+
+// call status
+#define XGRID_COLL_OK           0x00
+#define XGRID_COLL_NO_TREE      0x01
+#define XGRID_COLL_BUSY         0x02
+#define XGRID_COLL_NOT_ROOT     0x03
+#define XGRID_COLL_ERROR        0x04
+
+// XgridColl class
+class XgridColl
+{
+public:
+        // typedefs
+        
+        // folds in into acc, both len bytes
+        typedef void (*Combine)(uint8_t *acc, const uint8_t *in, uint8_t len);
+        
+        // kind is one of XGRID_COLL_*, source is the
+        // contributing node for gather, the root otherwise
+        typedef void (*Result)(uint8_t kind, uint8_t op, uint16_t source, const uint8_t *data, uint8_t len);
+
+private:
+        // Private typedefs
+        typedef struct
+        {
+                uint8_t id;
+                Combine func;
+        } xgrid_coll_func_t;
+        
+        typedef struct
+        {
+                uint8_t in_use;
+                uint8_t op;
+                uint8_t kind;
+                uint8_t func;
+                uint8_t local;
+                uint16_t have;
+                uint16_t started;
+                uint8_t len;
+                uint8_t acc[XGRID_COLL_DATA_SIZE];
+        } xgrid_coll_slot_t;
+        
+        // Per object data
+        Xgrid *xgrid;
+        
+        xgrid_coll_func_t funcs[XGRID_COLL_MAX_FUNCS];
+        uint8_t func_cnt;
+        
+        // spanning tree
+        uint16_t root;
+        uint8_t epoch;
+        uint8_t depth;
+        uint8_t joined;
+        int8_t parent;
+        uint16_t children;
+        uint16_t tree_time;
+        
+        // reductions in progress
+        xgrid_coll_slot_t slots[XGRID_COLL_MAX_OPS];
+        
+        // recently finished reductions
+        uint8_t done_ops[XGRID_COLL_DONE_CNT];
+        uint8_t done_cnt;
+        
+        // barrier, generation counts releases
+        // since the tree was built
+        uint8_t bar_gen;
+        uint8_t bar_local;
+        uint8_t bar_sent;
+        uint16_t bar_have;
+        uint16_t bar_time;
+        
+        // Static data
+        static XgridColl *instance;
+        
+        // Private methods
+        void reset_ops();
+        int8_t find_func(uint8_t id);
+        int8_t get_slot(uint8_t op, uint8_t kind, uint8_t func);
+        int8_t find_done(uint8_t op);
+        void set_done(uint8_t op);
+        void clear_done(int8_t d);
+        void merge(xgrid_coll_slot_t *s, const uint8_t *data, uint8_t len);
+        uint16_t slot_timeout();
+        void check_slot(int8_t i, uint8_t force);
+        void deliver(uint8_t kind, uint8_t op, uint16_t source, const uint8_t *data, uint8_t len);
+        
+        uint8_t send_coll(uint8_t type, uint16_t mask, uint8_t op, uint8_t kind, uint8_t func,
+                uint16_t source, const uint8_t *data, uint8_t len);
+        void send_tree(uint16_t mask);
+        uint8_t contribute(uint8_t op, uint8_t kind, uint8_t func, const uint8_t *data, uint8_t len);
+        
+        void check_barrier();
+        void release_barrier();
+        
+        void receive_tree(uint8_t n, xgrid_pkt_coll_tree_t *t);
+        void receive_up(uint8_t n, xgrid_pkt_coll_t *c, uint8_t len);
+        void receive_down(uint8_t n, xgrid_pkt_coll_t *c, uint8_t len);
+        
+        // Private static methods
+        static void handle_tree(Xgrid::Packet *pkt);
+        static void handle_join(Xgrid::Packet *pkt);
+        static void handle_up(Xgrid::Packet *pkt);
+        static void handle_down(Xgrid::Packet *pkt);
+
+public:
+        // Public variables
+        
+        // result callback
+        // called from dispatch(), data valid until it returns
+        Result rx_result;
+        
+        // Public methods
+        XgridColl(Xgrid *_xgrid);
+        ~XgridColl();
+        
+        void begin();
+        
+        int8_t register_func(uint8_t id, Combine func);
+        
+        // make this node the root of a new tree
+        void build_tree();
+        uint8_t tree_ready();
+        uint8_t is_root();
+        uint16_t get_root();
+        
+        // parent port, -1 on the root or without a tree
+        int8_t get_parent();
+        
+        // every node calls these with the same op, reduce
+        // results go to the root, allreduce results to all
+        uint8_t reduce(uint8_t op, uint8_t func, const uint8_t *data, uint8_t len);
+        uint8_t allreduce(uint8_t op, uint8_t func, const uint8_t *data, uint8_t len);
+        
+        // root only, delivered on every node
+        uint8_t broadcast(uint8_t op, const uint8_t *data, uint8_t len);
+        
+        // each contribution is passed up as it arrives
+        // and delivered on the root, one packet per node
+        // per level, so it costs N times the depth
+        uint8_t gather(uint8_t op, const uint8_t *data, uint8_t len);
+        
+        // enter the barrier for the current generation,
+        // released once every node in the tree entered,
+        // also reported to rx_result with op as generation
+        uint8_t barrier();
+        uint8_t barrier_waiting();
+        
+        void process();
+};
+
+// Prototypes
+
+
+#endif // __XGRID_COLL_H
@@ -0,0 +1,777 @@
+/************************************************************************/
+/* xgrid jobs                                                           */
+/*                                                                      */
+/* xgrid_jobs.cpp                                                       */
+/*                                                                      */
+/* Alex Forencich <alex@alexforencich.com>                              */
+/*                                                                      */
+/* Copyright (c) 2011 Alex Forencich                                    */
+/*                                                                      */
+/* Permission is hereby granted, free of charge, to any person          */
+/* obtaining a copy of this software and associated documentation       */
+/* files(the "Software"), to deal in the Software without restriction,  */
+/* including without limitation the rights to use, copy, modify, merge, */
+/* publish, distribute, sublicense, and/or sell copies of the Software, */
+/* and to permit persons to whom the Software is furnished to do so,    */
+/* subject to the following conditions:                                 */
+/*                                                                      */
+/* The above copyright notice and this permission notice shall be       */
+/* included in all copies or substantial portions of the Software.      */
+/*                                                                      */
+/* THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,      */
+/* EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF   */
+/* MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND                */
+/* NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS  */
+/* BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN   */
+/* ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN    */
+/* CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE     */
+/* SOFTWARE.                                                            */
+/*                                                                      */
+/************************************************************************/
+
+#include "xgrid_jobs.h"
+
+#include <string.h>
+
+// Statics
+XgridJobs *XgridJobs::instance = 0;
+
+
+XgridJobs::XgridJobs(Xgrid *_xgrid) :
+        xgrid(_xgrid),
+        kernel_cnt(0),
+        steal_time(0),
+        active(0),
+        worker_cnt(0),
+        retry_cnt(0),
+        rate(0)
+{
+        memset(run_queue, 0, sizeof(run_queue));
+        memset(hint, 0, sizeof(hint));
+        memset(hint_time, 0, sizeof(hint_time));
+        memset(slots, 0, sizeof(slots));
+}
+
+
+XgridJobs::~XgridJobs()
+{
+        
+}
+
+
+void XgridJobs::begin()
+{
+        instance = this;
+        
+        xgrid->register_handler(XGRID_PKT_JOB_ITEM, XGRID_PORT_ANY, &handle_item);
+        xgrid->register_handler(XGRID_PKT_JOB_RESULT, XGRID_PORT_ANY, &handle_result);
+        xgrid->register_handler(XGRID_PKT_JOB_STEAL, XGRID_PORT_ANY, &handle_steal);
+        xgrid->register_handler(XGRID_PKT_JOB_HANDOFF, XGRID_PORT_ANY, &handle_handoff);
+}
+
+
+int8_t XgridJobs::register_kernel(uint8_t id, Kernel func)
+{
+        int8_t k = find_kernel(id);
+        
+        // replace existing
+        if (k >= 0)
+        {
+                kernels[k].func = func;
+                return k;
+        }
+        
+        if (kernel_cnt >= XGRID_JOBS_MAX_KERNELS)
+                return -1;
+        
+        kernels[kernel_cnt].id = id;
+        kernels[kernel_cnt].func = func;
+        
+        return kernel_cnt++;
+}
+
+
+int8_t XgridJobs::find_kernel(uint8_t id)
+{
+        for (uint8_t k = 0; k < kernel_cnt; k++)
+        {
+                if (kernels[k].id == id)
+                        return k;
+        }
+        
+        return -1;
+}
+
+
+uint8_t XgridJobs::queue_item(uint16_t coordinator, uint16_t job, uint16_t item, uint8_t k, const uint8_t *data, uint16_t len)
+{
+        int8_t free_entry = -1;
+        
+        if (find_kernel(k) < 0)
+                return XGRID_JOB_STATUS_NO_KERNEL;
+        
+        if (len > XGRID_JOBS_DATA_SIZE)
+                return XGRID_JOB_STATUS_ERROR;
+        
+        for (uint8_t i = 0; i < XGRID_JOBS_QUEUE_SIZE; i++)
+        {
+                xgrid_jobs_entry_t *e = &(run_queue[i]);
+                
+                if (!e->in_use)
+                {
+                        if (free_entry < 0)
+                                free_entry = i;
+                        continue;
+                }
+                
+                // resent while still queued
+                if (e->coordinator == coordinator && e->job_id == job && e->item_id == item)
+                        return XGRID_JOB_STATUS_OK;
+        }
+        
+        if (free_entry < 0)
+                return XGRID_JOB_STATUS_BUSY;
+        
+        xgrid_jobs_entry_t *e = &(run_queue[free_entry]);
+        
+        e->in_use = 1;
+        e->coordinator = coordinator;
+        e->job_id = job;
+        e->item_id = item;
+        e->kernel = k;
+        e->len = len;
+        memcpy(e->data, data, len);
+        
+        return XGRID_JOB_STATUS_OK;
+}
+
+
+uint8_t XgridJobs::send_result(uint16_t dest, uint16_t job, uint16_t item, uint8_t status, const uint8_t *data, uint16_t len)
+{
+        xgrid_pkt_job_result_t r;
+        
+        r.job_id = job;
+        r.item_id = item;
+        r.status = status;
+        
+        // coordinator is this node
+        if (dest == xgrid->get_id())
+        {
+                uint8_t buffer[sizeof(xgrid_pkt_job_result_t) + XGRID_JOBS_DATA_SIZE];
+                
+                memcpy(buffer, &r, sizeof(xgrid_pkt_job_result_t));
+                memcpy(buffer + sizeof(xgrid_pkt_job_result_t), data, len);
+                receive_result(dest, buffer, sizeof(xgrid_pkt_job_result_t) + len);
+                
+                return XGRID_SEND_OK;
+        }
+        
+        Xgrid::Packet pkt;
+        
+        pkt.type = XGRID_PKT_JOB_RESULT;
+        pkt.flags = XGRID_PKT_FLAG_UNICAST;
+        pkt.radius = XGRID_JOBS_RADIUS;
+        pkt.dest_id = dest;
+        pkt.data = (uint8_t *)data;
+        pkt.data_len = len;
+        
+        return xgrid->send_packet_gather(&pkt, (uint8_t *)&r, sizeof(xgrid_pkt_job_result_t));
+}
+
+
+void XgridJobs::run_items()
+{
+        uint8_t out[XGRID_JOBS_DATA_SIZE];
+        
+        for (uint8_t i = 0; i < XGRID_JOBS_QUEUE_SIZE; i++)
+        {
+                xgrid_jobs_entry_t *e = &(run_queue[i]);
+                uint16_t out_len = 0;
+                
+                if (!e->in_use)
+                        continue;
+                
+                int8_t k = find_kernel(e->kernel);
+                uint8_t status = XGRID_JOB_STATUS_NO_KERNEL;
+                
+                if (k >= 0)
+                        status = (*kernels[k].func)(e->data, e->len, out, &out_len);
+                
+                if (out_len > XGRID_JOBS_DATA_SIZE)
+                        out_len = XGRID_JOBS_DATA_SIZE;
+                
+                // out of buffers, run it again later
+                if (send_result(e->coordinator, e->job_id, e->item_id, status, out, out_len) == XGRID_SEND_NO_BUFFER)
+                        return;
+                
+                e->in_use = 0;
+                
+                // one item per pass keeps the main loop responsive
+                return;
+        }
+}
+
+
+void XgridJobs::handle_item(Xgrid::Packet *pkt)
+{
+        if (instance == 0 || pkt->data_len < sizeof(xgrid_pkt_job_item_t))
+                return;
+        
+        xgrid_pkt_job_item_t *item = (xgrid_pkt_job_item_t *)(pkt->data);
+        uint8_t status = instance->queue_item(pkt->source_id, item->job_id, item->item_id, item->kernel,
+                item->data, pkt->data_len - sizeof(xgrid_pkt_job_item_t));
+        
+        // accepted items are answered when they run
+        if (status != XGRID_JOB_STATUS_OK)
+                instance->send_result(pkt->source_id, item->job_id, item->item_id, status, 0, 0);
+}
+
+
+void XgridJobs::handle_result(Xgrid::Packet *pkt)
+{
+        if (instance == 0)
+                return;
+        
+        instance->receive_result(pkt->source_id, pkt->data, pkt->data_len);
+}
+
+
+uint8_t XgridJobs::queue_len()
+{
+        uint8_t cnt = 0;
+        
+        for (uint8_t i = 0; i < XGRID_JOBS_QUEUE_SIZE; i++)
+        {
+                if (run_queue[i].in_use)
+                        cnt++;
+        }
+        
+        return cnt;
+}
+
+
+void XgridJobs::set_hint(uint8_t n, uint8_t load)
+{
+        if (n >= XGRID_MAX_NODES)
+                return;
+        
+        hint[n] = load;
+        hint_time[n] = xgrid->get_ticks();
+}
+
+
+void XgridJobs::try_steal()
+{
+        uint16_t now = xgrid->get_ticks();
+        int8_t victim = -1;
+        uint8_t most = 1;
+        
+        if (queue_len() > 0 || (uint16_t)(now - steal_time) < XGRID_JOBS_STEAL_INTERVAL)
+                return;
+        
+        steal_time = now;
+        
+        // most loaded neighbor with work to spare
+        for (uint8_t n = 0; n < XGRID_MAX_NODES; n++)
+        {
+                uint16_t id;
+                uint8_t load;
+                
+                if (!xgrid->get_neighbor(n, &id, &load))
+                        continue;
+                
+                if ((uint16_t)(now - hint_time[n]) < XGRID_JOBS_HINT_AGE)
+                        load = hint[n];
+                
+                if (load > most)
+                {
+                        most = load;
+                        victim = n;
+                }
+        }
+        
+        if (victim < 0)
+                return;
+        
+        xgrid_pkt_job_steal_t s;
+        Xgrid::Packet pkt;
+        
+        s.load = 0;
+        s.want = XGRID_JOBS_QUEUE_SIZE / 2;
+        
+        pkt.type = XGRID_PKT_JOB_STEAL;
+        pkt.flags = 0;
+        pkt.radius = 1;
+        pkt.data = (uint8_t *)&s;
+        pkt.data_len = sizeof(xgrid_pkt_job_steal_t);
+        
+        xgrid->send_packet(&pkt, 1 << victim);
+        
+        // don't ask again until we hear back
+        set_hint(victim, 0);
+}
+
+
+void XgridJobs::give_work(uint8_t n, uint8_t want)
+{
+        uint8_t cnt = queue_len();
+        uint8_t give = cnt / 2;
+        uint8_t sent = 0;
+        
+        if (give > want)
+                give = want;
+        
+        // newest items go, the next to run stays
+        for (int8_t i = XGRID_JOBS_QUEUE_SIZE - 1; i >= 0 && give > 0; i--)
+        {
+                xgrid_jobs_entry_t *e = &(run_queue[i]);
+                xgrid_pkt_job_handoff_t h;
+                Xgrid::Packet pkt;
+                
+                if (!e->in_use)
+                        continue;
+                
+                h.coordinator = e->coordinator;
+                h.load = cnt - give;
+                h.item.job_id = e->job_id;
+                h.item.item_id = e->item_id;
+                h.item.kernel = e->kernel;
+                
+                pkt.type = XGRID_PKT_JOB_HANDOFF;
+                pkt.flags = 0;
+                pkt.radius = 1;
+                pkt.data = e->data;
+                pkt.data_len = e->len;
+                
+                uint8_t ret = xgrid->send_packet_gather(&pkt, (uint8_t *)&h, sizeof(xgrid_pkt_job_handoff_t), 1 << n);
+                
+                if (ret != XGRID_SEND_OK && ret != XGRID_SEND_CONGESTED)
+                        break;
+                
+                e->in_use = 0;
+                cnt--;
+                give--;
+                sent++;
+        }
+        
+        // nothing handed over, just tell it how busy we are
+        if (sent == 0)
+        {
+                xgrid_pkt_job_steal_t s;
+                Xgrid::Packet pkt;
+                
+                s.load = cnt;
+                s.want = 0;
+                
+                pkt.type = XGRID_PKT_JOB_STEAL;
+                pkt.flags = 0;
+                pkt.radius = 1;
+                pkt.data = (uint8_t *)&s;
+                pkt.data_len = sizeof(xgrid_pkt_job_steal_t);
+                
+                xgrid->send_packet(&pkt, 1 << n);
+        }
+}
+
+
+void XgridJobs::handle_steal(Xgrid::Packet *pkt)
+{
+        if (instance == 0 || pkt->data_len < sizeof(xgrid_pkt_job_steal_t))
+                return;
+        
+        xgrid_pkt_job_steal_t *s = (xgrid_pkt_job_steal_t *)(pkt->data);
+        
+        instance->set_hint(pkt->rx_node, s->load);
+        
+        if (s->want > 0 && pkt->rx_node < XGRID_MAX_NODES)
+                instance->give_work(pkt->rx_node, s->want);
+}
+
+
+void XgridJobs::handle_handoff(Xgrid::Packet *pkt)
+{
+        if (instance == 0 || pkt->data_len < sizeof(xgrid_pkt_job_handoff_t))
+                return;
+        
+        xgrid_pkt_job_handoff_t *h = (xgrid_pkt_job_handoff_t *)(pkt->data);
+        
+        instance->set_hint(pkt->rx_node, h->load);
+        
+        uint8_t status = instance->queue_item(h->coordinator, h->item.job_id, h->item.item_id, h->item.kernel,
+                h->item.data, pkt->data_len - sizeof(xgrid_pkt_job_handoff_t));
+        
+        // can't take it after all, coordinator reassigns
+        if (status != XGRID_JOB_STATUS_OK)
+                instance->send_result(h->coordinator, h->item.job_id, h->item.item_id, status, 0, 0);
+}
+
+
+int8_t XgridJobs::add_worker(uint16_t id)
+{
+        for (uint8_t w = 0; w < worker_cnt; w++)
+        {
+                if (workers[w].id == id)
+                        return w;
+        }
+        
+        if (worker_cnt >= XGRID_JOBS_MAX_WORKERS)
+                return -1;
+        
+        workers[worker_cnt].id = id;
+        workers[worker_cnt].outstanding = 0;
+        workers[worker_cnt].misses = 0;
+        workers[worker_cnt].backoff = 0;
+        
+        return worker_cnt++;
+}
+
+
+uint8_t XgridJobs::start_job(uint16_t id, uint8_t k, uint16_t cnt, GetItem get, PutResult put)
+{
+        if (active || cnt > XGRID_JOBS_MAX_ITEMS || get == 0)
+                return 0;
+        
+        job_id = id;
+        kernel = k;
+        item_cnt = cnt;
+        next_item = 0;
+        done = 0;
+        reassigned = 0;
+        get_item = get;
+        put_result = put;
+        
+        memset(done_map, 0, sizeof(done_map));
+        memset(slots, 0, sizeof(slots));
+        retry_cnt = 0;
+        
+        for (uint8_t w = 0; w < worker_cnt; w++)
+        {
+                workers[w].outstanding = 0;
+                workers[w].misses = 0;
+                workers[w].backoff = 0;
+        }
+        
+        report_time = xgrid->get_ticks();
+        report_done = 0;
+        rate = 0;
+        
+        active = 1;
+        
+        return 1;
+}
+
+
+void XgridJobs::cancel_job()
+{
+        active = 0;
+}
+
+
+uint8_t XgridJobs::job_active()
+{
+        return active;
+}
+
+
+uint16_t XgridJobs::get_rate()
+{
+        return rate;
+}
+
+
+uint8_t XgridJobs::is_done(uint16_t item)
+{
+        return (done_map[item >> 3] & (1 << (item & 7))) != 0;
+}
+
+
+// least loaded worker with room, or -1
+int8_t XgridJobs::pick_worker()
+{
+        uint16_t now = xgrid->get_ticks();
+        int8_t best = -1;
+        
+        for (uint8_t w = 0; w < worker_cnt; w++)
+        {
+                xgrid_jobs_worker_t *wk = &(workers[w]);
+                
+                if (wk->outstanding >= XGRID_JOBS_WINDOW)
+                        continue;
+                
+                if ((int16_t)(now - wk->backoff) < 0)
+                        continue;
+                
+                // dropped worker is due another try, one
+                // more miss drops it again
+                if (wk->misses >= XGRID_JOBS_MAX_MISSES)
+                        wk->misses = XGRID_JOBS_MAX_MISSES - 1;
+                
+                if (best < 0 || wk->outstanding < workers[best].outstanding)
+                        best = w;
+        }
+        
+        return best;
+}
+
+
+// drop forces the worker out, for ones that can't run the kernel
+void XgridJobs::add_miss(uint8_t w, uint8_t drop)
+{
+        xgrid_jobs_worker_t *wk = &(workers[w]);
+        
+        if (drop || ++wk->misses >= XGRID_JOBS_MAX_MISSES)
+        {
+                wk->misses = XGRID_JOBS_MAX_MISSES;
+                wk->backoff = xgrid->get_ticks() + XGRID_JOBS_REVIVE_TIME;
+        }
+}
+
+
+void XgridJobs::release_slot(uint8_t s)
+{
+        workers[slots[s].worker].outstanding--;
+        slots[s].in_use = 0;
+}
+
+
+void XgridJobs::send_items()
+{
+        uint8_t buffer[XGRID_JOBS_DATA_SIZE];
+        
+        for (uint8_t s = 0; s < XGRID_JOBS_SLOT_CNT; s++)
+        {
+                if (slots[s].in_use)
+                        continue;
+                
+                int8_t w = pick_worker();
+                
+                if (w < 0)
+                        return;
+                
+                // lost items first, then new ones
+                uint16_t item = 0xFFFF;
+                
+                while (retry_cnt > 0 && item == 0xFFFF)
+                {
+                        item = retry[--retry_cnt];
+                        
+                        if (is_done(item))
+                                item = 0xFFFF;
+                }
+                
+                while (item == 0xFFFF && next_item < item_cnt)
+                {
+                        if (!is_done(next_item))
+                                item = next_item;
+                        next_item++;
+                }
+                
+                if (item == 0xFFFF)
+                        return;
+                
+                uint16_t len = XGRID_JOBS_DATA_SIZE;
+                
+                if (!(*get_item)(item, buffer, &len))
+                {
+                        // nothing to send, count it as done
+                        done_map[item >> 3] |= 1 << (item & 7);
+                        done++;
+                        continue;
+                }
+                
+                uint8_t ret;
+                
+                if (workers[w].id == xgrid->get_id())
+                {
+                        // local worker
+                        uint8_t status = queue_item(workers[w].id, job_id, item, kernel, buffer, len);
+                        
+                        ret = XGRID_SEND_OK;
+                        
+                        if (status != XGRID_JOB_STATUS_OK)
+                        {
+                                ret = XGRID_SEND_NO_BUFFER;
+                                workers[w].backoff = xgrid->get_ticks() + XGRID_JOBS_BUSY_BACKOFF;
+                                
+                                if (status != XGRID_JOB_STATUS_BUSY)
+                                        add_miss(w, 1);
+                        }
+                }
+                else
+                {
+                        xgrid_pkt_job_item_t hdr;
+                        Xgrid::Packet pkt;
+                        
+                        hdr.job_id = job_id;
+                        hdr.item_id = item;
+                        hdr.kernel = kernel;
+                        
+                        pkt.type = XGRID_PKT_JOB_ITEM;
+                        pkt.flags = XGRID_PKT_FLAG_UNICAST;
+                        pkt.radius = XGRID_JOBS_RADIUS;
+                        pkt.dest_id = workers[w].id;
+                        pkt.data = buffer;
+                        pkt.data_len = len;
+                        
+                        ret = xgrid->send_packet_gather(&pkt, (uint8_t *)&hdr, sizeof(xgrid_pkt_job_item_t));
+                        
+                        if (ret == XGRID_SEND_NO_ROUTE)
+                                add_miss(w, 0);
+                }
+                
+                // congested still went out
+                if (ret != XGRID_SEND_OK && ret != XGRID_SEND_CONGESTED)
+                {
+                        retry[retry_cnt++] = item;
+                        return;
+                }
+                
+                slots[s].in_use = 1;
+                slots[s].worker = w;
+                slots[s].item_id = item;
+                slots[s].sent = xgrid->get_ticks();
+                workers[w].outstanding++;
+                
+                // back off the rest of the grid too
+                if (ret == XGRID_SEND_CONGESTED)
+                        return;
+        }
+}
+
+
+void XgridJobs::check_timeouts()
+{
+        uint16_t now = xgrid->get_ticks();
+        
+        for (uint8_t s = 0; s < XGRID_JOBS_SLOT_CNT; s++)
+        {
+                if (!slots[s].in_use || (uint16_t)(now - slots[s].sent) < XGRID_JOBS_ITEM_TIMEOUT)
+                        continue;
+                
+                // lost, give it to someone else
+                add_miss(slots[s].worker, 0);
+                retry[retry_cnt++] = slots[s].item_id;
+                reassigned++;
+                release_slot(s);
+        }
+}
+
+
+void XgridJobs::receive_result(uint16_t source, const uint8_t *data, uint16_t len)
+{
+        if (!active || len < sizeof(xgrid_pkt_job_result_t))
+                return;
+        
+        xgrid_pkt_job_result_t *r = (xgrid_pkt_job_result_t *)data;
+        
+        if (r->job_id != job_id || r->item_id >= item_cnt)
+                return;
+        
+        // free the slot, the answer may come from
+        // a neighbor that stole the item
+        for (uint8_t s = 0; s < XGRID_JOBS_SLOT_CNT; s++)
+        {
+                if (slots[s].in_use && slots[s].item_id == r->item_id)
+                {
+                        xgrid_jobs_worker_t *wk = &(workers[slots[s].worker]);
+                        
+                        wk->misses = 0;
+                        release_slot(s);
+                        
+                        if (r->status == XGRID_JOB_STATUS_BUSY || r->status == XGRID_JOB_STATUS_NO_KERNEL)
+                        {
+                                // try elsewhere
+                                if (wk->id == source)
+                                {
+                                        wk->backoff = xgrid->get_ticks() + XGRID_JOBS_BUSY_BACKOFF;
+                                        if (r->status == XGRID_JOB_STATUS_NO_KERNEL)
+                                                add_miss(slots[s].worker, 1);
+                                }
+                                
+                                retry[retry_cnt++] = r->item_id;
+                                reassigned++;
+                                return;
+                        }
+                        
+                        break;
+                }
+        }
+        
+        if (r->status == XGRID_JOB_STATUS_BUSY || r->status == XGRID_JOB_STATUS_NO_KERNEL)
+                return;
+        
+        // late answers for reassigned items still count once
+        if (is_done(r->item_id))
+                return;
+        
+        done_map[r->item_id >> 3] |= 1 << (r->item_id & 7);
+        done++;
+        
+        if (put_result)
+                (*put_result)(r->item_id, r->status, r->data, len - sizeof(xgrid_pkt_job_result_t));
+}
+
+
+void XgridJobs::send_report()
+{
+        xgrid_pkt_job_report_t r;
+        Xgrid::Packet pkt;
+        uint16_t now = xgrid->get_ticks();
+        uint16_t elapsed = now - report_time;
+        
+        if (elapsed > 0)
+                rate = (uint32_t)(done - report_done) * 1000 / elapsed;
+        
+        report_time = now;
+        report_done = done;
+        
+        r.job_id = job_id;
+        r.items = item_cnt;
+        r.done = done;
+        r.reassigned = reassigned;
+        r.rate = rate;
+        r.workers = 0;
+        
+        for (uint8_t w = 0; w < worker_cnt; w++)
+        {
+                if (workers[w].misses < XGRID_JOBS_MAX_MISSES)
+                        r.workers++;
+        }
+        
+        pkt.type = XGRID_PKT_JOB_REPORT;
+        pkt.flags = 0;
+        pkt.radius = XGRID_JOBS_RADIUS;
+        pkt.data = (uint8_t *)&r;
+        pkt.data_len = sizeof(xgrid_pkt_job_report_t);
+        
+        xgrid->send_packet(&pkt);
+}
+
+
+void XgridJobs::process()
+{
+        // worker
+        run_items();
+        try_steal();
+        
+        xgrid->load = queue_len();
+        
+        // coordinator
+        if (!active)
+                return;
+        
+        check_timeouts();
+        send_items();
+        
+        if (done >= item_cnt)
+        {
+                send_report();
+                active = 0;
+        }
+        else if ((uint16_t)(xgrid->get_ticks() - report_time) >= XGRID_JOBS_REPORT_INTERVAL)
+        {
+                send_report();
+        }
+}
+
+
@@ -0,0 +1,212 @@
+/************************************************************************/
+/* xgrid jobs                                                           */
+/*                                                                      */
+/* xgrid_jobs.h                                                         */
+/*                                                                      */
+/* Alex Forencich <alex@alexforencich.com>                              */
+/*                                                                      */
+/* Copyright (c) 2011 Alex Forencich                                    */
+/*                                                                      */
+/* Permission is hereby granted, free of charge, to any person          */
+/* obtaining a copy of this software and associated documentation       */
+/* files(the "Software"), to deal in the Software without restriction,  */
+/* including without limitation the rights to use, copy, modify, merge, */
+/* publish, distribute, sublicense, and/or sell copies of the Software, */
+/* and to permit persons to whom the Software is furnished to do so,    */
+/* subject to the following conditions:                                 */
+/*                                                                      */
+/* The above copyright notice and this permission notice shall be       */
+/* included in all copies or substantial portions of the Software.      */
+/*                                                                      */
+/* THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,      */
+/* EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF   */
+/* MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND                */
+/* NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS  */
+/* BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN   */
+/* ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN    */
+/* CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE     */
+/* SOFTWARE.                                                            */
+/*                                                                      */
+/************************************************************************/
+
+#ifndef __XGRID_JOBS_H
+#define __XGRID_JOBS_H
+
+#include <avr/io.h>
+
+#include "xgrid.h"
+
+// defines
+#define XGRID_JOBS_MAX_KERNELS  8
+#define XGRID_JOBS_QUEUE_SIZE   4
+#define XGRID_JOBS_MAX_WORKERS  8
+#define XGRID_JOBS_MAX_ITEMS    1024
+#define XGRID_JOBS_RADIUS       16
+
+// item and result data fit in one small buffer, the
+// handoff header is bigger than unicast plus item header
+#define XGRID_JOBS_DATA_SIZE    (XGRID_SM_BUFFER_SIZE - sizeof(xgrid_pkt_job_handoff_t))
+
+// items in flight per worker
+#define XGRID_JOBS_WINDOW       2
+#define XGRID_JOBS_SLOT_CNT     (XGRID_JOBS_MAX_WORKERS * XGRID_JOBS_WINDOW)
+
+// coordinator timing in ms
+// unanswered items go to another worker after the
+// timeout, a busy worker is skipped for the backoff,
+// one that misses too many in a row is dropped and
+// gets one more item once the revive time is up
+#define XGRID_JOBS_ITEM_TIMEOUT 1000
+#define XGRID_JOBS_BUSY_BACKOFF 50
+#define XGRID_JOBS_MAX_MISSES   3
+#define XGRID_JOBS_REVIVE_TIME  5000
+#define XGRID_JOBS_REPORT_INTERVAL 1000
+
+// work stealing timing in ms
+// an idle node asks at most once per interval, queue
+// lengths heard in job packets beat the hello hint
+// until they age out
+#define XGRID_JOBS_STEAL_INTERVAL 20
+#define XGRID_JOBS_HINT_AGE     500
+
+// XgridJobs class
+class XgridJobs
+{
+public:
+        // typedefs
+        
+        // runs one work item, output at most
+        // XGRID_JOBS_DATA_SIZE, returns a job status
+        typedef uint8_t (*Kernel)(const uint8_t *in, uint16_t in_len, uint8_t *out, uint16_t *out_len);
+        
+        // coordinator callbacks, get_item fills in
+        // item data and returns 0 if there is none
+        typedef uint8_t (*GetItem)(uint16_t item, uint8_t *data, uint16_t *len);
+        typedef void (*PutResult)(uint16_t item, uint8_t status, const uint8_t *data, uint16_t len);
+
+private:
+        // Private typedefs
+        typedef struct
+        {
+                uint8_t id;
+                Kernel func;
+        } xgrid_jobs_kernel_t;
+        
+        typedef struct
+        {
+                uint8_t in_use;
+                uint16_t coordinator;
+                uint16_t job_id;
+                uint16_t item_id;
+                uint8_t kernel;
+                uint8_t len;
+                uint8_t data[XGRID_JOBS_DATA_SIZE];
+        } xgrid_jobs_entry_t;
+        
+        typedef struct
+        {
+                uint16_t id;
+                uint8_t outstanding;
+                uint8_t misses;
+                uint16_t backoff;
+        } xgrid_jobs_worker_t;
+        
+        typedef struct
+        {
+                uint8_t in_use;
+                uint8_t worker;
+                uint16_t item_id;
+                uint16_t sent;
+        } xgrid_jobs_slot_t;
+        
+        // Per object data
+        Xgrid *xgrid;
+        
+        // worker
+        xgrid_jobs_kernel_t kernels[XGRID_JOBS_MAX_KERNELS];
+        uint8_t kernel_cnt;
+        xgrid_jobs_entry_t run_queue[XGRID_JOBS_QUEUE_SIZE];
+        
+        // work stealing
+        uint8_t hint[XGRID_MAX_NODES];
+        uint16_t hint_time[XGRID_MAX_NODES];
+        uint16_t steal_time;
+        
+        // coordinator
+        uint8_t active;
+        uint16_t job_id;
+        uint8_t kernel;
+        uint16_t item_cnt;
+        uint16_t next_item;
+        uint16_t done;
+        uint16_t reassigned;
+        uint8_t done_map[XGRID_JOBS_MAX_ITEMS / 8];
+        GetItem get_item;
+        PutResult put_result;
+        
+        xgrid_jobs_worker_t workers[XGRID_JOBS_MAX_WORKERS];
+        uint8_t worker_cnt;
+        xgrid_jobs_slot_t slots[XGRID_JOBS_SLOT_CNT];
+        uint16_t retry[XGRID_JOBS_SLOT_CNT];
+        uint8_t retry_cnt;
+        
+        uint16_t report_time;
+        uint16_t report_done;
+        uint16_t rate;
+        
+        // Static data
+        static XgridJobs *instance;
+        
+        // Private methods
+        int8_t find_kernel(uint8_t id);
+        uint8_t queue_item(uint16_t coordinator, uint16_t job, uint16_t item, uint8_t k, const uint8_t *data, uint16_t len);
+        uint8_t send_result(uint16_t dest, uint16_t job, uint16_t item, uint8_t status, const uint8_t *data, uint16_t len);
+        void run_items();
+        
+        uint8_t queue_len();
+        void set_hint(uint8_t n, uint8_t load);
+        void try_steal();
+        void give_work(uint8_t n, uint8_t want);
+        
+        uint8_t is_done(uint16_t item);
+        int8_t pick_worker();
+        void add_miss(uint8_t w, uint8_t drop);
+        void release_slot(uint8_t s);
+        void send_items();
+        void check_timeouts();
+        void send_report();
+        void receive_result(uint16_t source, const uint8_t *data, uint16_t len);
+        
+        // Private static methods
+        static void handle_item(Xgrid::Packet *pkt);
+        static void handle_result(Xgrid::Packet *pkt);
+        static void handle_steal(Xgrid::Packet *pkt);
+        static void handle_handoff(Xgrid::Packet *pkt);
+
+public:
+        // Public variables
+        
+        // Public methods
+        XgridJobs(Xgrid *_xgrid);
+        ~XgridJobs();
+        
+        void begin();
+        
+        // worker
+        int8_t register_kernel(uint8_t id, Kernel func);
+        
+        // coordinator
+        int8_t add_worker(uint16_t id);
+        uint8_t start_job(uint16_t id, uint8_t k, uint16_t cnt, GetItem get, PutResult put);
+        void cancel_job();
+        uint8_t job_active();
+        uint16_t get_rate();
+        
+        // run queued items and coordinate, call from main loop
+        void process();
+};
+
+// Prototypes
+
+
+#endif // __XGRID_JOBS_H
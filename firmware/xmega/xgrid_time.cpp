@@ -0,0 +1,374 @@
+/************************************************************************/
+/* xgrid time sync                                                      */
+/*                                                                      */
+/* xgrid_time.cpp                                                       */
+/*                                                                      */
+/* Alex Forencich <alex@alexforencich.com>                              */
+/*                                                                      */
+/* Copyright (c) 2011 Alex Forencich                                    */
+/*                                                                      */
+/* Permission is hereby granted, free of charge, to any person          */
+/* obtaining a copy of this software and associated documentation       */
+/* files(the "Software"), to deal in the Software without restriction,  */
+/* including without limitation the rights to use, copy, modify, merge, */
+/* publish, distribute, sublicense, and/or sell copies of the Software, */
+/* and to permit persons to whom the Software is furnished to do so,    */
+/* subject to the following conditions:                                 */
+/*                                                                      */
+/* The above copyright notice and this permission notice shall be       */
+/* included in all copies or substantial portions of the Software.      */
+/*                                                                      */
+/* THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,      */
+/* EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF   */
+/* MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND                */
+/* NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS  */
+/* BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN   */
+/* ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN    */
+/* CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE     */
+/* SOFTWARE.                                                            */
+/*                                                                      */
+/************************************************************************/
+
+#include "xgrid_time.h"
+
+#include <string.h>
+
+// Statics
+XgridTime *XgridTime::instance = 0;
+
+
+XgridTime::XgridTime(Xgrid *_xgrid, XgridColl *_coll) :
+        xgrid(_xgrid),
+        coll(_coll),
+        synced(0),
+        root(0),
+        ref_local(0),
+        ref_offset(0),
+        drift(0),
+        rate(0),
+        best_rtt(0xFFFFFFFF),
+        sync_time(0),
+        probe_port(0),
+        req_pending(0),
+        local_time(0)
+{
+        memset(link_delay, 0, sizeof(link_delay));
+}
+
+
+XgridTime::~XgridTime()
+{
+        
+}
+
+
+void XgridTime::begin()
+{
+        instance = this;
+        
+        // timestamps are taken as close to the link as we get
+        xgrid->register_handler(XGRID_PKT_TIME_REQUEST, XGRID_PORT_ANY, &handle_request,
+                XGRID_HANDLER_IMMEDIATE | XGRID_HANDLER_PRIORITY);
+        xgrid->register_handler(XGRID_PKT_TIME_REPLY, XGRID_PORT_ANY, &handle_reply,
+                XGRID_HANDLER_IMMEDIATE | XGRID_HANDLER_PRIORITY);
+}
+
+
+int32_t XgridTime::correction(int32_t dt, int32_t rate)
+{
+        // rate is fixed point, multiply and shift only
+        return (int32_t)(((int64_t)dt * rate) >> 32);
+}
+
+
+// clock model changes in the tick interrupt, call
+// from there or with interrupts off
+uint32_t XgridTime::grid_time(uint32_t l)
+{
+        return l + ref_offset + correction((int32_t)(l - ref_local), rate);
+}
+
+
+uint32_t XgridTime::get_time()
+{
+        if (local_time == 0)
+                return 0;
+        
+        // copy the clock model, do the math with interrupts on
+        uint8_t saved_status = SREG;
+        cli();
+        
+        uint32_t l = (*local_time)();
+        uint32_t l0 = ref_local;
+        uint32_t offset = ref_offset;
+        int32_t r = rate;
+        
+        SREG = saved_status;
+        
+        return l + offset + correction((int32_t)(l - l0), r);
+}
+
+
+uint8_t XgridTime::is_synced()
+{
+        return synced;
+}
+
+
+int32_t XgridTime::get_drift()
+{
+        uint8_t saved_status = SREG;
+        cli();
+        
+        int32_t d = drift;
+        
+        SREG = saved_status;
+        
+        return d;
+}
+
+
+uint16_t XgridTime::get_link_delay(uint8_t n)
+{
+        if (n >= XGRID_MAX_NODES)
+                return 0;
+        
+        return link_delay[n];
+}
+
+
+void XgridTime::queue_request(uint8_t n)
+{
+        uint8_t saved_status = SREG;
+        cli();
+        
+        req_pending |= 1 << n;
+        
+        SREG = saved_status;
+}
+
+
+void XgridTime::send_request(uint8_t n)
+{
+        xgrid_pkt_time_request_t req;
+        Xgrid::Packet pkt;
+        
+        pkt.type = XGRID_PKT_TIME_REQUEST;
+        pkt.flags = 0;
+        pkt.radius = 1;
+        pkt.data = (uint8_t *)&req;
+        pkt.data_len = sizeof(xgrid_pkt_time_request_t);
+        
+        // stamp last, the packet leaves in this tick
+        req.t1 = (*local_time)();
+        
+        xgrid->send_packet(&pkt, 1 << n);
+}
+
+
+void XgridTime::receive_request(Xgrid::Packet *pkt)
+{
+        xgrid_pkt_time_reply_t reply;
+        Xgrid::Packet rpkt;
+        
+        // runs from Xgrid::process, no need for get_time
+        reply.t1 = ((xgrid_pkt_time_request_t *)(pkt->data))->t1;
+        reply.t2 = grid_time((*local_time)());
+        reply.synced = synced;
+        
+        rpkt.type = XGRID_PKT_TIME_REPLY;
+        rpkt.flags = 0;
+        rpkt.radius = 1;
+        rpkt.data = (uint8_t *)&reply;
+        rpkt.data_len = sizeof(xgrid_pkt_time_reply_t);
+        
+        reply.t3 = grid_time((*local_time)());
+        
+        xgrid->send_packet(&rpkt, 1 << pkt->rx_node);
+}
+
+
+void XgridTime::receive_reply(Xgrid::Packet *pkt)
+{
+        uint32_t t4 = (*local_time)();
+        xgrid_pkt_time_reply_t *r = (xgrid_pkt_time_reply_t *)(pkt->data);
+        uint8_t n = pkt->rx_node;
+        
+        // round trip less the time spent at the far end
+        int32_t rtt = (int32_t)((t4 - r->t1) - (r->t3 - r->t2));
+        
+        if (rtt < 0)
+                rtt = 0;
+        
+        uint16_t delay = rtt / 2 > 0xFFFF ? 0xFFFF : rtt / 2;
+        
+        if (link_delay[n] == 0)
+                link_delay[n] = delay;
+        else
+                link_delay[n] = (3 * (uint32_t)link_delay[n] + delay) / 4;
+        
+        // only the parent disciplines the clock
+        if (n != coll->get_parent() || !r->synced)
+                return;
+        
+        // skip samples held up in a queue, the best
+        // round trip creeps up in case the link slowed
+        if ((uint32_t)rtt <= best_rtt)
+        {
+                best_rtt = rtt;
+        }
+        else
+        {
+                best_rtt += ((uint32_t)rtt - best_rtt) / 16;
+                
+                if ((uint32_t)rtt > 2 * best_rtt + XGRID_TIME_JITTER)
+                        return;
+        }
+        
+        // parent stamped t2 one way delay after t1
+        // t1 and t3 are stamped in the pass that sends them and
+        // t2 and t4 both wait up to a tick for the receive pass,
+        // so the waits cancel and the filter above prefers
+        // samples that did not wait
+        update(r->t2 - r->t1 - rtt / 2, r->t1 + rtt / 2);
+}
+
+
+void XgridTime::update(uint32_t offset, uint32_t l)
+{
+        int32_t err = (int32_t)(offset - (grid_time(l) - l));
+        
+        // first sample or too far off, step
+        if (!synced || err > XGRID_TIME_STEP || err < -XGRID_TIME_STEP)
+        {
+                ref_offset = offset;
+                ref_local = l;
+                synced = 1;
+                return;
+        }
+        
+        // slew half the error, fold the rest into drift
+        int32_t dt = (int32_t)(l - ref_local);
+        
+        ref_offset = grid_time(l) - l + err / 2;
+        
+        // err is within the step limit, fits in 32 bits
+        if (dt > 0)
+                drift += err * 1000000L / dt / 4;
+        
+        if (drift > XGRID_TIME_MAX_DRIFT)
+                drift = XGRID_TIME_MAX_DRIFT;
+        if (drift < -XGRID_TIME_MAX_DRIFT)
+                drift = -XGRID_TIME_MAX_DRIFT;
+        
+        rate = drift * XGRID_TIME_PPM_SCALE;
+        ref_local = l;
+}
+
+
+void XgridTime::handle_request(Xgrid::Packet *pkt)
+{
+        if (instance == 0 || instance->local_time == 0 || pkt->data_len < sizeof(xgrid_pkt_time_request_t) ||
+                pkt->rx_node >= XGRID_MAX_NODES)
+                return;
+        
+        instance->receive_request(pkt);
+}
+
+
+void XgridTime::handle_reply(Xgrid::Packet *pkt)
+{
+        if (instance == 0 || instance->local_time == 0 || pkt->data_len < sizeof(xgrid_pkt_time_reply_t) ||
+                pkt->rx_node >= XGRID_MAX_NODES)
+                return;
+        
+        instance->receive_reply(pkt);
+}
+
+
+void XgridTime::process()
+{
+        if (local_time == 0)
+                return;
+        
+        uint16_t now = xgrid->get_ticks();
+        int8_t parent = coll->get_parent();
+        
+        // new tree root, carry on from the current time
+        // and converge on the new reference
+        if (coll->get_root() != root && (parent >= 0 || coll->is_root()))
+        {
+                uint16_t new_root = coll->get_root();
+                uint8_t is_root = coll->is_root();
+                
+                uint8_t saved_status = SREG;
+                cli();
+                
+                uint32_t l = (*local_time)();
+                uint32_t l0 = ref_local;
+                uint32_t offset = ref_offset;
+                int32_t r = rate;
+                
+                SREG = saved_status;
+                
+                offset += correction((int32_t)(l - l0), r);
+                
+                saved_status = SREG;
+                cli();
+                
+                ref_offset = offset;
+                ref_local = l;
+                best_rtt = 0xFFFFFFFF;
+                root = new_root;
+                
+                // the root is the reference
+                synced = is_root;
+                if (synced)
+                {
+                        drift = 0;
+                        rate = 0;
+                }
+                
+                SREG = saved_status;
+        }
+        
+        if ((uint16_t)(now - sync_time) < XGRID_TIME_INTERVAL)
+                return;
+        
+        sync_time = now;
+        
+        if (parent >= 0)
+                queue_request(parent);
+        
+        // delay to one other neighbor per interval
+        for (uint8_t i = 0; i < XGRID_MAX_NODES; i++)
+        {
+                uint16_t id;
+                uint8_t load;
+                
+                probe_port = (probe_port + 1) % XGRID_MAX_NODES;
+                
+                if (probe_port != parent && xgrid->get_neighbor(probe_port, &id, &load))
+                {
+                        queue_request(probe_port);
+                        break;
+                }
+        }
+}
+
+
+void XgridTime::tick()
+{
+        if (local_time == 0 || req_pending == 0)
+                return;
+        
+        for (uint8_t n = 0; n < XGRID_MAX_NODES; n++)
+        {
+                if (req_pending & (1 << n))
+                        send_request(n);
+        }
+        
+        req_pending = 0;
+}
+
+
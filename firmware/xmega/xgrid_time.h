@@ -0,0 +1,139 @@
+/************************************************************************/
+/* xgrid time sync                                                      */
+/*                                                                      */
+/* xgrid_time.h                                                         */
+/*                                                                      */
+/* Alex Forencich <alex@alexforencich.com>                              */
+/*                                                                      */
+/* Copyright (c) 2011 Alex Forencich                                    */
+/*                                                                      */
+/* Permission is hereby granted, free of charge, to any person          */
+/* obtaining a copy of this software and associated documentation       */
+/* files(the "Software"), to deal in the Software without restriction,  */
+/* including without limitation the rights to use, copy, modify, merge, */
+/* publish, distribute, sublicense, and/or sell copies of the Software, */
+/* and to permit persons to whom the Software is furnished to do so,    */
+/* subject to the following conditions:                                 */
+/*                                                                      */
+/* The above copyright notice and this permission notice shall be       */
+/* included in all copies or substantial portions of the Software.      */
+/*                                                                      */
+/* THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,      */
+/* EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF   */
+/* MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND                */
+/* NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS  */
+/* BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN   */
+/* ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN    */
+/* CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE     */
+/* SOFTWARE.                                                            */
+/*                                                                      */
+/************************************************************************/
+
+#ifndef __XGRID_TIME_H
+#define __XGRID_TIME_H
+
+#include <avr/io.h>
+#include <avr/interrupt.h>
+
+#include "xgrid.h"
+#include "xgrid_coll.h"
+
+// defines
+
+// timing in ms
+// each node exchanges with its tree parent once per
+// interval and probes one other neighbor for link delay
+#define XGRID_TIME_INTERVAL     1000
+
+// offset errors in us beyond the step limit are
+// applied at once instead of slewed, samples with a
+// round trip past twice the best recent one plus the
+// jitter allowance are discarded
+#define XGRID_TIME_STEP         2000
+#define XGRID_TIME_JITTER       1000
+
+// drift limit in ppm, the internal RC oscillator
+// is good to a fraction of a percent
+#define XGRID_TIME_MAX_DRIFT    10000
+
+// drift in ppm to rate in 2^-32 per us
+#define XGRID_TIME_PPM_SCALE    4295
+
+// XgridTime class
+class XgridTime
+{
+private:
+        // Per object data
+        Xgrid *xgrid;
+        XgridColl *coll;
+        
+        // clock model, grid time is local time plus
+        // offset plus drift since the reference
+        uint8_t synced;
+        uint16_t root;
+        uint32_t ref_local;
+        uint32_t ref_offset;
+        int32_t drift;
+        int32_t rate;
+        uint32_t best_rtt;
+        
+        // one way delay per port in us
+        uint16_t link_delay[XGRID_MAX_NODES];
+        
+        uint16_t sync_time;
+        uint8_t probe_port;
+        
+        // requests waiting for the next tick, one bit per port
+        volatile uint8_t req_pending;
+        
+        // Static data
+        static XgridTime *instance;
+        
+        // Private methods
+        uint32_t grid_time(uint32_t l);
+        void queue_request(uint8_t n);
+        void send_request(uint8_t n);
+        void receive_request(Xgrid::Packet *pkt);
+        void receive_reply(Xgrid::Packet *pkt);
+        void update(uint32_t offset, uint32_t l);
+        
+        // Private static methods
+        static int32_t correction(int32_t dt, int32_t rate);
+        static void handle_request(Xgrid::Packet *pkt);
+        static void handle_reply(Xgrid::Packet *pkt);
+
+public:
+        // Public variables
+        
+        // local time callback
+        // free running microsecond count, safe to call
+        // with interrupts off
+        uint32_t (*local_time)();
+        
+        // Public methods
+        XgridTime(Xgrid *_xgrid, XgridColl *_coll);
+        ~XgridTime();
+        
+        void begin();
+        
+        // grid time in us, local time until synced
+        uint32_t get_time();
+        uint8_t is_synced();
+        
+        // rate against the root in ppm, one way
+        // delay to the neighbor on port n in us
+        int32_t get_drift();
+        uint16_t get_link_delay(uint8_t n);
+        
+        void process();
+        
+        // call from the tick interrupt just ahead of
+        // Xgrid::process so requests go out in the same
+        // pass they are stamped, like the replies do
+        void tick();
+};
+
+// Prototypes
+
+
+#endif // __XGRID_TIME_H
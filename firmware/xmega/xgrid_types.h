@@ -44,22 +44,176 @@
 #endif
 
 // flags
+#define XGRID_PKT_FLAG_FRAGMENT 0x08
 #define XGRID_PKT_FLAG_TRACE    0x10
+#define XGRID_PKT_FLAG_UNICAST  0x20
+#define XGRID_PKT_FLAG_PRIORITY 0x40
+
+// unicast packets carry the destination ID
+// in the first two bytes of the data field
+typedef struct
+{
+        uint16_t dest_id;
+        uint8_t data[];
+} __attribute__ ((PACKED_ATTR)) xgrid_pkt_unicast_t;
+
+// fragmented packets carry part of a message too
+// large for one buffer after the destination, msg_id
+// is chosen by the source, offset and total in bytes,
+// offset is a multiple of the fragment size
+typedef struct
+{
+        uint16_t msg_id;
+        uint16_t offset;
+        uint16_t total;
+        uint8_t data[];
+} __attribute__ ((PACKED_ATTR)) xgrid_pkt_fragment_t;
 
 // packet types
 // general purpose
 #define XGRID_PKT_DEBUG 0xFF
 
+// compute jobs
+// coordinator sends work items to workers by unicast,
+// each is answered with a result carrying the same job
+// and item IDs, busy means the run queue was full and
+// the item should go elsewhere, the coordinator floods
+// a progress report with completed items per second
+#define XGRID_PKT_JOB_ITEM 0xE0
+#define XGRID_PKT_JOB_RESULT 0xE1
+#define XGRID_PKT_JOB_REPORT 0xE2
+
+// work stealing between neighbors, radius 1
+// an idle node asks a loaded neighbor for up to want
+// items, the neighbor hands over a share of its queue
+// keeping the original coordinator, load is the
+// sender's queue length, a steal with want 0 only
+// carries the hint
+#define XGRID_PKT_JOB_STEAL 0xE3
+#define XGRID_PKT_JOB_HANDOFF 0xE4
+
+#define XGRID_JOB_STATUS_OK        0x00
+#define XGRID_JOB_STATUS_BUSY      0x01
+#define XGRID_JOB_STATUS_NO_KERNEL 0x02
+#define XGRID_JOB_STATUS_ERROR     0x03
+
+typedef struct
+{
+        uint16_t job_id;
+        uint16_t item_id;
+        uint8_t kernel;
+        uint8_t data[];
+} __attribute__ ((PACKED_ATTR)) xgrid_pkt_job_item_t;
+
+typedef struct
+{
+        uint16_t job_id;
+        uint16_t item_id;
+        uint8_t status;
+        uint8_t data[];
+} __attribute__ ((PACKED_ATTR)) xgrid_pkt_job_result_t;
+
+typedef struct
+{
+        uint16_t job_id;
+        uint16_t items;
+        uint16_t done;
+        uint16_t reassigned;
+        uint16_t rate;
+        uint8_t workers;
+} __attribute__ ((PACKED_ATTR)) xgrid_pkt_job_report_t;
+
+typedef struct
+{
+        uint8_t load;
+        uint8_t want;
+} __attribute__ ((PACKED_ATTR)) xgrid_pkt_job_steal_t;
+
+typedef struct
+{
+        uint16_t coordinator;
+        uint8_t load;
+        xgrid_pkt_job_item_t item;
+} __attribute__ ((PACKED_ATTR)) xgrid_pkt_job_handoff_t;
+
+// collectives over a spanning tree, radius 1
+// the root floods a tree offer hop by hop, each node
+// takes the neighbor it first heard the offer from as
+// parent and joins it, reduce and gather contributions
+// go up to the parent, broadcasts and allreduce results
+// go down to the children, op is chosen by the caller
+// and func picks the combine function for reductions,
+// barrier arrivals go up and the release comes down
+// with the barrier generation in op
+#define XGRID_PKT_COLL_TREE 0xE5
+#define XGRID_PKT_COLL_JOIN 0xE6
+#define XGRID_PKT_COLL_UP 0xE7
+#define XGRID_PKT_COLL_DOWN 0xE8
+
+#define XGRID_COLL_REDUCE    0x00
+#define XGRID_COLL_ALLREDUCE 0x01
+#define XGRID_COLL_BROADCAST 0x02
+#define XGRID_COLL_GATHER    0x03
+#define XGRID_COLL_BARRIER   0x04
+
+typedef struct
+{
+        uint16_t root;
+        uint8_t epoch;
+        uint8_t depth;
+} __attribute__ ((PACKED_ATTR)) xgrid_pkt_coll_tree_t;
+
+typedef struct
+{
+        uint16_t root;
+        uint8_t epoch;
+        uint8_t op;
+        uint8_t kind;
+        uint8_t func;
+        uint16_t source;
+        uint8_t data[];
+} __attribute__ ((PACKED_ATTR)) xgrid_pkt_coll_t;
+
+// time synchronization, radius 1
+// a node sends its local time t1 to its tree parent,
+// the reply echoes t1 with the parent's grid time at
+// receipt t2 and at reply t3, all in microseconds,
+// synced is clear while the parent has no time yet
+#define XGRID_PKT_TIME_REQUEST 0xE9
+#define XGRID_PKT_TIME_REPLY 0xEA
+
+typedef struct
+{
+        uint32_t t1;
+} __attribute__ ((PACKED_ATTR)) xgrid_pkt_time_request_t;
+
+typedef struct
+{
+        uint32_t t1;
+        uint32_t t2;
+        uint32_t t3;
+        uint8_t synced;
+} __attribute__ ((PACKED_ATTR)) xgrid_pkt_time_reply_t;
+
 // network
 // ping packet for testing connectivity
 // reply will contain firmware information
+// timestamp is echoed back for round trip measurement
+// queue is number of packet buffers in use
 #define XGRID_PKT_PING_REQUEST 0xFD
 #define XGRID_PKT_PING_REPLY 0xFE
 
+typedef struct
+{
+        uint16_t timestamp;
+} __attribute__ ((PACKED_ATTR)) xgrid_pkt_ping_request_t;
+
 typedef struct
 {
         uint32_t build;
         uint16_t crc;
+        uint16_t timestamp;
+        uint8_t queue;
 } __attribute__ ((PACKED_ATTR)) xgrid_pkt_ping_reply_t;
 
 // maintenance command
@@ -108,6 +262,179 @@ typedef struct
 // flush compare buffer
 #define XGRID_PKT_FLUSH_COMPARE_BUFFER 0xFC
 
+// route update
+// distance vector sent to each neighbor with radius 1
+// list of destination IDs and hop counts
+#define XGRID_PKT_ROUTE_UPDATE 0xF8
+
+typedef struct
+{
+        uint16_t id;
+        uint8_t metric;
+} __attribute__ ((PACKED_ATTR)) xgrid_pkt_route_entry_t;
+
+// hello
+// sent periodically to all neighbors with radius 1
+// link capabilities and application load hint of the
+// sender followed by a list of one-hop neighbor IDs,
+// flagged if selected as a multipoint relay
+#define XGRID_PKT_HELLO 0xF7
+
+#define XGRID_HELLO_FLAG_MPR 0x01
+
+// link capabilities
+#define XGRID_CAP_COMPACT 0x01
+#define XGRID_CAP_V2      0x02
+#define XGRID_CAP_ESCAPE  0x04
+#define XGRID_CAP_BAUD    0x08
+#define XGRID_CAP_XONXOFF 0x10
+#define XGRID_CAP_CREDITS 0x20
+
+typedef struct
+{
+        uint16_t id;
+        uint8_t flags;
+} __attribute__ ((PACKED_ATTR)) xgrid_pkt_hello_entry_t;
+
+typedef struct
+{
+        uint8_t caps;
+        uint8_t load;
+        xgrid_pkt_hello_entry_t neighbors[];
+} __attribute__ ((PACKED_ATTR)) xgrid_pkt_hello_t;
+
+// topology collection
+// request is flooded, every node answers with a unicast
+// reply to the requester listing its neighbor table,
+// replies follow the path the request came in on
+// rtt in ms, loss in percent of pings unanswered,
+// errors is count of bytes and frames discarded on receive
+#define XGRID_PKT_TOPOLOGY_REQUEST 0xF5
+#define XGRID_PKT_TOPOLOGY_REPLY 0xF6
+
+#define XGRID_TOPOLOGY_RADIUS 16
+
+// aggregate
+// several small packets bound for the same neighbor
+// combined into one frame with radius 1
+// data is a series of items, each a length byte
+// (header plus data) followed by a packet without
+// the identifier and size fields
+#define XGRID_PKT_AGGREGATE 0xF2
+
+typedef struct
+{
+        uint8_t len;
+        uint16_t source_id;
+        uint8_t type;
+        uint8_t seq;
+        uint8_t flags;
+        uint8_t radius;
+        uint8_t data[];
+} __attribute__ ((PACKED_ATTR)) xgrid_pkt_aggregate_item_t;
+
+// statistics
+// request is flooded, every node answers with small
+// unicast replies to the requester, one with the buffer
+// class counters and one per port, sent a tick apart
+// along the path the request came in on, counters are
+// optionally reset after the last one, ticks is node
+// time in ms for computing rates
+#define XGRID_PKT_STATS_REQUEST 0xF3
+#define XGRID_PKT_STATS_REPLY 0xF4
+
+#define XGRID_STATS_FLAG_RESET 0x01
+
+#define XGRID_STATS_PART_BUFFERS 0xFF
+
+typedef struct
+{
+        uint8_t flags;
+        uint8_t radius;
+} __attribute__ ((PACKED_ATTR)) xgrid_pkt_stats_request_t;
+
+typedef struct
+{
+        uint32_t bytes_in;
+        uint32_t bytes_out;
+        uint16_t packets_in;
+        uint16_t packets_out;
+        uint16_t forwarded;
+        uint16_t duplicates;
+        uint16_t alloc_fail;
+        uint16_t resync_bytes;
+        uint16_t rx_errors;
+        uint16_t rx_timeouts;
+        uint16_t rx_overruns;
+        uint16_t max_tx_wait;
+        uint16_t no_route;
+} __attribute__ ((PACKED_ATTR)) xgrid_pkt_stats_port_t;
+
+typedef struct
+{
+        uint8_t count;
+        uint8_t max_used;
+        uint16_t allocs;
+        uint16_t alloc_fail;
+} __attribute__ ((PACKED_ATTR)) xgrid_pkt_stats_buffer_t;
+
+typedef struct
+{
+        uint16_t ticks;
+        uint8_t port_cnt;
+        uint8_t class_cnt;
+        uint8_t part;
+        uint8_t data[];
+        // buffers part: xgrid_pkt_stats_buffer_t classes[class_cnt];
+        // otherwise: xgrid_pkt_stats_port_t of port part
+} __attribute__ ((PACKED_ATTR)) xgrid_pkt_stats_reply_t;
+
+typedef struct
+{
+        uint8_t radius;
+} __attribute__ ((PACKED_ATTR)) xgrid_pkt_topology_request_t;
+
+typedef struct
+{
+        uint16_t id;
+        uint8_t port;
+        uint16_t rtt;
+        uint8_t loss;
+        uint8_t queue;
+        uint16_t errors;
+} __attribute__ ((PACKED_ATTR)) xgrid_pkt_topology_entry_t;
+
+typedef struct
+{
+        uint8_t queue;
+        xgrid_pkt_topology_entry_t neighbors[];
+} __attribute__ ((PACKED_ATTR)) xgrid_pkt_topology_reply_t;
+
+// baud rate negotiation
+// link level, radius 1, rate is an index into the
+// candidate rate table, lower ID proposes one step
+// up, both switch and the proposer sends test frames
+// until acknowledged at the new rate
+#define XGRID_PKT_BAUD 0xF1
+
+// buffer credits
+// link level, radius 1, header v2 only with no data,
+// sent when room frees up at a node whose neighbor
+// may be holding packets, credits ride in the header
+#define XGRID_PKT_CREDITS 0xF0
+
+#define XGRID_BAUD_PROPOSE  0x01
+#define XGRID_BAUD_ACCEPT   0x02
+#define XGRID_BAUD_REJECT   0x03
+#define XGRID_BAUD_TEST     0x04
+#define XGRID_BAUD_TEST_ACK 0x05
+
+typedef struct
+{
+        uint8_t cmd;
+        uint8_t rate;
+} __attribute__ ((PACKED_ATTR)) xgrid_pkt_baud_t;
+
 #endif // __XGRID_TYPES_H
 
 
@@ -0,0 +1,157 @@
+/************************************************************************/
+/* IHexFile                                                             */
+/*                                                                      */
+/* Intel HEX file reader                                                */
+/*                                                                      */
+/* IHexFile.cpp                                                         */
+/*                                                                      */
+/* Alex Forencich <alex@alexforencich.com>                              */
+/*                                                                      */
+/* Copyright (c) 2012 Alex Forencich                                    */
+/*                                                                      */
+/* Permission is hereby granted, free of charge, to any person          */
+/* obtaining a copy of this software and associated documentation       */
+/* files(the "Software"), to deal in the Software without restriction,  */
+/* including without limitation the rights to use, copy, modify, merge, */
+/* publish, distribute, sublicense, and/or sell copies of the Software, */
+/* and to permit persons to whom the Software is furnished to do so,    */
+/* subject to the following conditions:                                 */
+/*                                                                      */
+/* The above copyright notice and this permission notice shall be       */
+/* included in all copies or substantial portions of the Software.      */
+/*                                                                      */
+/* THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,      */
+/* EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF   */
+/* MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND                */
+/* NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS  */
+/* BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN   */
+/* ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN    */
+/* CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE     */
+/* SOFTWARE.                                                            */
+/*                                                                      */
+/************************************************************************/
+
+#include "IHexFile.h"
+
+#include <fstream>
+#include <sstream>
+#include <stdlib.h>
+
+IHexFile::IHexFile()
+{
+        // nothing
+}
+
+
+IHexFile::~IHexFile()
+{
+        // nothing
+}
+
+
+bool IHexFile::load(std::string filename)
+{
+        std::ifstream f(filename.c_str());
+        std::string line;
+        std::vector<uint8_t> rec;
+        uint32_t base = 0;
+        int line_num = 0;
+        
+        clear();
+        
+        if (!f.is_open())
+        {
+                error = "Unable to open " + filename;
+                return false;
+        }
+        
+        while (std::getline(f, line))
+        {
+                uint8_t sum = 0;
+                uint8_t len;
+                uint16_t offset;
+                uint8_t type;
+                
+                line_num++;
+                
+                // strip CR from DOS line endings
+                while (line.size() > 0 && (line[line.size()-1] == '\r' || line[line.size()-1] == ' '))
+                        line.erase(line.size()-1);
+                
+                if (line.size() == 0)
+                        continue;
+                
+                if (line[0] != ':' || line.size() < 11 || (line.size() & 1) == 0)
+                {
+                        error = Glib::ustring::compose("Bad record on line %1", line_num);
+                        return false;
+                }
+                
+                rec.clear();
+                for (size_t i = 1; i < line.size(); i += 2)
+                {
+                        rec.push_back(strtoul(line.substr(i, 2).c_str(), 0, 16));
+                        sum += rec.back();
+                }
+                
+                len = rec[0];
+                offset = (rec[1] << 8) | rec[2];
+                type = rec[3];
+                
+                if (rec.size() != len + 5u || sum != 0)
+                {
+                        error = Glib::ustring::compose("Bad checksum on line %1", line_num);
+                        return false;
+                }
+                
+                switch (type)
+                {
+                        case 0x00:
+                                // data
+                                if (data.size() < base + offset + len)
+                                        data.resize(base + offset + len, 0xFF);
+                                for (int i = 0; i < len; i++)
+                                        data[base + offset + i] = rec[4 + i];
+                                break;
+                        case 0x01:
+                                // end of file
+                                return true;
+                        case 0x02:
+                                // extended segment address
+                                if (len != 2)
+                                {
+                                        error = Glib::ustring::compose("Bad address record on line %1", line_num);
+                                        return false;
+                                }
+                                base = ((rec[4] << 8) | rec[5]) << 4;
+                                break;
+                        case 0x04:
+                                // extended linear address
+                                if (len != 2)
+                                {
+                                        error = Glib::ustring::compose("Bad address record on line %1", line_num);
+                                        return false;
+                                }
+                                base = ((rec[4] << 8) | rec[5]) << 16;
+                                break;
+                        default:
+                                // start address records, ignore
+                                break;
+                }
+        }
+        
+        return true;
+}
+
+
+void IHexFile::clear()
+{
+        data.clear();
+        error = "";
+}
+
+
+Glib::ustring IHexFile::get_error()
+{
+        return error;
+}
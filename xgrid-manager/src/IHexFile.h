@@ -0,0 +1,63 @@
+/************************************************************************/
+/* IHexFile                                                             */
+/*                                                                      */
+/* Intel HEX file reader                                                */
+/*                                                                      */
+/* IHexFile.h                                                           */
+/*                                                                      */
+/* Alex Forencich <alex@alexforencich.com>                              */
+/*                                                                      */
+/* Copyright (c) 2012 Alex Forencich                                    */
+/*                                                                      */
+/* Permission is hereby granted, free of charge, to any person          */
+/* obtaining a copy of this software and associated documentation       */
+/* files(the "Software"), to deal in the Software without restriction,  */
+/* including without limitation the rights to use, copy, modify, merge, */
+/* publish, distribute, sublicense, and/or sell copies of the Software, */
+/* and to permit persons to whom the Software is furnished to do so,    */
+/* subject to the following conditions:                                 */
+/*                                                                      */
+/* The above copyright notice and this permission notice shall be       */
+/* included in all copies or substantial portions of the Software.      */
+/*                                                                      */
+/* THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,      */
+/* EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF   */
+/* MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND                */
+/* NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS  */
+/* BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN   */
+/* ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN    */
+/* CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE     */
+/* SOFTWARE.                                                            */
+/*                                                                      */
+/************************************************************************/
+
+#ifndef __IHEXFILE_H
+#define __IHEXFILE_H
+
+#include <glibmm.h>
+
+#include <string>
+#include <vector>
+#include <inttypes.h>
+
+// IHexFile class
+// Intel HEX image, unused bytes are 0xFF
+class IHexFile
+{
+public:
+        IHexFile();
+        virtual ~IHexFile();
+        
+        bool load(std::string filename);
+        void clear();
+        
+        // image data starting at address 0
+        std::vector<uint8_t> data;
+        
+        Glib::ustring get_error();
+        
+protected:
+        Glib::ustring error;
+};
+
+#endif //__IHEXFILE_H
@@ -0,0 +1,584 @@
+/************************************************************************/
+/* XBootUploader                                                        */
+/*                                                                      */
+/* XBoot Firmware Uploader                                              */
+/*                                                                      */
+/* XBootUploader.cpp                                                    */
+/*                                                                      */
+/* Alex Forencich <alex@alexforencich.com>                              */
+/*                                                                      */
+/* Copyright (c) 2012 Alex Forencich                                    */
+/*                                                                      */
+/* Permission is hereby granted, free of charge, to any person          */
+/* obtaining a copy of this software and associated documentation       */
+/* files(the "Software"), to deal in the Software without restriction,  */
+/* including without limitation the rights to use, copy, modify, merge, */
+/* publish, distribute, sublicense, and/or sell copies of the Software, */
+/* and to permit persons to whom the Software is furnished to do so,    */
+/* subject to the following conditions:                                 */
+/*                                                                      */
+/* The above copyright notice and this permission notice shall be       */
+/* included in all copies or substantial portions of the Software.      */
+/*                                                                      */
+/* THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,      */
+/* EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF   */
+/* MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND                */
+/* NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS  */
+/* BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN   */
+/* ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN    */
+/* CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE     */
+/* SOFTWARE.                                                            */
+/*                                                                      */
+/************************************************************************/
+
+#include "XBootUploader.h"
+
+#include <iostream>
+#include <sstream>
+#include <iomanip>
+
+// XBoot commands and replies, see firmware/xboot/protocol.h
+#define CMD_SYNC                '\x1b'
+#define CMD_CHECK_BLOCK_SUPPORT 'b'
+#define CMD_PROGRAM_ID          'S'
+#define CMD_READ_SIGNATURE      's'
+#define CMD_SET_ADDRESS         'A'
+#define CMD_SET_EXT_ADDRESS     'H'
+#define CMD_CHIP_ERASE          'e'
+#define CMD_BLOCK_LOAD          'B'
+#define CMD_EXIT_BOOTLOADER     'E'
+#define CMD_CRC                 'h'
+
+#define MEM_FLASH               'F'
+#define SECTION_APPLICATION     'A'
+
+#define REPLY_ACK               '\r'
+#define REPLY_YES               'Y'
+
+// XMEGA USART holds two characters in its receive buffer
+// plus one in the shift register
+#define XBOOT_DEFAULT_SLACK     3
+
+// timer period in ms
+#define XBOOT_TICK              50
+// resend sync every 250 ms, give up after 10 s
+#define XBOOT_SYNC_RESEND       5
+#define XBOOT_SYNC_TIMEOUT      200
+// line must be quiet for 100 ms after sync
+#define XBOOT_SYNC_QUIET        2
+// no reply for 5 s
+#define XBOOT_TIMEOUT           100
+
+XBootUploader::XBootUploader() :
+        state(XS_Idle),
+        cmd_offset(0),
+        total_sent(0),
+        slack(XBOOT_DEFAULT_SLACK),
+        sync_ticks(0),
+        idle_ticks(0),
+        block_size(0),
+        app_size(0),
+        payload_total(0),
+        payload_done(0),
+        debug(false)
+{
+        // nothing
+}
+
+
+XBootUploader::~XBootUploader()
+{
+        c_timer.disconnect();
+}
+
+
+void XBootUploader::set_serial_interface(std::tr1::shared_ptr<SerialInterface> si)
+{
+        clear_serial_interface();
+        if (!si)
+                return;
+        ser_int = si;
+        c_port_receive_data = ser_int->port_receive_data().connect( sigc::mem_fun(*this, &XBootUploader::on_receive_data) );
+}
+
+
+void XBootUploader::clear_serial_interface()
+{
+        if (!ser_int)
+                return;
+        c_port_receive_data.disconnect();
+        ser_int = std::tr1::shared_ptr<SerialInterface>();
+}
+
+
+bool XBootUploader::has_serial_interface()
+{
+        return ser_int;
+}
+
+
+bool XBootUploader::start(std::vector<uint8_t> &img)
+{
+        gsize num;
+        char c = CMD_SYNC;
+        
+        if (state != XS_Idle)
+                return false;
+        
+        if (!ser_int || !ser_int->is_open())
+        {
+                std::cerr << "[XBootUploader] Port not open!" << std::endl;
+                return false;
+        }
+        
+        image = img;
+        
+        cmd_queue.clear();
+        reply_queue.clear();
+        rx_data.clear();
+        cmd_offset = 0;
+        total_sent = 0;
+        sync_ticks = 0;
+        idle_ticks = 0;
+        payload_total = 0;
+        payload_done = 0;
+        
+        state = XS_Sync;
+        
+        // ESC resets the application into the bootloader
+        if (ser_int->write(&c, 1, num) != SerialInterface::SS_Success)
+        {
+                state = XS_Idle;
+                return false;
+        }
+        
+        timer.start();
+        
+        c_timer = Glib::signal_timeout().connect( sigc::mem_fun(*this, &XBootUploader::on_timer), XBOOT_TICK );
+        
+        return true;
+}
+
+
+void XBootUploader::cancel()
+{
+        if (state != XS_Idle)
+                finish(false, "Upload cancelled");
+}
+
+
+bool XBootUploader::is_running()
+{
+        return state != XS_Idle;
+}
+
+
+int XBootUploader::set_slack(int s)
+{
+        slack = s;
+        return slack;
+}
+
+
+int XBootUploader::get_slack()
+{
+        return slack;
+}
+
+
+bool XBootUploader::set_debug(bool d)
+{
+        debug = d;
+        return debug;
+}
+
+
+bool XBootUploader::get_debug()
+{
+        return debug;
+}
+
+
+sigc::signal<void, double> XBootUploader::signal_progress()
+{
+        return m_signal_progress;
+}
+
+
+sigc::signal<void, bool, Glib::ustring> XBootUploader::signal_done()
+{
+        return m_signal_done;
+}
+
+
+void XBootUploader::on_receive_data()
+{
+        gsize num;
+        int status;
+        static char buf[1024];
+        
+        if (!ser_int)
+                return;
+        
+        // read raw data from serial port
+        do
+        {
+                status = ser_int->read(buf, 1024, num);
+                
+                if (status != SerialInterface::SS_Success)
+                {
+                        if (state != XS_Idle)
+                                finish(false, "Read error");
+                        return;
+                }
+                
+                if (state != XS_Idle)
+                        rx_data.append(buf, num);
+        }
+        while (num == 1024);
+        
+        idle_ticks = 0;
+        
+        if (state == XS_Sync)
+        {
+                // wait for the line to go quiet, more than one
+                // sync may have been answered
+                if (rx_data.find("XBoot++") != std::string::npos)
+                        sync_ticks = -1;
+                return;
+        }
+        
+        while (state != XS_Idle && !reply_queue.empty() && rx_data.size() >= reply_queue.front().reply_len)
+        {
+                std::string r = rx_data.substr(0, reply_queue.front().reply_len);
+                rx_data.erase(0, reply_queue.front().reply_len);
+                
+                if (!handle_reply(reply_queue.front(), r))
+                        return;
+                
+                reply_queue.pop_front();
+        }
+        
+        if (state == XS_Program && cmd_queue.empty() && reply_queue.empty())
+        {
+                finish(true, Glib::ustring::compose("Uploaded %1 bytes in %2 s", payload_done,
+                        Glib::ustring::format(std::fixed, std::setprecision(1), timer.elapsed())));
+                return;
+        }
+        
+        pump();
+}
+
+
+bool XBootUploader::on_timer()
+{
+        gsize num;
+        
+        if (state == XS_Sync)
+        {
+                if (sync_ticks < 0)
+                {
+                        if (idle_ticks++ >= XBOOT_SYNC_QUIET)
+                        {
+                                rx_data.clear();
+                                state = XS_Info;
+                                idle_ticks = 0;
+                                
+                                queue_command(std::string(1, CMD_CHECK_BLOCK_SUPPORT), XR_BlockSize, 3, false);
+                                queue_command(std::string(1, CMD_READ_SIGNATURE), XR_Signature, 3, false);
+                                pump();
+                        }
+                        return true;
+                }
+                
+                if (++sync_ticks > XBOOT_SYNC_TIMEOUT)
+                {
+                        finish(false, "No response from bootloader");
+                        return false;
+                }
+                
+                if (sync_ticks % XBOOT_SYNC_RESEND == 0)
+                {
+                        const char buf[] = { CMD_SYNC, CMD_PROGRAM_ID };
+                        if (ser_int->write(buf, 2, num) != SerialInterface::SS_Success)
+                        {
+                                finish(false, "Write error");
+                                return false;
+                        }
+                }
+                
+                return true;
+        }
+        
+        if (++idle_ticks > XBOOT_TIMEOUT)
+        {
+                finish(false, "Bootloader timed out");
+                return false;
+        }
+        
+        // retry anything the port did not take
+        pump();
+        
+        return true;
+}
+
+
+void XBootUploader::queue_command(std::string data, XBootReply reply, size_t reply_len, bool busy, size_t payload)
+{
+        Command cmd;
+        
+        cmd.data = data;
+        cmd.reply = reply;
+        cmd.reply_len = reply_len;
+        cmd.busy = busy;
+        cmd.end_pos = 0;
+        cmd.payload = payload;
+        
+        payload_total += payload;
+        
+        cmd_queue.push_back(cmd);
+}
+
+
+void XBootUploader::queue_program()
+{
+        size_t next_word = 0;
+        
+        if (image.size() > app_size)
+        {
+                finish(false, "Image does not fit in application section");
+                return;
+        }
+        
+        state = XS_Program;
+        
+        queue_command(std::string(1, CMD_CHIP_ERASE), XR_Ack, 1, true);
+        
+        for (size_t addr = 0; addr < image.size(); addr += block_size)
+        {
+                std::string cmd;
+                bool blank = true;
+                
+                for (size_t i = addr; i < addr + block_size && i < image.size(); i++)
+                {
+                        if (image[i] != 0xFF)
+                        {
+                                blank = false;
+                                break;
+                        }
+                }
+                
+                // erased already
+                if (blank)
+                        continue;
+                
+                // bootloader auto-increments, so only set the
+                // address after skipping blank blocks
+                if (addr / 2 != next_word)
+                {
+                        if (addr / 2 > 0xFFFF)
+                        {
+                                cmd = CMD_SET_EXT_ADDRESS;
+                                cmd += (char)((addr / 2) >> 16);
+                        }
+                        else
+                        {
+                                cmd = CMD_SET_ADDRESS;
+                        }
+                        cmd += (char)((addr / 2) >> 8);
+                        cmd += (char)(addr / 2);
+                        queue_command(cmd, XR_Ack, 1, false);
+                }
+                
+                cmd = CMD_BLOCK_LOAD;
+                cmd += (char)(block_size >> 8);
+                cmd += (char)(block_size);
+                cmd += MEM_FLASH;
+                
+                for (size_t i = addr; i < addr + block_size; i++)
+                        cmd += (char)(i < image.size() ? image[i] : 0xFF);
+                
+                queue_command(cmd, XR_Ack, 1, true, block_size);
+                
+                next_word = (addr + block_size) / 2;
+        }
+        
+        queue_command(std::string(1, CMD_CRC) + SECTION_APPLICATION, XR_CRC, 2, true);
+        queue_command(std::string(1, CMD_EXIT_BOOTLOADER), XR_Ack, 1, false);
+}
+
+
+bool XBootUploader::handle_reply(Command &cmd, std::string &r)
+{
+        uint8_t *d = (uint8_t *)r.data();
+        
+        if (debug)
+        {
+                std::cout << "[XBootUploader] Reply to '" << cmd.data[0] << "':";
+                for (size_t i = 0; i < r.size(); i++)
+                        std::cout << " " << std::hex << std::setfill('0') << std::setw(2) << (int)d[i];
+                std::cout << std::dec << std::endl;
+        }
+        
+        switch (cmd.reply)
+        {
+                case XR_Ack:
+                        if (d[0] != REPLY_ACK)
+                        {
+                                finish(false, Glib::ustring::compose("Bootloader error on command '%1'", cmd.data.substr(0, 1)));
+                                return false;
+                        }
+                        
+                        if (cmd.payload)
+                        {
+                                payload_done += cmd.payload;
+                                m_signal_progress.emit((double)payload_done / payload_total);
+                        }
+                        break;
+                
+                case XR_BlockSize:
+                        if (d[0] != REPLY_YES)
+                        {
+                                finish(false, "Bootloader does not support block mode");
+                                return false;
+                        }
+                        
+                        block_size = (d[1] << 8) | d[2];
+                        
+                        if (block_size == 0)
+                        {
+                                finish(false, "Bad block size");
+                                return false;
+                        }
+                        break;
+                
+                case XR_Signature:
+                        // flash size is encoded in the middle signature byte,
+                        // 0x94 for 16 KB up to 0x98 for 256 KB, except the 192 KB parts
+                        if (d[2] != 0x1E)
+                        {
+                                finish(false, "Bad device signature");
+                                return false;
+                        }
+                        
+                        if (d[1] == 0x97 && (d[0] == 0x44 || d[0] == 0x4E))
+                                app_size = 192 * 1024;
+                        else if (d[1] >= 0x94 && d[1] <= 0x98)
+                                app_size = (16 * 1024) << (d[1] - 0x94);
+                        else
+                        {
+                                finish(false, "Unknown device");
+                                return false;
+                        }
+                        
+                        queue_program();
+                        
+                        if (state != XS_Program)
+                                return false;
+                        break;
+                
+                case XR_CRC:
+                {
+                        uint16_t crc = 0;
+                        
+                        for (size_t i = 0; i < app_size; i++)
+                                crc = crc16_update(crc, i < image.size() ? image[i] : 0xFF);
+                        
+                        if (((d[0] << 8) | d[1]) != crc)
+                        {
+                                finish(false, "Verify failed, CRC mismatch");
+                                return false;
+                        }
+                        break;
+                }
+        }
+        
+        return true;
+}
+
+
+void XBootUploader::pump()
+{
+        gsize num;
+        
+        if (!ser_int || state == XS_Idle)
+                return;
+        
+        while (!cmd_queue.empty())
+        {
+                Command &cmd = cmd_queue.front();
+                size_t len = cmd.data.size() - cmd_offset;
+                
+                // the bootloader does not read the port while it is busy,
+                // so send at most what the receive FIFO holds
+                for (std::deque<Command>::iterator it = reply_queue.begin(); it != reply_queue.end(); it++)
+                {
+                        if (it->busy)
+                        {
+                                size_t limit = it->end_pos + slack;
+                                
+                                if (total_sent >= limit)
+                                        return;
+                                
+                                if (len > limit - total_sent)
+                                        len = limit - total_sent;
+                                
+                                break;
+                        }
+                }
+                
+                if (ser_int->write(cmd.data.data() + cmd_offset, len, num) != SerialInterface::SS_Success)
+                {
+                        finish(false, "Write error");
+                        return;
+                }
+                
+                cmd_offset += num;
+                total_sent += num;
+                
+                if (cmd_offset == cmd.data.size())
+                {
+                        cmd.end_pos = total_sent;
+                        reply_queue.push_back(cmd);
+                        cmd_queue.pop_front();
+                        cmd_offset = 0;
+                }
+                else if (num < len)
+                {
+                        // port is full, try again on the next tick
+                        return;
+                }
+        }
+}
+
+
+void XBootUploader::finish(bool success, Glib::ustring msg)
+{
+        state = XS_Idle;
+        
+        c_timer.disconnect();
+        
+        cmd_queue.clear();
+        reply_queue.clear();
+        rx_data.clear();
+        
+        if (debug)
+                std::cout << "[XBootUploader] " << msg << std::endl;
+        
+        m_signal_done.emit(success, msg);
+}
+
+
+uint16_t XBootUploader::crc16_update(uint16_t crc, uint8_t a)
+{
+        // same as _crc16_update from avr-libc
+        crc ^= a;
+        for (int i = 0; i < 8; i++)
+        {
+                if (crc & 1)
+                        crc = (crc >> 1) ^ 0xA001;
+                else
+                        crc = (crc >> 1);
+        }
+        return crc;
+}
@@ -0,0 +1,149 @@
+/************************************************************************/
+/* XBootUploader                                                        */
+/*                                                                      */
+/* XBoot Firmware Uploader                                              */
+/*                                                                      */
+/* XBootUploader.h                                                      */
+/*                                                                      */
+/* Alex Forencich <alex@alexforencich.com>                              */
+/*                                                                      */
+/* Copyright (c) 2012 Alex Forencich                                    */
+/*                                                                      */
+/* Permission is hereby granted, free of charge, to any person          */
+/* obtaining a copy of this software and associated documentation       */
+/* files(the "Software"), to deal in the Software without restriction,  */
+/* including without limitation the rights to use, copy, modify, merge, */
+/* publish, distribute, sublicense, and/or sell copies of the Software, */
+/* and to permit persons to whom the Software is furnished to do so,    */
+/* subject to the following conditions:                                 */
+/*                                                                      */
+/* The above copyright notice and this permission notice shall be       */
+/* included in all copies or substantial portions of the Software.      */
+/*                                                                      */
+/* THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,      */
+/* EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF   */
+/* MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND                */
+/* NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS  */
+/* BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN   */
+/* ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN    */
+/* CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE     */
+/* SOFTWARE.                                                            */
+/*                                                                      */
+/************************************************************************/
+
+#ifndef __XBOOTUPLOADER_H
+#define __XBOOTUPLOADER_H
+
+#include <gtkmm.h>
+
+#include "SerialInterface.h"
+
+#include <string>
+#include <tr1/memory>
+#include <vector>
+#include <deque>
+#include <inttypes.h>
+
+// XBootUploader class
+// Programs the flash through the XBoot AVR109 bootloader.
+// Commands are pipelined: while the bootloader is busy writing a page,
+// only as many bytes as fit in the UART receive FIFO are sent ahead.
+class XBootUploader
+{
+public:
+        XBootUploader();
+        virtual ~XBootUploader();
+        
+        void set_serial_interface(std::tr1::shared_ptr<SerialInterface> si);
+        void clear_serial_interface();
+        bool has_serial_interface();
+        
+        bool start(std::vector<uint8_t> &image);
+        void cancel();
+        bool is_running();
+        
+        // bytes sent ahead of a busy bootloader
+        int set_slack(int s);
+        int get_slack();
+        
+        bool set_debug(bool d);
+        bool get_debug();
+        
+        sigc::signal<void, double> signal_progress();
+        sigc::signal<void, bool, Glib::ustring> signal_done();
+        
+protected:
+        // Reply types
+        typedef enum
+        {
+                XR_Ack = 0,
+                XR_BlockSize = 1,
+                XR_Signature = 2,
+                XR_CRC = 3,
+        }
+        XBootReply;
+        
+        // Upload state
+        typedef enum
+        {
+                XS_Idle = 0,
+                XS_Sync = 1,
+                XS_Info = 2,
+                XS_Program = 3,
+        }
+        XBootState;
+        
+        struct Command
+        {
+                std::string data;
+                XBootReply reply;
+                size_t reply_len;
+                bool busy;
+                size_t end_pos;
+                size_t payload;
+        };
+        
+        void on_receive_data();
+        bool on_timer();
+        
+        void queue_command(std::string data, XBootReply reply, size_t reply_len, bool busy, size_t payload = 0);
+        void queue_program();
+        bool handle_reply(Command &cmd, std::string &r);
+        void pump();
+        void finish(bool success, Glib::ustring msg);
+        
+        static uint16_t crc16_update(uint16_t crc, uint8_t a);
+        
+        std::tr1::shared_ptr<SerialInterface> ser_int;
+        
+        std::vector<uint8_t> image;
+        
+        XBootState state;
+        
+        std::deque<Command> cmd_queue;
+        std::deque<Command> reply_queue;
+        std::string rx_data;
+        size_t cmd_offset;
+        size_t total_sent;
+        
+        int slack;
+        int sync_ticks;
+        int idle_ticks;
+        
+        size_t block_size;
+        size_t app_size;
+        size_t payload_total;
+        size_t payload_done;
+        
+        Glib::Timer timer;
+        
+        bool debug;
+        
+        sigc::signal<void, double> m_signal_progress;
+        sigc::signal<void, bool, Glib::ustring> m_signal_done;
+        
+        sigc::connection c_port_receive_data;
+        sigc::connection c_timer;
+};
+
+#endif //__XBOOTUPLOADER_H
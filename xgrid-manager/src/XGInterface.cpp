@@ -131,6 +131,28 @@ void XGInterface::send_packet(XGPacket &pkt)
 }
 
 
+void XGInterface::split_aggregate(XGPacket &pkt)
+{
+        size_t ptr = 0;
+        
+        // each item is a length byte followed by a bare packet
+        while (ptr < pkt.data.size())
+        {
+                XGPacket sub;
+                size_t len = pkt.data[ptr++];
+                size_t bytes_read;
+                
+                if (len > pkt.data.size() - ptr)
+                        break;
+                
+                if (sub.read_packet_bare(&pkt.data[ptr], len, bytes_read) && sub.decode_packet())
+                        m_signal_receive_packet.emit(sub);
+                
+                ptr += len;
+        }
+}
+
+
 void XGInterface::set_id(uint16_t id)
 {
         my_id = id;
@@ -226,7 +248,11 @@ void XGInterface::on_receive_data()
                 if (pkt.read_packet(read_data_queue, len))
                 {
                         pkt.decode_packet();
-                        m_signal_receive_packet.emit(pkt);
+                        
+                        if (pkt.type == XGRID_PKT_AGGREGATE)
+                                split_aggregate(pkt);
+                        else
+                                m_signal_receive_packet.emit(pkt);
                 }
                 for (int i = 0; i < len; i++)
                         read_data_queue.pop_front();
@@ -72,6 +72,7 @@ public:
         
 protected:
         void on_receive_data();
+        void split_aggregate(XGPacket &pkt);
         
         std::tr1::shared_ptr<SerialInterface> ser_int;
         
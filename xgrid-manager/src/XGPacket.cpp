@@ -53,11 +53,14 @@ void XGPacket::zero()
         seq = 0;
         flags = 0;
         radius = 0;
+        dest_id = 0;
         data.clear();
 }
 
 uint16_t XGPacket::get_length()
 {
+        if (flags & XGRID_PKT_FLAG_UNICAST)
+                return data.size()+sizeof(xgrid_header_t)+2;
         return data.size()+sizeof(xgrid_header_t);
 }
 
@@ -199,6 +202,12 @@ bool XGPacket::build_packet()
         payload.push_back(flags);
         payload.push_back(radius);
         
+        if (flags & XGRID_PKT_FLAG_UNICAST)
+        {
+                payload.push_back(dest_id);
+                payload.push_back(dest_id >> 8);
+        }
+        
         for (int i = 0; i < data.size(); i++)
         {
                 payload.push_back(data[i]);
@@ -218,8 +227,18 @@ bool XGPacket::decode_packet()
         flags = payload[4];
         radius = payload[5];
         
+        int offset = sizeof(xgrid_header_t);
+        
+        if (flags & XGRID_PKT_FLAG_UNICAST)
+        {
+                if (payload.size() < sizeof(xgrid_header_t) + 2)
+                        return false;
+                dest_id = read_payload_uint16(offset);
+                offset += 2;
+        }
+        
         data.clear();
-        for (int i = sizeof(xgrid_header_t); i < payload.size(); i++)
+        for (int i = offset; i < payload.size(); i++)
         {
                 data.push_back(payload[i]);
         }
@@ -238,6 +257,8 @@ std::string XGPacket::get_desc()
         desc << "  Seq: " << std::dec << (int)seq << std::endl;
         desc << "  Flags: 0x" << std::setfill('0') << std::setw(2) << std::hex << (int)flags << std::endl;
         desc << "  Radius: " << std::dec << (int)radius << std::endl;
+        if (flags & XGRID_PKT_FLAG_UNICAST)
+                desc << "  Dest ID: 0x" << std::setfill('0') << std::setw(4) << std::hex << (int)dest_id << std::endl;
         
         desc << "  Data (hex):";
         for (int i = 0; i < data.size(); i++)
@@ -70,6 +70,7 @@ public:
         uint8_t seq;
         uint8_t flags;
         uint8_t radius;
+        uint16_t dest_id;
         
         std::vector<uint8_t> data;
         
@@ -45,7 +45,7 @@ XGPacketBuilder::XGPacketBuilder()
 {
         updating_fields = false;
         
-        tbl.resize(7, 2);
+        tbl.resize(8, 2);
         tbl.set_col_spacings(10);
         tbl.set_row_spacings(5);
         pack_start(tbl, false, false, 0);
@@ -86,22 +86,29 @@ XGPacketBuilder::XGPacketBuilder()
         ent_radius.signal_changed().connect( sigc::mem_fun(*this, &XGPacketBuilder::on_radius_change) );
         tbl.attach(ent_radius, 1, 2, 4, 5);
         
+        lbl_dest.set_label("Dest ID:");
+        tbl.attach(lbl_dest, 0, 1, 5, 6);
+        
+        ent_dest.set_text("0x0000");
+        ent_dest.signal_changed().connect( sigc::mem_fun(*this, &XGPacketBuilder::on_dest_change) );
+        tbl.attach(ent_dest, 1, 2, 5, 6);
+        
         lbl_data.set_label("Data:");
-        tbl.attach(lbl_data, 0, 1, 5, 6);
+        tbl.attach(lbl_data, 0, 1, 6, 7);
         
         tv_data.set_wrap_mode(Gtk::WRAP_WORD_CHAR);
         tv_data.get_buffer()->signal_changed().connect( sigc::mem_fun(*this, &XGPacketBuilder::on_data_change) );
         sw_data.add(tv_data);
         sw_data.set_shadow_type(Gtk::SHADOW_ETCHED_IN);
         sw_data.set_policy(Gtk::POLICY_AUTOMATIC, Gtk::POLICY_AUTOMATIC);
-        tbl.attach(sw_data, 1, 2, 5, 7);
+        tbl.attach(sw_data, 1, 2, 6, 8);
         
         hex_data.set_label("Hex");
         hex_data.set_active(true);
         hex_data.signal_toggled().connect( sigc::mem_fun(*this, &XGPacketBuilder::on_hex_data_toggle) );
         al_hex_data.add(hex_data);
         al_hex_data.set(Gtk::ALIGN_CENTER, Gtk::ALIGN_CENTER, 0, 0);
-        tbl.attach(al_hex_data, 0, 1, 6, 7);
+        tbl.attach(al_hex_data, 0, 1, 7, 8);
         
 }
 
@@ -157,6 +164,15 @@ void XGPacketBuilder::on_radius_change()
 }
 
 
+void XGPacketBuilder::on_dest_change()
+{
+        if (updating_fields)
+                return;
+        
+        pkt.dest_id = parse_number(ent_dest.get_text());
+}
+
+
 void XGPacketBuilder::on_data_change()
 {
         if (updating_fields)
@@ -263,6 +279,7 @@ void XGPacketBuilder::read_packet()
         ent_seq.set_text(Glib::ustring::format(std::dec, (int)pkt.seq));
         ent_flags.set_text("0x" + Glib::ustring::format(std::setfill(L'0'), std::setw(2), std::hex, (int)pkt.flags));
         ent_radius.set_text(Glib::ustring::format(std::dec, (int)pkt.radius));
+        ent_dest.set_text("0x" + Glib::ustring::format(std::setfill(L'0'), std::setw(4), std::hex, (int)pkt.dest_id));
         
         updating_fields = false;
         
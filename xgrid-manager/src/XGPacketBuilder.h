@@ -59,6 +59,7 @@ protected:
         void on_seq_change();
         void on_flags_change();
         void on_radius_change();
+        void on_dest_change();
         void on_data_change();
         void on_hex_data_toggle();
         
@@ -79,6 +80,8 @@ protected:
         Gtk::Entry ent_flags;
         Gtk::Label lbl_radius;
         Gtk::Entry ent_radius;
+        Gtk::Label lbl_dest;
+        Gtk::Entry ent_dest;
         Gtk::Label lbl_data;
         Gtk::ScrolledWindow sw_data;
         Gtk::TextView tv_data;
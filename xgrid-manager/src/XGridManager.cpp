@@ -32,6 +32,7 @@
 /************************************************************************/
 
 #include "XGridManager.h"
+#include "IHexFile.h"
 
 #include <stdio.h>
 #include <stdlib.h>
@@ -58,6 +59,12 @@ XGridManager::XGridManager()
         
         file_menu_item.set_submenu(file_menu);
         
+        file_upload_item.set_label("Upload Firmware...");
+        file_upload_item.signal_activate().connect( sigc::mem_fun(*this, &XGridManager::on_file_upload_item_activate) );
+        file_menu.append(file_upload_item);
+        
+        file_menu.append(file_sep_item);
+        
         file_quit_item.set_label(Gtk::Stock::QUIT.id);
         file_quit_item.set_use_stock(true);
         file_quit_item.signal_activate().connect( sigc::mem_fun(*this, &XGridManager::on_file_quit_item_activate) );
@@ -147,6 +154,108 @@ XGridManager::XGridManager()
         btn_node_reset.signal_clicked().connect( sigc::mem_fun(*this, &XGridManager::on_btn_node_reset_click) );
         bbox_node_info.add(btn_node_reset);
         
+        // Topology tab
+        note.append_page(vbox_topology, "Topology");
+        
+        tv_topology_tm = Gtk::ListStore::create(cTopologyModel);
+        tv_topology.set_model(tv_topology_tm);
+        
+        tv_topology.append_column("Node", cTopologyModel.node_id);
+        tv_topology.append_column("Load", cTopologyModel.node_queue);
+        tv_topology.append_column("Port", cTopologyModel.port);
+        tv_topology.append_column("Neighbor", cTopologyModel.neighbor_id);
+        tv_topology.append_column("RTT (ms)", cTopologyModel.rtt);
+        tv_topology.append_column("Loss (%)", cTopologyModel.loss);
+        tv_topology.append_column("Queue", cTopologyModel.queue);
+        tv_topology.append_column("Errors", cTopologyModel.errors);
+        
+        tv_topology.modify_font(Pango::FontDescription("monospace"));
+        
+        sw_topology.add(tv_topology);
+        sw_topology.set_policy(Gtk::POLICY_AUTOMATIC, Gtk::POLICY_AUTOMATIC);
+        vbox_topology.pack_start(sw_topology, true, true, 0);
+        
+        bbox_topology.set_layout(Gtk::BUTTONBOX_SPREAD);
+        bbox_topology.set_border_width(5);
+        vbox_topology.pack_start(bbox_topology, false, true, 0);
+        
+        btn_topology_collect.set_label("Collect");
+        btn_topology_collect.signal_clicked().connect( sigc::mem_fun(*this, &XGridManager::on_btn_topology_collect_click) );
+        bbox_topology.add(btn_topology_collect);
+        
+        btn_topology_clear.set_label("Clear");
+        btn_topology_clear.signal_clicked().connect( sigc::mem_fun(*this, &XGridManager::on_btn_topology_clear_click) );
+        bbox_topology.add(btn_topology_clear);
+        
+        // Statistics tab
+        note.append_page(vbox_stats, "Statistics");
+        
+        vbox_stats.pack_start(vpane_stats, true, true, 0);
+        
+        tv_stats_port_tm = Gtk::ListStore::create(cStatsPortModel);
+        tv_stats_port.set_model(tv_stats_port_tm);
+        
+        tv_stats_port.append_column("Node", cStatsPortModel.node_id);
+        tv_stats_port.append_column("Port", cStatsPortModel.port);
+        tv_stats_port.append_column("Bytes In", cStatsPortModel.bytes_in);
+        tv_stats_port.append_column("Bytes Out", cStatsPortModel.bytes_out);
+        tv_stats_port.append_column("In (B/s)", cStatsPortModel.rate_in);
+        tv_stats_port.append_column("Out (B/s)", cStatsPortModel.rate_out);
+        tv_stats_port.append_column("Pkts In", cStatsPortModel.packets_in);
+        tv_stats_port.append_column("Pkts Out", cStatsPortModel.packets_out);
+        tv_stats_port.append_column("Fwd", cStatsPortModel.forwarded);
+        tv_stats_port.append_column("Dups", cStatsPortModel.duplicates);
+        tv_stats_port.append_column("Alloc Fail", cStatsPortModel.alloc_fail);
+        tv_stats_port.append_column("Resync", cStatsPortModel.resync_bytes);
+        tv_stats_port.append_column("Errors", cStatsPortModel.rx_errors);
+        tv_stats_port.append_column("Timeouts", cStatsPortModel.rx_timeouts);
+        tv_stats_port.append_column("Overruns", cStatsPortModel.rx_overruns);
+        tv_stats_port.append_column("Max Wait (ms)", cStatsPortModel.max_tx_wait);
+        tv_stats_port.append_column("No Route", cStatsPortModel.no_route);
+        
+        tv_stats_port.modify_font(Pango::FontDescription("monospace"));
+        
+        sw_stats_port.add(tv_stats_port);
+        sw_stats_port.set_policy(Gtk::POLICY_AUTOMATIC, Gtk::POLICY_AUTOMATIC);
+        vpane_stats.pack1(sw_stats_port, true, true);
+        
+        tv_stats_buffer_tm = Gtk::ListStore::create(cStatsBufferModel);
+        tv_stats_buffer.set_model(tv_stats_buffer_tm);
+        
+        tv_stats_buffer.append_column("Node", cStatsBufferModel.node_id);
+        tv_stats_buffer.append_column("Class", cStatsBufferModel.buffer_class);
+        tv_stats_buffer.append_column("Count", cStatsBufferModel.count);
+        tv_stats_buffer.append_column("Max Used", cStatsBufferModel.max_used);
+        tv_stats_buffer.append_column("Allocs", cStatsBufferModel.allocs);
+        tv_stats_buffer.append_column("Alloc Fail", cStatsBufferModel.alloc_fail);
+        
+        tv_stats_buffer.modify_font(Pango::FontDescription("monospace"));
+        
+        sw_stats_buffer.add(tv_stats_buffer);
+        sw_stats_buffer.set_size_request(-1, 100);
+        sw_stats_buffer.set_policy(Gtk::POLICY_AUTOMATIC, Gtk::POLICY_AUTOMATIC);
+        vpane_stats.pack2(sw_stats_buffer, false, false);
+        
+        lbl_stats_jobs.set_label("Jobs: none");
+        lbl_stats_jobs.set_alignment(0, 0.5);
+        vbox_stats.pack_start(lbl_stats_jobs, false, true, 5);
+        
+        bbox_stats.set_layout(Gtk::BUTTONBOX_SPREAD);
+        bbox_stats.set_border_width(5);
+        vbox_stats.pack_start(bbox_stats, false, true, 0);
+        
+        btn_stats_refresh.set_label("Refresh");
+        btn_stats_refresh.signal_clicked().connect( sigc::mem_fun(*this, &XGridManager::on_btn_stats_refresh_click) );
+        bbox_stats.add(btn_stats_refresh);
+        
+        btn_stats_reset.set_label("Reset Counters");
+        btn_stats_reset.signal_clicked().connect( sigc::mem_fun(*this, &XGridManager::on_btn_stats_reset_click) );
+        bbox_stats.add(btn_stats_reset);
+        
+        btn_stats_clear.set_label("Clear");
+        btn_stats_clear.signal_clicked().connect( sigc::mem_fun(*this, &XGridManager::on_btn_stats_clear_click) );
+        bbox_stats.add(btn_stats_clear);
+        
         // Packet builder tab
         note.append_page(vbox_pkt_builder, "Packet Builder");
         
@@ -206,6 +315,9 @@ XGridManager::XGridManager()
         
         xg_int.signal_receive_packet().connect( sigc::mem_fun(*this, &XGridManager::on_receive_packet) );
         
+        uploader.signal_progress().connect( sigc::mem_fun(*this, &XGridManager::on_upload_progress) );
+        uploader.signal_done().connect( sigc::mem_fun(*this, &XGridManager::on_upload_done) );
+        
         show_all_children();
 }
 
@@ -216,6 +328,55 @@ XGridManager::~XGridManager()
 }
 
 
+void XGridManager::on_file_upload_item_activate()
+{
+        IHexFile hex;
+        
+        if (!ser_int->is_open())
+        {
+                status.pop();
+                status.push("Upload: port not open");
+                return;
+        }
+        
+        Gtk::FileChooserDialog dlg(*this, "Upload Firmware", Gtk::FILE_CHOOSER_ACTION_OPEN);
+        dlg.add_button(Gtk::Stock::CANCEL, Gtk::RESPONSE_CANCEL);
+        dlg.add_button(Gtk::Stock::OPEN, Gtk::RESPONSE_OK);
+        
+        Gtk::FileFilter filter_hex;
+        filter_hex.set_name("Intel HEX files");
+        filter_hex.add_pattern("*.hex");
+        dlg.add_filter(filter_hex);
+        
+        if (dlg.run() != Gtk::RESPONSE_OK)
+                return;
+        
+        dlg.hide();
+        
+        if (!hex.load(dlg.get_filename()))
+        {
+                status.pop();
+                status.push("Upload: " + hex.get_error());
+                return;
+        }
+        
+        // bootloader gets the port to itself while uploading
+        xg_int.clear_serial_interface();
+        uploader.set_serial_interface(ser_int);
+        
+        if (!uploader.start(hex.data))
+        {
+                on_upload_done(false, "unable to start");
+                return;
+        }
+        
+        file_upload_item.set_sensitive(false);
+        
+        status.pop();
+        status.push("Upload: entering bootloader");
+}
+
+
 void XGridManager::on_file_quit_item_activate()
 {
         gtk_main_quit();
@@ -320,6 +481,176 @@ void XGridManager::on_btn_node_reset_click()
 }
 
 
+void XGridManager::on_btn_topology_collect_click()
+{
+        XGPacket pkt;
+        
+        tv_topology_tm->clear();
+        
+        // flood request across the grid, replies
+        // come back with the same radius
+        pkt.type = XGRID_PKT_TOPOLOGY_REQUEST;
+        pkt.flags = 0;
+        pkt.radius = XGRID_TOPOLOGY_RADIUS;
+        pkt.data.push_back(XGRID_TOPOLOGY_RADIUS);
+        
+        send_packet(pkt);
+}
+
+
+void XGridManager::on_btn_topology_clear_click()
+{
+        tv_topology_tm->clear();
+}
+
+
+void XGridManager::on_btn_stats_refresh_click()
+{
+        send_stats_request(0);
+}
+
+
+void XGridManager::on_btn_stats_reset_click()
+{
+        send_stats_request(XGRID_STATS_FLAG_RESET);
+        
+        // counters restart from zero
+        stats_samples.clear();
+}
+
+
+void XGridManager::on_btn_stats_clear_click()
+{
+        tv_stats_port_tm->clear();
+        tv_stats_buffer_tm->clear();
+        stats_samples.clear();
+}
+
+
+void XGridManager::send_stats_request(uint8_t flags)
+{
+        XGPacket pkt;
+        
+        pkt.type = XGRID_PKT_STATS_REQUEST;
+        pkt.flags = 0;
+        pkt.radius = XGRID_TOPOLOGY_RADIUS;
+        pkt.data.push_back(flags);
+        pkt.data.push_back(XGRID_TOPOLOGY_RADIUS);
+        
+        send_packet(pkt);
+}
+
+
+void XGridManager::update_stats(XGPacket &pkt)
+{
+        if (pkt.data.size() < sizeof(xgrid_pkt_stats_reply_t))
+                return;
+        
+        xgrid_pkt_stats_reply_t *r = (xgrid_pkt_stats_reply_t *)&(pkt.data[0]);
+        Glib::ustring node_id = Glib::ustring::format(std::hex, std::setfill(L'0'), std::setw(4), pkt.source_id);
+        Gtk::TreeModel::iterator it;
+        
+        // buffer classes come in their own reply
+        if (r->part == XGRID_STATS_PART_BUFFERS)
+        {
+                if (pkt.data.size() < sizeof(xgrid_pkt_stats_reply_t) + r->class_cnt * sizeof(xgrid_pkt_stats_buffer_t))
+                        return;
+                
+                xgrid_pkt_stats_buffer_t *b = (xgrid_pkt_stats_buffer_t *)(r->data);
+                
+                // replace any old entries for this node
+                it = tv_stats_buffer_tm->children().begin();
+                while (it != tv_stats_buffer_tm->children().end())
+                {
+                        Glib::ustring id = (*it)[cStatsBufferModel.node_id];
+                        
+                        if (id == node_id)
+                                it = tv_stats_buffer_tm->erase(it);
+                        else
+                                ++it;
+                }
+                
+                for (int i = 0; i < r->class_cnt; i++)
+                {
+                        Gtk::TreeModel::Row row = *(tv_stats_buffer_tm->append());
+                        row[cStatsBufferModel.node_id] = node_id;
+                        row[cStatsBufferModel.buffer_class] = i == 0 ? "small" : (i == 1 ? "large" : Glib::ustring::format(i));
+                        row[cStatsBufferModel.count] = b[i].count;
+                        row[cStatsBufferModel.max_used] = b[i].max_used;
+                        row[cStatsBufferModel.allocs] = b[i].allocs;
+                        row[cStatsBufferModel.alloc_fail] = b[i].alloc_fail;
+                }
+                
+                return;
+        }
+        
+        // one port per reply
+        if (pkt.data.size() < sizeof(xgrid_pkt_stats_reply_t) + sizeof(xgrid_pkt_stats_port_t))
+                return;
+        
+        xgrid_pkt_stats_port_t *p = (xgrid_pkt_stats_port_t *)(r->data);
+        int port = r->part;
+        
+        // replace any old entry for this port
+        it = tv_stats_port_tm->children().begin();
+        while (it != tv_stats_port_tm->children().end())
+        {
+                Glib::ustring id = (*it)[cStatsPortModel.node_id];
+                int old_port = (*it)[cStatsPortModel.port];
+                
+                if (id == node_id && old_port == port)
+                        it = tv_stats_port_tm->erase(it);
+                else
+                        ++it;
+        }
+        
+        // rates from previous sample
+        uint32_t key = ((uint32_t)pkt.source_id << 8) | port;
+        std::map<uint32_t, StatsSample>::iterator prev = stats_samples.find(key);
+        uint16_t dt = 0;
+        
+        if (prev != stats_samples.end())
+                dt = r->ticks - prev->second.ticks;
+        
+        Gtk::TreeModel::Row row = *(tv_stats_port_tm->append());
+        row[cStatsPortModel.node_id] = node_id;
+        row[cStatsPortModel.port] = port;
+        row[cStatsPortModel.bytes_in] = p->bytes_in;
+        row[cStatsPortModel.bytes_out] = p->bytes_out;
+        row[cStatsPortModel.packets_in] = p->packets_in;
+        row[cStatsPortModel.packets_out] = p->packets_out;
+        row[cStatsPortModel.forwarded] = p->forwarded;
+        row[cStatsPortModel.duplicates] = p->duplicates;
+        row[cStatsPortModel.alloc_fail] = p->alloc_fail;
+        row[cStatsPortModel.resync_bytes] = p->resync_bytes;
+        row[cStatsPortModel.rx_errors] = p->rx_errors;
+        row[cStatsPortModel.rx_timeouts] = p->rx_timeouts;
+        row[cStatsPortModel.rx_overruns] = p->rx_overruns;
+        row[cStatsPortModel.max_tx_wait] = p->max_tx_wait;
+        row[cStatsPortModel.no_route] = p->no_route;
+        
+        if (dt > 0 && p->bytes_in >= prev->second.bytes_in && p->bytes_out >= prev->second.bytes_out)
+        {
+                row[cStatsPortModel.rate_in] = Glib::ustring::format(std::fixed, std::setprecision(1),
+                        (p->bytes_in - prev->second.bytes_in) * 1000.0 / dt);
+                row[cStatsPortModel.rate_out] = Glib::ustring::format(std::fixed, std::setprecision(1),
+                        (p->bytes_out - prev->second.bytes_out) * 1000.0 / dt);
+        }
+        else
+        {
+                row[cStatsPortModel.rate_in] = "-";
+                row[cStatsPortModel.rate_out] = "-";
+        }
+        
+        StatsSample sample;
+        sample.ticks = r->ticks;
+        sample.bytes_in = p->bytes_in;
+        sample.bytes_out = p->bytes_out;
+        
+        stats_samples[key] = sample;
+}
+
+
 void XGridManager::send_packet(XGPacket &pkt)
 {
         xg_int.send_packet(pkt);
@@ -381,6 +712,76 @@ void XGridManager::on_receive_packet(XGPacket pkt)
                 lbl_node_build.set_label("Build: " + Glib::ustring::format(r->build));
                 lbl_node_crc.set_label("CRC: 0x" + Glib::ustring::format(std::hex, std::setfill(L'0'), std::setw(4), r->crc));
         }
+        else if (pkt.type == XGRID_PKT_STATS_REPLY)
+        {
+                update_stats(pkt);
+        }
+        else if (pkt.type == XGRID_PKT_JOB_REPORT && pkt.data.size() >= sizeof(xgrid_pkt_job_report_t))
+        {
+                // decode job progress report
+                xgrid_pkt_job_report_t *r = (xgrid_pkt_job_report_t *)&(pkt.data[0]);
+                
+                lbl_stats_jobs.set_label("Jobs: job " + Glib::ustring::format(r->job_id) +
+                        " from " + Glib::ustring::format(std::hex, std::setfill(L'0'), std::setw(4), pkt.source_id) +
+                        ", " + Glib::ustring::format(r->done) + "/" + Glib::ustring::format(r->items) + " items" +
+                        ", " + Glib::ustring::format(r->rate) + " items/s" +
+                        ", " + Glib::ustring::format((int)r->workers) + " workers" +
+                        ", " + Glib::ustring::format(r->reassigned) + " reassigned");
+        }
+        else if (pkt.type == XGRID_PKT_TOPOLOGY_REPLY && pkt.data.size() >= sizeof(xgrid_pkt_topology_reply_t))
+        {
+                // decode topology reply packet
+                xgrid_pkt_topology_reply_t *r = (xgrid_pkt_topology_reply_t *)&(pkt.data[0]);
+                int cnt = (pkt.data.size() - sizeof(xgrid_pkt_topology_reply_t)) / sizeof(xgrid_pkt_topology_entry_t);
+                Glib::ustring node_id = Glib::ustring::format(std::hex, std::setfill(L'0'), std::setw(4), pkt.source_id);
+                
+                // replace any old entries for this node
+                Gtk::TreeModel::iterator it = tv_topology_tm->children().begin();
+                while (it != tv_topology_tm->children().end())
+                {
+                        Glib::ustring id = (*it)[cTopologyModel.node_id];
+                        
+                        if (id == node_id)
+                                it = tv_topology_tm->erase(it);
+                        else
+                                ++it;
+                }
+                
+                for (int i = 0; i < cnt; i++)
+                {
+                        xgrid_pkt_topology_entry_t *e = &(r->neighbors[i]);
+                        
+                        Gtk::TreeModel::Row row = *(tv_topology_tm->append());
+                        row[cTopologyModel.node_id] = node_id;
+                        row[cTopologyModel.node_queue] = r->queue;
+                        row[cTopologyModel.port] = e->port;
+                        row[cTopologyModel.neighbor_id] = Glib::ustring::format(std::hex, std::setfill(L'0'), std::setw(4), e->id);
+                        row[cTopologyModel.rtt] = e->rtt;
+                        row[cTopologyModel.loss] = e->loss;
+                        row[cTopologyModel.queue] = e->queue;
+                        row[cTopologyModel.errors] = e->errors;
+                }
+        }
+}
+
+
+void XGridManager::on_upload_progress(double fraction)
+{
+        status.pop();
+        status.push("Upload: " + Glib::ustring::format((int)(fraction * 100)) + "%");
+}
+
+
+void XGridManager::on_upload_done(bool success, Glib::ustring msg)
+{
+        uploader.clear_serial_interface();
+        xg_int.set_serial_interface(ser_int);
+        xg_int.reset_buffer();
+        
+        file_upload_item.set_sensitive(true);
+        
+        status.pop();
+        status.push(Glib::ustring(success ? "Upload complete: " : "Upload failed: ") + msg);
 }
 
 
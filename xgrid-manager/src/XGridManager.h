@@ -37,12 +37,14 @@
 #include <gtkmm.h>
 
 #include <tr1/memory>
+#include <map>
 
 #include "PortConfig.h"
 #include "SerialInterface.h"
 #include "XGPacket.h"
 #include "XGInterface.h"
 #include "XGPacketBuilder.h"
+#include "XBootUploader.h"
 
 // XGridManager class
 class XGridManager : public Gtk::Window
@@ -53,6 +55,7 @@ public:
         
 protected:
         //Signal handlers:
+        void on_file_upload_item_activate();
         void on_file_quit_item_activate();
         void on_config_port_item_activate();
         void on_config_close_port_item_activate();
@@ -67,6 +70,16 @@ protected:
         void on_btn_node_query_click();
         void on_btn_node_reset_click();
         
+        void on_btn_topology_collect_click();
+        void on_btn_topology_clear_click();
+        
+        void on_btn_stats_refresh_click();
+        void on_btn_stats_reset_click();
+        void on_btn_stats_clear_click();
+        
+        void send_stats_request(uint8_t flags);
+        void update_stats(XGPacket &pkt);
+        
         void send_packet(XGPacket &pkt);
         
         void on_port_open();
@@ -74,6 +87,9 @@ protected:
         
         void on_receive_packet(XGPacket pkt);
         
+        void on_upload_progress(double fraction);
+        void on_upload_done(bool success, Glib::ustring msg);
+        
         void open_port();
         void close_port();
         
@@ -105,6 +121,118 @@ protected:
         
         Glib::RefPtr<Gtk::ListStore> tv_pkt_log_tm;
         
+        class TopologyModel : public Gtk::TreeModel::ColumnRecord
+        {
+        public:
+                TopologyModel()
+                {
+                        add(node_id);
+                        add(node_queue);
+                        add(port);
+                        add(neighbor_id);
+                        add(rtt);
+                        add(loss);
+                        add(queue);
+                        add(errors);
+                }
+                
+                Gtk::TreeModelColumn<Glib::ustring> node_id;
+                Gtk::TreeModelColumn<int> node_queue;
+                Gtk::TreeModelColumn<int> port;
+                Gtk::TreeModelColumn<Glib::ustring> neighbor_id;
+                Gtk::TreeModelColumn<int> rtt;
+                Gtk::TreeModelColumn<int> loss;
+                Gtk::TreeModelColumn<int> queue;
+                Gtk::TreeModelColumn<int> errors;
+        };
+        
+        TopologyModel cTopologyModel;
+        
+        Glib::RefPtr<Gtk::ListStore> tv_topology_tm;
+        
+        class StatsPortModel : public Gtk::TreeModel::ColumnRecord
+        {
+        public:
+                StatsPortModel()
+                {
+                        add(node_id);
+                        add(port);
+                        add(bytes_in);
+                        add(bytes_out);
+                        add(rate_in);
+                        add(rate_out);
+                        add(packets_in);
+                        add(packets_out);
+                        add(forwarded);
+                        add(duplicates);
+                        add(alloc_fail);
+                        add(resync_bytes);
+                        add(rx_errors);
+                        add(rx_timeouts);
+                        add(rx_overruns);
+                        add(max_tx_wait);
+                        add(no_route);
+                }
+                
+                Gtk::TreeModelColumn<Glib::ustring> node_id;
+                Gtk::TreeModelColumn<int> port;
+                Gtk::TreeModelColumn<unsigned int> bytes_in;
+                Gtk::TreeModelColumn<unsigned int> bytes_out;
+                Gtk::TreeModelColumn<Glib::ustring> rate_in;
+                Gtk::TreeModelColumn<Glib::ustring> rate_out;
+                Gtk::TreeModelColumn<unsigned int> packets_in;
+                Gtk::TreeModelColumn<unsigned int> packets_out;
+                Gtk::TreeModelColumn<unsigned int> forwarded;
+                Gtk::TreeModelColumn<unsigned int> duplicates;
+                Gtk::TreeModelColumn<unsigned int> alloc_fail;
+                Gtk::TreeModelColumn<unsigned int> resync_bytes;
+                Gtk::TreeModelColumn<unsigned int> rx_errors;
+                Gtk::TreeModelColumn<unsigned int> rx_timeouts;
+                Gtk::TreeModelColumn<unsigned int> rx_overruns;
+                Gtk::TreeModelColumn<unsigned int> max_tx_wait;
+                Gtk::TreeModelColumn<unsigned int> no_route;
+        };
+        
+        StatsPortModel cStatsPortModel;
+        
+        Glib::RefPtr<Gtk::ListStore> tv_stats_port_tm;
+        
+        class StatsBufferModel : public Gtk::TreeModel::ColumnRecord
+        {
+        public:
+                StatsBufferModel()
+                {
+                        add(node_id);
+                        add(buffer_class);
+                        add(count);
+                        add(max_used);
+                        add(allocs);
+                        add(alloc_fail);
+                }
+                
+                Gtk::TreeModelColumn<Glib::ustring> node_id;
+                Gtk::TreeModelColumn<Glib::ustring> buffer_class;
+                Gtk::TreeModelColumn<unsigned int> count;
+                Gtk::TreeModelColumn<unsigned int> max_used;
+                Gtk::TreeModelColumn<unsigned int> allocs;
+                Gtk::TreeModelColumn<unsigned int> alloc_fail;
+        };
+        
+        StatsBufferModel cStatsBufferModel;
+        
+        Glib::RefPtr<Gtk::ListStore> tv_stats_buffer_tm;
+        
+        // previous counter samples for rate calculation,
+        // keyed by node ID in the high bits and port
+        typedef struct
+        {
+                uint16_t ticks;
+                uint32_t bytes_in;
+                uint32_t bytes_out;
+        } StatsSample;
+        
+        std::map<uint32_t, StatsSample> stats_samples;
+        
         //Child widgets:
         // window
         Gtk::VBox vbox1;
@@ -112,6 +240,8 @@ protected:
         Gtk::MenuBar main_menu;
         Gtk::MenuItem file_menu_item;
         Gtk::Menu file_menu;
+        Gtk::ImageMenuItem file_upload_item;
+        Gtk::SeparatorMenuItem file_sep_item;
         Gtk::ImageMenuItem file_quit_item;
         Gtk::MenuItem view_menu_item;
         Gtk::Menu view_menu;
@@ -137,6 +267,25 @@ protected:
         Gtk::HButtonBox bbox_node_info;
         Gtk::Button btn_node_query;
         Gtk::Button btn_node_reset;
+        // topology
+        Gtk::VBox vbox_topology;
+        Gtk::ScrolledWindow sw_topology;
+        Gtk::TreeView tv_topology;
+        Gtk::HButtonBox bbox_topology;
+        Gtk::Button btn_topology_collect;
+        Gtk::Button btn_topology_clear;
+        // statistics
+        Gtk::VBox vbox_stats;
+        Gtk::VPaned vpane_stats;
+        Gtk::ScrolledWindow sw_stats_port;
+        Gtk::TreeView tv_stats_port;
+        Gtk::ScrolledWindow sw_stats_buffer;
+        Gtk::TreeView tv_stats_buffer;
+        Gtk::Label lbl_stats_jobs;
+        Gtk::HButtonBox bbox_stats;
+        Gtk::Button btn_stats_refresh;
+        Gtk::Button btn_stats_reset;
+        Gtk::Button btn_stats_clear;
         // packet builder
         Gtk::VBox vbox_pkt_builder;
         Gtk::VPaned vpane_pkt_builder;
@@ -163,6 +312,8 @@ protected:
         
         XGInterface xg_int;
         
+        XBootUploader uploader;
+        
         std::deque<char> read_data_queue;
         
         